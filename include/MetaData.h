@@ -1,24 +1,53 @@
 #pragma once
+#include "bitmap.h"
+#include "extent_index.h"
 #include "types/ext4_super.h"
 #include "types/hdd_super.h"
+#include <atomic>
 #include <cassert>
 #include <cstdint>
 #include <cstring>
 #include <fcntl.h>
-#include <shared_mutex>
+#include <memory>
+#include <mutex>
 #include <stdint.h>
 #include <sys/types.h>
+#include <utility>
 #include <vector>
 
 #define BOOT_SECTOR_SIZE 0x400
+
+// where new data blocks go, AUTO places them by logical block number
+enum class Tier : uint8_t { AUTO, SSD, HDD };
+
 class MetaDataManager {
 public:
   static MetaDataManager &get_instance();
   void super_block_fill();
   void gdt_fill();
 
-  // hdd disk
+  // ssd disk, mirror the metadata and stripe the blocks over the ssd files;
+  // the layout is set before any metadata past the super block is read
+  void ssd_layout_init();
+  // number of ssd files the ssd blocks are spread over
+  uint32_t ssd_device_count();
+  // sorted [begin, end) ranges of the fixed ssd metadata blocks
+  void ssd_metadata_ranges(std::vector<std::pair<uint64_t, uint64_t>> &ranges);
+  // with sparse_super only some groups keep a copy of the super block
+  bool group_has_super(uint32_t group_id);
+
+  // hdd disk, initialized at the first mount
   void hdd_disk_init();
+  // load the hdd metadata, return false if the hdd is not initialized
+  bool hdd_disk_load();
+  // number of hdd files the hdd groups are striped over
+  uint32_t hdd_device_count();
+  // some blocks are beyond the reach of a 32 bit narrow address
+  bool wide_pblocks();
+
+  // journal location recorded in the super block
+  bool journal_location(uint32_t &pblock, uint32_t &blocks);
+  void set_journal_location(uint32_t pblock, uint32_t blocks);
 
   // super block stat
   uint32_t block_size();
@@ -33,25 +62,101 @@ public:
   off_t inode_table_entry_offset(uint32_t inode_idx);
 
   // return new ssd block idx
-  uint32_t alloc_new_pblock(uint32_t lblock);
-  uint32_t alloc_new_ssd_pblock();
-  uint32_t alloc_new_hdd_pblock();
-  uint32_t get_new_inode_idx();
-  void free_pblock(const std::vector<uint32_t> &pblock_vec);
-  void free_inode(uint32_t inode_idx);
+  pblock_t alloc_new_pblock(uint32_t lblock);
+  pblock_t alloc_new_ssd_pblock();
+  pblock_t alloc_new_hdd_pblock();
+  // allocate count blocks for [lblock, lblock + count), as contiguous as
+  // possible; hdd blocks start at goal if it is free
+  void alloc_new_pblocks(uint32_t lblock, uint32_t count,
+                         std::vector<pblock_t> &pblock_vec,
+                         Tier tier = Tier::AUTO, pblock_t goal = 0);
+  // metadata blocks, they may use the ssd space reserved for the metadata
+  void alloc_new_ssd_pblocks(uint32_t count, std::vector<pblock_t> &pblock_vec);
+  void alloc_new_hdd_pblocks(uint32_t count, std::vector<pblock_t> &pblock_vec,
+                             pblock_t goal = 0);
+  // length of the largest free hdd extent
+  uint64_t hdd_largest_extent();
+  uint64_t hdd_free_blocks();
+
+  // ssd space; the watermarks and the metadata reserve are percents of the
+  // ssd blocks. Above the high watermark new data goes to the hdd, the
+  // demoter then moves data off the ssd until the low watermark.
+  void set_ssd_watermarks(uint32_t high, uint32_t low, uint32_t reserve);
+  uint64_t ssd_free_blocks();
+  // ssd blocks data of the tier may still take
+  uint64_t ssd_data_quota(Tier tier);
+  // blocks to move off the ssd, 0 until the high watermark is crossed
+  uint64_t ssd_demote_target();
+  uint32_t inodes_count();
+  // the inode is placed near its parent directory, see find_inode_group
+  uint32_t get_new_inode_idx(uint32_t parent_idx, bool dir);
+  void free_pblock(const std::vector<pblock_t> &pblock_vec);
+  // free at once, bypassing the journal's deferred free
+  void free_pblock_now(const std::vector<pblock_t> &pblock_vec);
+  void free_inode(uint32_t inode_idx, bool dir = false);
+  bool inode_in_use(uint32_t inode_idx);
+  // append the inodes of the group in use, one bitmap read for the group
+  void group_inodes_in_use(uint32_t group_id,
+                           std::vector<uint32_t> &inode_vec);
+  // free a batch of inodes with one pass over the bitmaps of each group,
+  // dir_vec lists the directories among inode_vec
+  void free_inodes(const std::vector<uint32_t> &inode_vec,
+                   const std::vector<uint32_t> &dir_vec = {});
+
+  // while a goal is alive, the ssd blocks allocated by the thread go to the
+  // group of the inode first
+  class Goal {
+  public:
+    explicit Goal(uint32_t inode_idx);
+    ~Goal();
+    Goal(const Goal &) = delete;
+    Goal &operator=(const Goal &) = delete;
+
+  private:
+    uint32_t saved_;
+  };
+
+  // tier of the blocks preallocated by fallocate when the inode has no hint
+  void set_fallocate_tier(Tier tier);
+  Tier fallocate_tier();
 
   // stat
   void log_hdd_stat();
 
 private:
+  friend class FsChecker;
+
   ext4_super_block super_;
   std::vector<ext4_group_desc> gdt_table_;
 
   hdd_super_block hdd_super_;
   std::vector<hdd_group_desc> hdd_gdt_table_;
   
-  mutable std::shared_mutex ssd_mutex_;
-  mutable std::shared_mutex hdd_mutex_;
+  // one lock per group covers its bitmaps and descriptor
+  std::unique_ptr<std::mutex[]> ssd_group_mutex_;
+  std::unique_ptr<std::mutex[]> hdd_group_mutex_;
+  // free extents of the hdd, the mutex is never taken with a group held
+  ExtentIndex hdd_extents_;
+  std::mutex hdd_extent_mutex_;
+
+  // range of a group a thread allocates from before taking the next chunk
+  struct AllocWindow {
+    uint32_t group = 0;
+    uint32_t begin = 0;
+    uint32_t end = 0;
+  };
+  static thread_local AllocWindow ssd_window_;
+  static thread_local AllocWindow inode_window_;
+  static thread_local uint32_t goal_group_;
+  std::atomic<uint64_t> ssd_cursor_{0};
+  // sum of the free counts of the ssd groups
+  std::atomic<uint64_t> ssd_free_blocks_{0};
+  uint32_t ssd_high_ = 90;
+  uint32_t ssd_low_ = 80;
+  uint32_t ssd_reserve_ = 2;
+  std::atomic<uint64_t> inode_cursor_{0};
+
+  Tier fallocate_tier_ = Tier::AUTO;
 
   MetaDataManager() = default;
 
@@ -59,16 +164,47 @@ private:
   uint32_t block_groups_count();
   uint64_t block_group_size();
   uint32_t group_desc_size();
+  uint32_t hdd_blocks_per_group();
   
   // private gdt stat
   off_t gdt_table_entry_offset(uint32_t group_idx);
+  void gdt_write_back(uint32_t first_group, uint32_t last_group);
   uint64_t get_block_bitmap_free_block_count(uint32_t group_idx);
   uint64_t get_inode_bitmap_free_block_count(uint32_t group_idx);
   void inc_block_bitmap_free_block_count(uint32_t group_idx);
   void set_block_bitmap_free_block_count(uint32_t group_idx, uint64_t free_block_count);
   void set_inode_bitmap_free_block_count(uint32_t group_idx, uint64_t free_block_count);
+  uint32_t get_used_dirs_count(uint32_t group_idx);
+  void set_used_dirs_count(uint32_t group_idx, uint32_t used_dirs_count);
   uint64_t block_bitmap_block_idx(uint32_t group_idx);
   uint64_t inode_bitmap_block_idx(uint32_t group_idx);
+  uint64_t inode_table_block_idx(uint32_t group_idx);
+  pblock_t hdd_bitmap_block_idx(uint32_t group_idx);
+  void hdd_gdt_write_back(uint32_t first_group, uint32_t last_group);
+
+  // allocate bits in [begin_idx, end_idx) of a loaded bitmap, preferring one
+  // run of count bits
+  uint32_t alloc_bitmap_run(Bitmap &bitmap, uint32_t begin_idx,
+                            uint32_t end_idx, uint32_t count,
+                            uint64_t free_count, uint64_t base,
+                            std::vector<pblock_t> &pblock_vec);
+
+  // per-thread allocation windows
+  static void next_window(AllocWindow &window, std::atomic<uint64_t> &cursor,
+                          uint32_t groups, uint32_t group_size,
+                          uint32_t chunk);
+  uint32_t alloc_in_group(uint32_t group_id, uint32_t begin, uint32_t end,
+                          uint32_t count, std::vector<pblock_t> &pblock_vec);
+  // allocate up to count ssd blocks, return the number allocated
+  uint32_t try_alloc_ssd_pblocks(uint32_t count,
+                                 std::vector<pblock_t> &pblock_vec);
+
+  // hdd free extents
+  void build_hdd_extents();
+  void mark_hdd_used(uint64_t start, uint64_t len);
+  uint32_t find_inode_group(uint32_t parent_idx, bool dir);
+  bool alloc_inode_in_group(uint32_t group_id, uint32_t begin, uint32_t end,
+                            bool dir, uint32_t &idx);
 
   
 };
\ No newline at end of file
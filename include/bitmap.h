@@ -10,23 +10,42 @@ public:
   Bitmap(uint32_t block_size) {
     assert(block_size % sizeof(uint32_t) == 0);
     buf_ = std::vector<uint32_t>(block_size / sizeof(uint32_t), 0);
-    size_ = block_size * sizeof(uint32_t) * 8;
+    mapped_ = nullptr;
+    size_ = block_size * 8;
   }
 
-  void load(uint32_t bitmap_pblock) {
-    GET_INSTANCE(DiskManager).disk_block_read(buf_.data(), bitmap_pblock);
+  void load(pblock_t bitmap_pblock) {
+    if (map(bitmap_pblock))
+      return;
+    GET_INSTANCE(DiskManager).metadata_block_read(buf_.data(), bitmap_pblock);
   }
 
-  void save(uint32_t bitmap_pblock) {
-    GET_INSTANCE(DiskManager).disk_block_write(buf_.data(), bitmap_pblock);
+  void save(pblock_t bitmap_pblock) {
+    if (mapped()) {
+      GET_INSTANCE(DiskManager)
+          .metadata_mark_dirty((off_t)bitmap_pblock * bytes(), bytes());
+      return;
+    }
+    GET_INSTANCE(DiskManager).metadata_block_write(buf_.data(), bitmap_pblock);
   }
 
+  // operate on the mmap-backed metadata directly if possible
+  bool map(pblock_t bitmap_pblock) {
+    void *ptr = GET_INSTANCE(DiskManager).metadata_block_ptr(bitmap_pblock);
+    if (ptr == nullptr)
+      return false;
+    mapped_ = (uint32_t *)ptr;
+    return true;
+  }
+
+  bool mapped() { return mapped_ != nullptr; }
+
   bool lookup(uint32_t bitmap_idx) {
     assert(bitmap_idx < size_);
 
     uint32_t index = bitmap_idx / (sizeof(uint32_t) * 8);
     uint32_t bit_index = bitmap_idx % (sizeof(uint32_t) * 8);
-    return buf_[index] & (1 << bit_index);
+    return words()[index] & (1 << bit_index);
   }
 
   void set(uint32_t bitmap_idx) {
@@ -34,7 +53,7 @@ public:
 
     uint32_t index = bitmap_idx / (sizeof(uint32_t) * 8);
     uint32_t bit_index = bitmap_idx % (sizeof(uint32_t) * 8);
-    buf_[index] |= 1 << bit_index;
+    words()[index] |= 1 << bit_index;
   }
 
   void unset(uint32_t bitmap_idx) {
@@ -42,14 +61,34 @@ public:
 
     uint32_t index = bitmap_idx / (sizeof(uint32_t) * 8);
     uint32_t bit_index = bitmap_idx % (sizeof(uint32_t) * 8);
-    buf_[index] &= ~(1 << bit_index);
+    words()[index] &= ~(1 << bit_index);
+  }
+
+  // find the first free run at or after begin, at most max_len bits long;
+  // return size() if there is no free bit left
+  uint32_t find_free_run(uint32_t begin, uint32_t max_len, uint32_t &run_len) {
+    uint32_t i = begin;
+    while (i < size_ && lookup(i))
+      i++;
+
+    run_len = 0;
+    while (i + run_len < size_ && run_len < max_len && !lookup(i + run_len))
+      run_len++;
+    return i;
   }
 
   uint32_t size() {
     return size_;
   }
 
+  void *data() { return words(); }
+
+  size_t bytes() { return buf_.size() * sizeof(uint32_t); }
+
 private:
+  uint32_t *words() { return mapped_ != nullptr ? mapped_ : buf_.data(); }
+
   std::vector<uint32_t> buf_;
+  uint32_t *mapped_;
   uint32_t size_;
 };
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// O_DIRECT requires the buffer, offset and length aligned to this
+#define DIRECT_IO_ALIGN 4096
+
+// Reusable aligned buffers for O_DIRECT block I/O
+class AlignedBufferPool {
+public:
+  static AlignedBufferPool &get_instance();
+
+  // size is rounded up to DIRECT_IO_ALIGN
+  void *get(size_t size);
+  void put(void *buf, size_t size);
+
+private:
+  std::unordered_map<size_t, std::vector<void *>> free_bufs_;
+  std::mutex mutex_;
+
+  AlignedBufferPool() = default;
+  ~AlignedBufferPool();
+};
+
+// Aligned buffer borrowed from the pool for the current scope
+class AlignedBuffer {
+public:
+  AlignedBuffer(size_t size)
+      : size_(size), buf_(AlignedBufferPool::get_instance().get(size)) {}
+  ~AlignedBuffer() { AlignedBufferPool::get_instance().put(buf_, size_); }
+
+  AlignedBuffer(const AlignedBuffer &) = delete;
+  AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+  std::byte *data() { return (std::byte *)buf_; }
+
+private:
+  size_t size_;
+  void *buf_;
+};
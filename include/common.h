@@ -12,6 +12,8 @@
 
 #define GET_INSTANCE(X) X::get_instance()
 
+#define ROOT_INODE 2
+
 #include "types/ext4_dentry.h"
 #include "types/ext4_inode.h"
 #include <cassert>
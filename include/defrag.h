@@ -0,0 +1,70 @@
+#pragma once
+
+#include "disk.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <sys/ioctl.h>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+// defragment the open file in the background
+#define HYBRID_IOC_DEFRAG _IO('h', 1)
+
+// number of inode locks, inodes share them by hashing
+#define DEFRAG_LOCKS 256
+
+// Online defragmentation of the hdd blocks of files. A background thread
+// moves the fragmented hdd runs of a queued file into contiguous free
+// extents a chunk at a time, throttled to a configured rate. The blocks of a
+// file pinned to a tier which lie on the other tier are moved as well. File
+// data is accessed under the shared lock of the inode while a chunk is moved
+// under the exclusive one, so readers and writers only see the block map
+// before or after the move.
+class DefragManager {
+public:
+  static DefragManager &get_instance();
+
+  // bytes copied per second, 0 means unlimited
+  void set_rate(uint64_t rate);
+  void start();
+  void shutdown();
+  // return false if the file is queued already
+  bool enqueue(uint32_t inode_idx);
+  // move the ssd data blocks of a file which is not pinned to the ssd to the
+  // hdd in the calling thread, return the number of blocks moved
+  uint64_t demote_file(uint32_t inode_idx);
+
+  std::shared_mutex &inode_lock(uint32_t inode_idx);
+  // shared locks of every inode, for the operations touching a whole tree
+  std::vector<std::shared_lock<std::shared_mutex>> lock_all();
+
+private:
+  uint64_t rate_;
+  std::shared_mutex inode_locks_[DEFRAG_LOCKS];
+
+  std::deque<uint32_t> queue_;
+  std::unordered_set<uint32_t> queued_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+  bool running_;
+  bool stop_;
+
+  DefragManager();
+
+  void defrag_thread();
+  void defrag_file(uint32_t inode_idx);
+  // move the fragmented hdd runs and the misplaced blocks in [lblock,
+  // lblock + count), with demote the ssd blocks of an unpinned file are
+  // misplaced and the hdd runs are left alone; goal is the block after the
+  // last hdd block seen; return the bytes copied, or -1 if the file is gone
+  int64_t defrag_chunk(uint32_t inode_idx, uint32_t lblock, uint32_t count,
+                       pblock_t &goal, bool demote = false);
+  // sleep until the copied bytes fit the rate, return false on shutdown
+  bool throttle(std::chrono::steady_clock::time_point begin, uint64_t bytes);
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Demotion of ssd data to the hdd. Once the ssd fills past its high
+// watermark, a background thread sweeps the inode table like a clock hand
+// and moves the ssd data blocks of the files it meets to the hdd, until the
+// ssd is back under the low watermark. Files pinned to the ssd are skipped.
+// A sweep that moves nothing is not repeated until the target changes.
+class DemoteManager {
+public:
+  static DemoteManager &get_instance();
+
+  void start();
+  void shutdown();
+  // the ssd may be over its high watermark
+  void wake();
+
+private:
+  // next inode the sweep looks at
+  uint32_t cursor_;
+  // target of the last sweep that moved nothing, 0 if it moved blocks
+  uint64_t idle_target_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+  bool running_;
+  bool stop_;
+  bool woken_;
+
+  DemoteManager();
+
+  void demote_thread();
+  // move up to about count blocks off the ssd in one sweep at most, return
+  // the number of blocks moved
+  uint64_t demote(uint64_t count);
+};
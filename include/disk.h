@@ -1,40 +1,204 @@
 #pragma once
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <shared_mutex>
 #include <string>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
 #include <vector>
 
-#define HDD_MASK ((uint32_t)1 << 31)
-#define HDD_BLOCK_IDX(__blk) (__blk | HDD_MASK)
+// Physical block address, the top bit tags the hdd tier
+using pblock_t = uint64_t;
+
+#define HDD_MASK ((pblock_t)1 << 63)
+#define HDD_BLOCK_IDX(__blk) ((pblock_t)(__blk) | HDD_MASK)
+
+// The narrow on-disk form of an address is 32 bits with the tier tag in bit
+// 31, it is kept by block maps and fragment locations written before the
+// addresses were widened, and by every narrow inode.
+#define HDD_MASK32 ((uint32_t)1 << 31)
+
+inline bool pblock_fits32(pblock_t pblock) {
+  return (pblock & ~HDD_MASK) < HDD_MASK32;
+}
+
+inline uint32_t pblock_to32(pblock_t pblock) {
+  assert(pblock_fits32(pblock));
+  return (pblock & HDD_MASK) != 0 ? (uint32_t)pblock | HDD_MASK32
+                                  : (uint32_t)pblock;
+}
+
+inline pblock_t pblock_from32(uint32_t pblock32) {
+  return (pblock32 & HDD_MASK32) != 0 ? HDD_BLOCK_IDX(pblock32 & ~HDD_MASK32)
+                                      : pblock32;
+}
+
+// A worker thread running the I/Os of one hdd, so the I/Os to different
+// spindles overlap
+class IoQueue {
+public:
+  IoQueue();
+  ~IoQueue();
+  void push(std::function<void()> io);
+
+private:
+  std::deque<std::function<void()>> ios_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_;
+  std::thread thread_;
+
+  void run();
+};
 
 class DiskManager {
 public:
   static DiskManager &get_instance();
 
-  void disk_open(std::string ssd_filename, std::string hdd_filename);
+  // the ssd blocks are striped over the ssd files and the fixed metadata
+  // has a second copy on the next ssd; the hdd block groups are
+  // round-robined over the hdd files; read_only opens the files read-only
+  // and leaves an uninitialized hdd as it is
+  void disk_open(const std::vector<std::string> &ssd_filenames,
+                 const std::vector<std::string> &hdd_filenames,
+                 bool direct_io = false, bool read_only = false);
   void set_disk_block_size(uint32_t block_size);
+  uint32_t ssd_count();
+  uint32_t hdd_count();
+
+  // Until the layout is set, all the ssd I/O goes to the first ssd file.
+  // blocks_count is the size of the ssd address space, metadata holds the
+  // sorted [begin, end) ranges of fixed metadata blocks to mirror.
+  void set_ssd_layout(uint64_t blocks_count,
+                      const std::vector<std::pair<uint64_t, uint64_t>> &metadata);
+  // copy blocks written with a single ssd from the first ssd file to their
+  // place in the current layout
+  void ssd_spread(const std::vector<uint64_t> &blocks);
 
   ssize_t metadata_read(void *buf, size_t nbyte, off_t offset);
   ssize_t metadata_write(const void *buf, size_t nbyte, off_t offset);
 
-  ssize_t disk_read(void *buf, size_t nbyte, uint32_t pblock,
+  // metadata blocks on either disk, journaled when the journal is active
+  ssize_t metadata_read(void *buf, size_t nbyte, pblock_t pblock,
+                        off_t pblock_offset);
+  ssize_t metadata_write(const void *buf, size_t nbyte, pblock_t pblock,
+                         off_t pblock_offset);
+  ssize_t metadata_block_read(void *buf, pblock_t pblock);
+  ssize_t metadata_block_write(const void *buf, pblock_t pblock);
+  ssize_t metadata_block_readv(const std::vector<iovec> &iov, pblock_t pblock);
+  ssize_t metadata_block_writev(const std::vector<iovec> &iov, pblock_t pblock);
+
+  // mmap-backed metadata, the pointers are nullptr outside the mapped
+  // ranges or when the metadata is not mapped
+  void set_metadata_mmap(bool enabled);
+  bool metadata_mmap_enabled();
+  // map the ssd block ranges [first, second) of the fixed metadata
+  void metadata_mmap(const std::vector<std::pair<uint64_t, uint64_t>> &ranges);
+  void *metadata_ptr(off_t offset, size_t nbyte);
+  void *metadata_block_ptr(pblock_t pblock);
+  void metadata_mark_dirty(off_t offset, size_t nbyte);
+  void metadata_sync();
+
+  // make all the written data durable on every device
+  void disk_sync();
+
+  ssize_t disk_read(void *buf, size_t nbyte, pblock_t pblock,
                     off_t pblock_offset);
-  ssize_t disk_block_read(void *buf, uint32_t pblock);
-  ssize_t disk_write(const void *buf, size_t nbyte, uint32_t pblock,
+  ssize_t disk_block_read(void *buf, pblock_t pblock);
+  ssize_t disk_write(const void *buf, size_t nbyte, pblock_t pblock,
                      off_t pblock_offset);
-  ssize_t disk_block_write(const void *buf, uint32_t pblock);
+  ssize_t disk_block_write(const void *buf, pblock_t pblock);
+
+  // vectored I/O over consecutive blocks starting at pblock
+  ssize_t disk_block_readv(const std::vector<iovec> &iov, pblock_t pblock);
+  ssize_t disk_block_writev(const std::vector<iovec> &iov, pblock_t pblock);
+  // runs of consecutive blocks, the parts on different devices are done in
+  // parallel
+  void disk_block_submit(
+      const std::vector<std::pair<pblock_t, std::vector<iovec>>> &runs,
+      bool write);
 
 private:
-  int ssd_fd_, hdd_fd_;
+  // a backing file of one tier
+  struct Device {
+    int fd;
+    std::unique_ptr<std::shared_mutex> mutex;
+    std::unique_ptr<IoQueue> queue;
+  };
+
+  // part of an I/O which falls on one device
+  struct IoSegment {
+    Device *dev;
+    off_t offset;
+    std::vector<iovec> iov;
+  };
+
+  std::vector<Device> ssds_;
+  std::vector<Device> hdds_;
   uint32_t block_size_;
+  bool direct_io_;
 
-  mutable std::shared_mutex hdd_mutex_;
-  mutable std::shared_mutex ssd_mutex_;
+  // a mirrored range, rank[d] counts the mirrored blocks of ssd d before it
+  struct MirrorRange {
+    uint64_t begin, end;
+    std::vector<uint64_t> rank;
+  };
+  std::vector<MirrorRange> ssd_mirror_;
+  // blocks of the stripes on each ssd, the mirror copies come after them
+  uint64_t ssd_stripe_blocks_;
+  bool ssd_layout_set_;
+  // mirrored reads alternate between the two copies
+  std::atomic<uint32_t> mirror_next_;
+
+  // a mapped metadata range, in bytes of the ssd file
+  struct MappedRange {
+    off_t begin, end;
+    std::byte *addr;
+  };
+  // dirty range is flushed by metadata_sync
+  bool mmap_enabled_;
+  std::vector<MappedRange> metadata_maps_;
+  off_t dirty_begin_, dirty_end_;
+  std::mutex dirty_mutex_;
 
   DiskManager();
 
+  // every I/O to a disk goes through these, handling O_DIRECT alignment
+  ssize_t dev_pread(int fd, std::shared_mutex &mutex, void *buf, size_t nbytes,
+                    off_t offset);
+  ssize_t dev_pwrite(int fd, std::shared_mutex &mutex, const void *buf,
+                     size_t nbytes, off_t offset);
+  ssize_t dev_preadv(int fd, std::shared_mutex &mutex,
+                     const std::vector<iovec> &iov, off_t offset);
+  ssize_t dev_pwritev(int fd, std::shared_mutex &mutex,
+                      const std::vector<iovec> &iov, off_t offset);
+
+  void open_devices(const std::vector<std::string> &filenames, int flags,
+                    std::vector<Device> &devs, uint64_t &min_size);
+
+  // map an I/O on a tier address space to the devices
+  const MirrorRange *ssd_mirror_range(uint64_t block);
+  // blocks of [0, block) striped onto ssd dev, for a block of dev this is
+  // its offset on the device
+  uint64_t ssd_dev_blocks(uint32_t dev, uint64_t block);
+  // without mirror only the striped copy of the metadata is used
+  void ssd_split(const std::vector<iovec> &iov, off_t offset, bool write,
+                 std::vector<IoSegment> &segments, bool mirror = true);
+  void hdd_split(const std::vector<iovec> &iov, off_t offset,
+                 std::vector<IoSegment> &segments);
+  // the segments on different devices are done in parallel
+  void run_segments(std::vector<IoSegment> &segments, bool write);
+  ssize_t tier_preadv(bool hdd, const std::vector<iovec> &iov, off_t offset);
+  ssize_t tier_pwritev(bool hdd, const std::vector<iovec> &iov, off_t offset);
+
   ssize_t hdd_disk_read(void *buf, size_t nbyte, off_t offset);
   ssize_t hdd_disk_block_read(void *buf, uint64_t block_idx);
   ssize_t ssd_disk_read(void *buf, size_t nbyte, off_t offset);
@@ -44,4 +208,28 @@ private:
   ssize_t hdd_disk_block_write(const void *buf, uint64_t block_idx);
   ssize_t ssd_disk_write(const void *buf, size_t nbyte, off_t offset);
   ssize_t ssd_disk_block_write(const void *buf, uint64_t block_idx);
-};
\ No newline at end of file
+};
+
+// Collect block I/Os and merge the ones to consecutive pblocks on the same
+// disk into a single vectored I/O. Only the last block of a run may be
+// partial.
+class BlockIoBatch {
+public:
+  BlockIoBatch(uint32_t block_size) : block_size_(block_size) {}
+
+  void add(pblock_t pblock, void *buf, size_t nbyte);
+  void add(pblock_t pblock, const void *buf, size_t nbyte);
+  void read();
+  void write();
+
+private:
+  struct BlockIo {
+    pblock_t pblock;
+    iovec iov;
+  };
+
+  uint32_t block_size_;
+  std::vector<BlockIo> ios_;
+
+  void submit(bool write);
+};
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <utility>
+
+// In-memory index of the free extents of a block space. Extents are kept by
+// offset, so that a freed range merges with its neighbours, and by length,
+// so that a request finds the smallest extent holding it in O(log n). The
+// caller serializes the access.
+class ExtentIndex {
+public:
+  void clear();
+  // [start, start + len) becomes free
+  void insert(uint64_t start, uint64_t len);
+  // Take up to count blocks: continue the extent holding goal if there is
+  // one, otherwise the smallest extent holding count blocks, otherwise the
+  // largest extent. Return false if nothing is free.
+  bool alloc(uint64_t count, uint64_t goal, uint64_t &start, uint64_t &len);
+
+  uint64_t free_blocks() const { return free_blocks_; }
+  size_t extent_count() const { return by_offset_.size(); }
+  uint64_t largest() const;
+
+private:
+  // start -> length
+  std::map<uint64_t, uint64_t> by_offset_;
+  // (length, start)
+  std::set<std::pair<uint64_t, uint64_t>> by_size_;
+  uint64_t free_blocks_ = 0;
+
+  void add(uint64_t start, uint64_t len);
+  void remove(std::map<uint64_t, uint64_t>::iterator it);
+  // take [start, start + len) out of the extent it lies in
+  void carve(std::map<uint64_t, uint64_t>::iterator it, uint64_t start,
+             uint64_t len);
+};
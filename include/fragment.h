@@ -0,0 +1,37 @@
+#pragma once
+
+#include "disk.h"
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+// Sub-block allocator packing small files into shared SSD blocks
+class FragmentManager {
+public:
+  static FragmentManager &get_instance();
+
+  uint32_t frag_size();
+  // the largest file which is packed, larger files use whole blocks
+  uint32_t max_frag_bytes();
+  uint32_t bytes_to_frags(uint64_t bytes);
+
+  // allocate count consecutive fragments and zero them
+  void alloc(uint32_t count, pblock_t &pblock, uint32_t &start);
+  // with the journal, the run is only reused once the transaction dropping
+  // the reference to it is committed
+  void free(pblock_t pblock, uint32_t start, uint32_t count);
+  void free_now(pblock_t pblock, uint32_t start, uint32_t count);
+  // rebuild the partial packed blocks from the inodes at mount
+  void load();
+
+private:
+  // in-memory map of the packed blocks which still have free fragments,
+  // pblock -> used fragments bitmap
+  std::map<pblock_t, uint32_t> partial_blocks_;
+  std::mutex mutex_;
+
+  FragmentManager() = default;
+
+  uint32_t load_used(pblock_t pblock);
+  void save_used(pblock_t pblock, uint32_t used);
+};
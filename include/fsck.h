@@ -0,0 +1,50 @@
+#pragma once
+
+#include "disk.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Offline consistency checker. The inode tables and block maps of all the
+// block groups are walked in parallel to rebuild the ssd and hdd block
+// bitmaps, which are then compared with (and optionally written over) the
+// ones on disk together with the free counts in the gdt.
+class FsChecker {
+public:
+  FsChecker(uint32_t threads, bool repair);
+
+  // return the number of problems found
+  uint64_t check();
+
+private:
+  // one bit per block, set concurrently by the scanning threads
+  using UsedMap = std::vector<std::atomic<uint32_t>>;
+
+  uint32_t threads_;
+  bool repair_;
+
+  uint32_t block_size_;
+  uint64_t ssd_blocks_;
+  uint64_t hdd_blocks_;
+  UsedMap ssd_used_;
+  UsedMap hdd_used_;
+  std::vector<uint32_t> inode_free_;
+  std::vector<uint32_t> used_dirs_;
+
+  std::atomic<uint64_t> problems_;
+  std::atomic<uint64_t> inodes_;
+  std::atomic<uint64_t> blocks_;
+
+  void parallel_for(uint32_t n, const std::function<void(uint32_t)> &fn);
+  // shared blocks such as packed fragment blocks may be claimed many times
+  void mark(pblock_t pblock, bool shared);
+  void mark_metadata();
+  void scan_group(uint32_t group_id);
+  void check_ssd_group(uint32_t group_id);
+  void check_hdd_group(uint32_t group_id);
+  // compare count bits of the rebuilt map with the disk bitmap, return the
+  // number of used blocks
+  uint32_t compare_bitmap(const std::atomic<uint32_t> *used, uint32_t *disk,
+                          uint32_t count, bool hdd, uint32_t group_id);
+};
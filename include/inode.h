@@ -2,12 +2,17 @@
 #include "MetaData.h"
 #include "bitmap.h"
 #include "common.h"
+#include "disk.h"
 #include "types/ext4_dentry.h"
 #include "types/ext4_inode.h"
+#include <array>
 #include <cstddef>
 #include <cstdint>
 #include <fcntl.h>
+#include <list>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 struct DirCtx {
@@ -18,17 +23,41 @@ struct DirCtx {
   ~DirCtx() { delete[] buf; }
 };
 
+// index block pblock -> index block content
+using IndexCache = std::unordered_map<pblock_t, std::vector<pblock_t>>;
+
+// shape of the block map of an inode
+struct BlockMapLayout {
+  bool wide;
+  uint32_t ndir;      // direct blocks in i_block
+  uint32_t levels;    // index trees of depth 1 to levels follow them
+  uint64_t per_block; // entries per index block
+};
+
+// the reads and updates of the inodes hashed to one slot share a generation
+#define INODE_GEN_SLOTS 4096
+
 struct InodeCtx {
   bool dirty;
   ext4_inode inode;
+  // place in the lru list of the cache
+  std::list<uint32_t>::iterator lru;
 };
 
 class InodeManager {
 public:
   static InodeManager &get_instance();
   int init();
+  // the sizes read from the super block, enough to read inodes offline
+  void load_layout();
   int get_inode_by_path(const std::string &path, ext4_inode &inode);
   int get_inode_by_idx(uint32_t n, ext4_inode &res);
+  // inodes missing in the cache are read in batches per inode table
+  void get_inodes(const std::vector<uint32_t> &idx_vec,
+                  std::vector<ext4_inode> &res);
+  void evict_inode(uint32_t inode_idx);
+  // read the inode table blocks holding idx_vec into the cache
+  void prefetch_inodes(const std::vector<uint32_t> &idx_vec);
   ext4_dir_entry_2 *get_dentry(const ext4_inode &inode, off_t offset,
                                DirCtx &ctx);
   uint32_t get_idx_by_path(const std::string &path);
@@ -40,9 +69,54 @@ public:
   void set_file_blocks_count(ext4_inode &inode, uint32_t new_blocks_count);
 
   // file datablock
-  uint32_t get_data_pblock(const ext4_inode &inode, uint32_t lblock);
-  void set_data_pblock(ext4_inode &inode, uint32_t lblock, uint32_t pblock);
-  void collect_file_pblock(ext4_inode &inode, std::vector<uint32_t> &pblock_vec);
+  pblock_t get_data_pblock(const ext4_inode &inode, uint32_t lblock);
+  void set_data_pblock(ext4_inode &inode, uint32_t lblock, pblock_t pblock);
+  void get_data_pblocks(const ext4_inode &inode, uint32_t lblock,
+                        uint32_t count, std::vector<pblock_t> &pblock_vec);
+  void alloc_data_pblocks(ext4_inode &inode, uint32_t lblock, uint32_t count,
+                          Tier tier = Tier::AUTO);
+  // tier requested by the inode flags
+  Tier tier_hint(const ext4_inode &inode);
+  void set_tier_hint(ext4_inode &inode, Tier tier);
+  uint64_t max_file_size();
+  void collect_file_pblock(ext4_inode &inode, std::vector<pblock_t> &pblock_vec);
+
+  // inline data
+  bool is_inline(const ext4_inode &inode);
+  size_t read_inline(const ext4_inode &inode, char *buf, size_t size,
+                     off_t offset);
+  bool write_inline(ext4_inode &inode, const char *buf, size_t size,
+                    off_t offset);
+  void spill_inline(ext4_inode &inode);
+
+  // packed small file
+  bool is_frag(const ext4_inode &inode);
+  size_t read_frag(const ext4_inode &inode, char *buf, size_t size,
+                   off_t offset);
+  bool write_frag(ext4_inode &inode, const char *buf, size_t size,
+                  off_t offset);
+  bool pack_inline(ext4_inode &inode, uint64_t new_size);
+  void spill_frag(ext4_inode &inode);
+  void free_frag(ext4_inode &inode);
+
+  // block range operations
+  void truncate(uint32_t inode_idx, ext4_inode &inode, uint64_t new_size);
+  // free the last max_blocks blocks of a shrinking file and lower its size
+  // to match; return false, doing nothing, once at most max_blocks are left
+  // past new_size
+  bool truncate_tail(uint32_t inode_idx, ext4_inode &inode, uint64_t new_size,
+                     uint32_t max_blocks);
+  void preallocate(ext4_inode &inode, uint64_t offset, uint64_t len,
+                   bool keep_size);
+  void punch_hole(uint32_t inode_idx, ext4_inode &inode, uint64_t offset,
+                  uint64_t len);
+  // free the blocks mapped in [lblock, lblock + count) and the index blocks
+  // left empty
+  void free_data_range(ext4_inode &inode, uint32_t lblock, uint64_t count);
+  // first offset at or after offset which is in data (or in a hole), the end
+  // of file counts as a hole; return -ENXIO if there is no data left
+  off_t seek_data(uint32_t inode_idx, const ext4_inode &inode, uint64_t offset,
+                  bool data);
 
   // create file
   void add_dentry(ext4_inode &prefix_inode, const ext4_dir_entry_2 &new_dentry);
@@ -58,17 +132,51 @@ private:
   size_t inode_size_;
   InodeManager() = default;
 
+  // write-through inode cache, the least recently used inode is evicted
+  // first; inode_lru_ is ordered from the most recently used
+  std::unordered_map<uint32_t, InodeCtx> inode_cache_;
+  std::list<uint32_t> inode_lru_;
+  // bumped by every update and eviction, a read from disk is only cached if
+  // the generation of its slot did not change while it was read
+  std::array<uint64_t, INODE_GEN_SLOTS> inode_gen_{};
+  std::mutex inode_cache_mutex_;
+  void cache_inode(uint32_t inode_idx, const ext4_inode &inode, bool update,
+                   uint64_t gen = 0);
+
   // data block function
-  uint32_t get_data_pblock_ind(uint32_t lblock, uint32_t index_block);
-  uint32_t get_data_pblock_dind(uint32_t lblock, uint32_t dindex_block);
-  uint32_t get_data_pblock_tind(uint32_t lblock, uint32_t tindex_block);
-  void set_data_lblock_ind(uint32_t lblock, uint32_t index_block,
-                           uint32_t pblock);
-  void set_data_lblock_dind(uint32_t lblock, uint32_t dindex_block,
-                            uint32_t pblock);
-  void set_data_lblock_tind(uint32_t lblock, uint32_t tindex_block,
-                            uint32_t pblock);
-  void collect_file_pblock_ind(uint32_t index_block, std::vector<uint32_t> &pblock_vec);
-  void collect_file_pblock_dind(uint32_t dindex_block, std::vector<uint32_t> &pblock_vec);
-  void collect_file_pblock_tind(uint32_t tindex_block, std::vector<uint32_t> &pblock_vec);
+  BlockMapLayout map_layout(const ext4_inode &inode);
+  pblock_t map_slot(const ext4_inode &inode, uint32_t slot);
+  void set_map_slot(ext4_inode &inode, uint32_t slot, pblock_t pblock);
+  pblock_t read_index_entry(pblock_t index_pblock, uint64_t idx, bool wide);
+  void write_index_entry(pblock_t index_pblock, uint64_t idx, pblock_t pblock,
+                         bool wide);
+  void read_index(pblock_t index_pblock, bool wide,
+                  std::vector<pblock_t> &table);
+  void write_index(pblock_t index_pblock, bool wide,
+                   const std::vector<pblock_t> &table);
+  pblock_t get_index_entry(IndexCache &cache, pblock_t index_pblock,
+                           uint64_t idx, bool wide);
+  void widen_map(ext4_inode &inode);
+  void collect_index_pblock(pblock_t index_pblock, uint32_t depth, bool wide,
+                            std::vector<pblock_t> &pblock_vec);
+  bool clear_index_range(pblock_t index_pblock, uint32_t depth, bool wide,
+                         uint64_t begin, uint64_t end,
+                         std::vector<pblock_t> &pblock_vec);
+
+  // zero bytes of a file without freeing any block
+  void zero_small(ext4_inode &inode, uint64_t offset, uint64_t len);
+  void zero_partial_block(const ext4_inode &inode, uint64_t offset,
+                          uint32_t len);
+
+  // packed fragment location
+  void get_frag(const ext4_inode &inode, pblock_t &pblock, uint32_t &start,
+                uint32_t &count);
+  void set_frag(ext4_inode &inode, pblock_t pblock, uint32_t start,
+                uint32_t count);
+
+  // inline directory
+  bool add_dentry_inline(ext4_inode &prefix_inode,
+                         const ext4_dir_entry_2 &new_dentry);
+  void dir_block_write_back(ext4_inode &prefix_inode, uint32_t prefix_inode_idx,
+                            const DirCtx &ctx);
 };
\ No newline at end of file
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "disk.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Write-ahead metadata journal. Metadata writes go to an in-memory block
+// overlay instead of the disk, the blocks dirtied by the running transaction
+// are committed in batches with one sequential write to the journal and
+// written to their home location by a later checkpoint.
+class JournalManager {
+public:
+  static JournalManager &get_instance();
+
+  // every fuse operation that changes metadata holds a handle, a commit waits
+  // for the handles in flight so an operation is never split
+  class Handle {
+  public:
+    Handle();
+    ~Handle();
+    Handle(const Handle &) = delete;
+    Handle &operator=(const Handle &) = delete;
+
+  private:
+    bool locked_;
+  };
+
+  void set_enabled(bool enabled);
+  bool enabled();
+  // metadata io goes through the journal
+  bool active();
+
+  // replay the committed transactions, must run before any metadata is
+  // loaded
+  void recover();
+  // there are committed transactions recover would replay, nothing is
+  // written
+  bool needs_recovery();
+  // create the journal at the first mount and start the background commit
+  // thread
+  void start();
+  // commit and checkpoint everything, the journal is empty afterwards
+  void shutdown();
+
+  // nbyte may cross blocks, pblock_offset may exceed the block size
+  ssize_t read(void *buf, size_t nbyte, pblock_t pblock, off_t pblock_offset);
+  ssize_t write(const void *buf, size_t nbyte, pblock_t pblock,
+                off_t pblock_offset);
+  ssize_t readv(const std::vector<iovec> &iov, pblock_t pblock);
+  ssize_t writev(const std::vector<iovec> &iov, pblock_t pblock);
+
+  // freed blocks are released after the transaction dropping the last
+  // reference commits, return false if the journal is disabled
+  bool defer_free(const std::vector<pblock_t> &pblock_vec);
+  // the same for a run of packed fragments
+  bool defer_frag_free(pblock_t pblock, uint32_t start, uint32_t count);
+  // the block is no longer metadata, older images must not be replayed
+  void revoke(pblock_t pblock);
+
+  // make all the operations finished so far durable
+  void commit();
+  // commit if the running transaction fills a quarter of the ring; long
+  // operations split into several handles call it between them, with no
+  // handle held
+  void commit_if_large();
+
+private:
+  using Image = std::unique_ptr<std::byte[]>;
+
+  struct FragRun {
+    pblock_t pblock;
+    uint32_t start;
+    uint32_t count;
+  };
+
+  struct Transaction {
+    uint32_t seq;
+    std::vector<std::pair<pblock_t, Image>> blocks;
+    std::vector<pblock_t> revokes;
+    std::vector<pblock_t> frees;
+    std::vector<FragRun> frag_frees;
+  };
+
+  bool enabled_;
+  bool active_;
+  uint32_t block_size_;
+
+  // journal location and ring state
+  uint32_t journal_pblock_;
+  uint32_t journal_blocks_;
+  uint32_t start_;
+  uint32_t head_;
+  uint32_t first_seq_;
+  uint32_t next_seq_;
+  // size of a block number in the descriptor and revoke blocks
+  uint32_t tag_bytes_;
+
+  // current image of every journaled block
+  std::unordered_map<pblock_t, Image> overlay_;
+  // blocks dirtied by the running transaction
+  std::unordered_set<pblock_t> running_;
+  std::vector<pblock_t> revoked_;
+  std::vector<pblock_t> deferred_free_;
+  std::vector<FragRun> deferred_frag_free_;
+  // committed images not written to their home location yet
+  std::unordered_map<pblock_t, Image> checkpoint_;
+  std::mutex mutex_;
+
+  std::shared_mutex txn_mutex_;
+  std::mutex commit_mutex_;
+
+  std::thread commit_thread_;
+  std::condition_variable commit_cv_;
+  bool stop_;
+
+  JournalManager();
+
+  void create();
+  bool scan(std::map<pblock_t, std::vector<std::byte>> &images,
+            uint32_t &replayed);
+  void commit_thread();
+  void do_commit(bool force_checkpoint);
+
+  uint32_t ring_size();
+  uint32_t used_blocks();
+  uint32_t tags_per_block();
+  uint32_t transaction_blocks(size_t block_count, size_t revoke_count);
+  void write_super();
+  void write_transaction(Transaction &txn);
+  void read_ring(std::byte *buf, uint32_t ring_idx, uint32_t count);
+  void write_ring(const std::byte *buf, uint32_t ring_idx, uint32_t count);
+
+  // require mutex_ and an exclusive txn_mutex_
+  void checkpoint_locked();
+  std::byte *get_image_locked(pblock_t pblock);
+};
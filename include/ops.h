@@ -1,10 +1,51 @@
 #pragma once
 #define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 15)
+#include <atomic>
+#include <cstdint>
 #include <fuse.h>
 
+// a handle writing this many bytes in sequence is a stream, its data skips
+// the ssd
+#define STREAM_MIN_BYTES (512 << 10)
+// blocks a stream allocates ahead of the data it writes
+#define STREAM_PREALLOC_BLOCKS 1024
+
+struct ext4_inode;
+
+// per open file state, fi->fh points to it
+struct FileHandle {
+  uint32_t inode_idx;
+  // end of the last write and length of the sequential run it ends
+  std::atomic<uint64_t> next_offset;
+  std::atomic<uint64_t> seq_bytes;
+  // end of the blocks preallocated by the stream, given back at release
+  std::atomic<uint64_t> prealloc_end;
+
+  explicit FileHandle(uint32_t inode_idx)
+      : inode_idx(inode_idx), next_offset(0), seq_bytes(0), prealloc_end(0) {}
+
+  // account a write, return true if the handle is writing a stream
+  bool sequential(uint64_t offset, size_t size) {
+    uint64_t bytes = next_offset.exchange(offset + size) == offset
+                         ? seq_bytes += size
+                         : seq_bytes = size;
+    return bytes >= STREAM_MIN_BYTES;
+  }
+};
+
+inline FileHandle *file_handle(fuse_file_info *fi) {
+  return (FileHandle *)fi->fh;
+}
+
+inline uint32_t handle_inode(fuse_file_info *fi) {
+  return file_handle(fi)->inode_idx;
+}
+
 void *fs_init(fuse_conn_info *conn, fuse_config *cfg);
+void fs_destroy(void *private_data);
 int fs_open(const char *path, fuse_file_info *fi);
 int fs_getattr(const char *path, struct stat *, fuse_file_info *fi);
+void fs_fill_stat(const ext4_inode &inode, struct stat *stbuf);
 int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                off_t offset, fuse_file_info *fi, fuse_readdir_flags flags);
 int fs_read(const char *path, char *buf, size_t size, off_t offset,
@@ -14,4 +55,23 @@ int fs_write(const char *path, const char *buf, size_t size, off_t offset,
              struct fuse_file_info *fi);
 int fs_mknod(const char *path, mode_t mode, dev_t rdev);
 int fs_rmdir(const char *path);
-int fs_unlink(const char *path);
\ No newline at end of file
+int fs_truncate(const char *path, off_t size, fuse_file_info *fi);
+int fs_unlink(const char *path);
+int fs_release(const char *path, fuse_file_info *fi);
+int fs_flush(const char *path, fuse_file_info *fi);
+int fs_fsync(const char *path, int datasync, fuse_file_info *fi);
+int fs_fsyncdir(const char *path, int datasync, fuse_file_info *fi);
+int fs_setxattr(const char *path, const char *name, const char *value,
+                size_t size, int flags);
+int fs_getxattr(const char *path, const char *name, char *value, size_t size);
+int fs_listxattr(const char *path, char *list, size_t size);
+int fs_removexattr(const char *path, const char *name);
+int fs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                 fuse_file_info *fi);
+ssize_t fs_copy_file_range(const char *path_in, fuse_file_info *fi_in,
+                           off_t off_in, const char *path_out,
+                           fuse_file_info *fi_out, off_t off_out, size_t size,
+                           int flags);
+off_t fs_lseek(const char *path, off_t off, int whence, fuse_file_info *fi);
+int fs_ioctl(const char *path, unsigned int cmd, void *arg,
+             fuse_file_info *fi, unsigned int flags, void *data);
\ No newline at end of file
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+// Group commit: concurrent fsync requests share a single device flush. A
+// caller takes a ticket, the first waiter becomes the leader and flushes
+// for every ticket taken so far, the others wait for a flush that started
+// after their ticket
+class SyncManager {
+public:
+  static SyncManager &get_instance();
+
+  // return once everything written before the call is durable
+  void sync();
+
+private:
+  uint64_t requested_;
+  uint64_t completed_;
+  bool flushing_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+
+  SyncManager();
+};
@@ -36,6 +36,9 @@
 #define EXT4_TIND_BLOCK                 (EXT4_DIND_BLOCK + 1)
 #define EXT4_N_BLOCKS                   (EXT4_TIND_BLOCK + 1)
 
+/* Inline data lives in i_block */
+#define EXT4_MIN_INLINE_DATA_SIZE       (sizeof(__le32) * EXT4_N_BLOCKS)
+
 #define EXT4_SECRM_FL                   0x00000001 /* Secure deletion */
 #define EXT4_UNRM_FL                    0x00000002 /* Undelete */
 #define EXT4_COMPR_FL                   0x00000004 /* Compress file */
@@ -60,6 +63,7 @@
 #define EXT4_EXTENTS_FL                 0x00080000 /* Inode uses extents */
 #define EXT4_EA_INODE_FL                0x00200000 /* Inode used for large EA */
 #define EXT4_EOFBLOCKS_FL               0x00400000 /* Blocks allocated beyond EOF */
+#define EXT4_INLINE_DATA_FL             0x10000000 /* Inode has inline data */
 #define EXT4_RESERVED_FL                0x80000000 /* reserved for ext4 lib */
 
 
@@ -0,0 +1,95 @@
+#pragma once
+#include <cstdint>
+
+/*
+ * Hybrid-fs specific on-disk definitions, using the bits and fields which
+ * are unused in ext2/ext4.
+ */
+
+/* Inode flags */
+#define HYBRID_FRAG_FL          0x01000000 /* Data packed in a shared SSD block */
+#define HYBRID_TIER_SSD_FL      0x02000000 /* Allocate data blocks on SSD */
+#define HYBRID_TIER_HDD_FL      0x04000000 /* Allocate data blocks on HDD */
+#define HYBRID_WIDE_MAP_FL      0x08000000 /* Block map of 64 bit entries */
+#define HYBRID_TIER_FL          (HYBRID_TIER_SSD_FL | HYBRID_TIER_HDD_FL)
+
+/*
+ * The tier flags are exposed as the extended attribute HYBRID_TIER_XATTR
+ * with the value "ssd", "hdd" or "auto". New inodes inherit the tier flags
+ * of their parent directory.
+ */
+#define HYBRID_TIER_XATTR       "user.hybridfs.tier"
+
+/*
+ * Small files are packed into SSD blocks split into FRAGS_PER_BLOCK
+ * fragments. The first fragment of a packed block holds the header.
+ * A packed inode keeps the block in i_obso_faddr and the fragment run in
+ * osd2.linux2.l_i_reserved2 (start | count << 8).
+ */
+#define FRAGS_PER_BLOCK         32
+#define FRAG_BLOCK_MAGIC        0x48464652 /* "RFFH" */
+
+struct frag_block_header {
+  uint32_t fb_magic;
+  uint32_t fb_used; /* bitmap of used fragments, bit 0 is the header */
+};
+
+/*
+ * HDD striping. The HDD block groups are round-robined over the HDD files,
+ * group g is group g / n of file g % n. The number of files is kept in
+ * s_reserved[HYBRID_HDD_COUNT_SLOT] of the super block, 0 for a single file.
+ */
+#define HYBRID_HDD_COUNT_SLOT   0
+
+/*
+ * SSD striping and mirroring. The SSD block space is cut into stripe units
+ * of 16 blocks, unit u is unit u / n of file u % n. Each file holds its
+ * stripe units first, ceil(units / n) of them. After them come the second
+ * copies of the super block copies, gdt, bitmaps and inode tables whose
+ * striped copy is on the previous file (file n - 1 for file 0), packed in
+ * block order. The number of files is kept in
+ * s_reserved[HYBRID_SSD_COUNT_SLOT], 0 for a single file.
+ */
+#define HYBRID_SSD_COUNT_SLOT   1
+
+/*
+ * Metadata journal. The journal is a contiguous run of SSD blocks recorded
+ * in the super block: s_reserved_char_pad (s_jnl_backup_type in ext4) is
+ * HYBRID_JNL_BLOCKS, s_jnl_blocks[0] is the first block and s_jnl_blocks[1]
+ * the length. Block 0 of the journal
+ * holds the journal super block, the rest is a ring of transactions:
+ *
+ *   [revoke]* [descriptor data...]* commit
+ *
+ * Descriptor and revoke blocks start with a journal_header followed by
+ * jh_count block numbers of js_tag_bytes each (64 bit tagged addresses, or
+ * 32 bit narrow ones when js_tag_bytes is 0). The commit block holds the number of blocks of the
+ * transaction and a checksum over them.
+ */
+#define HYBRID_JNL_BLOCKS       0x48 /* s_reserved_char_pad */
+#define JOURNAL_MAGIC           0x4846534a /* "JSFH" */
+#define JOURNAL_DEFAULT_BLOCKS  4096
+
+#define JOURNAL_DESC_BLOCK      1
+#define JOURNAL_REVOKE_BLOCK    2
+#define JOURNAL_COMMIT_BLOCK    3
+
+struct journal_super_block {
+  uint32_t js_magic;
+  uint32_t js_blocks; /* journal length, including this block */
+  uint32_t js_start;  /* ring index of the first live transaction */
+  uint32_t js_seq;    /* sequence of the first live transaction */
+  uint32_t js_tag_bytes;
+};
+
+struct journal_header {
+  uint32_t jh_magic;
+  uint32_t jh_type;
+  uint32_t jh_seq;
+  uint32_t jh_count;
+};
+
+struct journal_commit {
+  journal_header jc_header; /* jh_count is the blocks before the commit */
+  uint32_t jc_checksum;
+};
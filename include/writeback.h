@@ -0,0 +1,71 @@
+#pragma once
+
+#include "MetaData.h"
+#include "types/ext4_inode.h"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sys/types.h>
+#include <unordered_map>
+#include <unordered_set>
+
+// Delayed allocation: file data is buffered in dirty pages and the physical
+// blocks are only allocated when the pages are written back
+class WriteBackManager {
+public:
+  static WriteBackManager &get_instance();
+
+  void set_enabled(bool enabled);
+  bool enabled();
+
+  // buffer the data and update the inode size, tier is where the pages are
+  // written back, Tier::HDD marks the file as a sequential stream
+  size_t write(uint32_t inode_idx, const char *buf, size_t size, off_t offset,
+               Tier tier = Tier::AUTO);
+  // copy the dirty part of [offset, offset + size) in lblock to buf, return
+  // false if lblock is not dirty
+  bool read_page(uint32_t inode_idx, uint32_t lblock, char *buf, size_t size,
+                 off_t offset);
+
+  bool is_dirty(uint32_t inode_idx, uint32_t lblock);
+  bool has_dirty(uint32_t inode_idx);
+
+  // allocate blocks for the dirty pages and write them to disk
+  void flush(uint32_t inode_idx);
+  void flush_all();
+  // throw away the dirty pages of a deleted file
+  void drop(uint32_t inode_idx);
+  // throw away the dirty data in [offset, offset + len), pages partially in
+  // the range are zeroed
+  void punch(uint32_t inode_idx, uint64_t offset, uint64_t len);
+
+private:
+  using DirtyPages = std::map<uint32_t, std::unique_ptr<std::byte[]>>;
+
+  bool enabled_;
+  uint32_t block_size_;
+  size_t dirty_bytes_;
+  std::unordered_map<uint32_t, DirtyPages> dirty_inodes_;
+  // pages being written back without mutex_, still readable until they
+  // are on disk
+  std::unordered_map<uint32_t, DirtyPages> writing_;
+  // files whose dirty pages belong to a stream
+  std::unordered_set<uint32_t> streams_;
+  std::mutex mutex_;
+  // signalled when a write back finishes
+  std::condition_variable written_;
+
+  WriteBackManager();
+
+  std::byte *get_page(uint32_t inode_idx, const ext4_inode &inode,
+                      uint32_t lblock, bool full_write);
+  // wait until the pages of the inode are not being written back
+  void wait_writeback(std::unique_lock<std::mutex> &lock, uint32_t inode_idx);
+  void flush_locked(std::unique_lock<std::mutex> &lock, uint32_t inode_idx);
+  // write back the files with the most dirty pages until the dirty data is
+  // under the limit, inode_idx is locked by the caller
+  void balance(uint32_t inode_idx);
+};
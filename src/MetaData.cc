@@ -1,20 +1,39 @@
 #include "MetaData.h"
 #include "bitmap.h"
 #include "common.h"
+#include "demote.h"
 #include "disk.h"
+#include "journal.h"
 #include "option.h"
 #include "types/ext4_inode.h"
 #include "types/hdd_super.h"
+#include "types/hybrid_fs.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <glog/logging.h>
-#include <shared_mutex>
+#include <map>
+#include <mutex>
 #include <sys/types.h>
+#include <unordered_set>
 #include <vector>
 
 #define GROUP_DESC_MIN_SIZE 0x20
+// blocks a thread reserves in a group at a time
+#define RESERVE_BLOCKS 64
+
+// allocation windows of the thread
+thread_local MetaDataManager::AllocWindow MetaDataManager::ssd_window_;
+thread_local MetaDataManager::AllocWindow MetaDataManager::inode_window_;
+thread_local uint32_t MetaDataManager::goal_group_ = UINT32_MAX;
+
+MetaDataManager::Goal::Goal(uint32_t inode_idx) : saved_(goal_group_) {
+  goal_group_ = (inode_idx - 1) / GET_INSTANCE(MetaDataManager).inodes_per_group();
+}
+
+MetaDataManager::Goal::~Goal() { goal_group_ = saved_; }
 
 MetaDataManager &MetaDataManager::get_instance() {
   static MetaDataManager instance;
@@ -34,15 +53,64 @@ void MetaDataManager::super_block_fill() {
   LOG(INFO) << "Blocks per group: " << blocks_per_group();
 }
 
+bool MetaDataManager::journal_location(uint32_t &pblock, uint32_t &blocks) {
+  if (super_.s_reserved_char_pad != HYBRID_JNL_BLOCKS)
+    return false;
+
+  pblock = super_.s_jnl_blocks[0];
+  blocks = super_.s_jnl_blocks[1];
+  return true;
+}
+
+void MetaDataManager::set_journal_location(uint32_t pblock, uint32_t blocks) {
+  super_.s_reserved_char_pad = HYBRID_JNL_BLOCKS;
+  super_.s_jnl_blocks[0] = pblock;
+  super_.s_jnl_blocks[1] = blocks;
+  GET_INSTANCE(DiskManager)
+      .metadata_write(&super_, sizeof(ext4_super_block), BOOT_SECTOR_SIZE);
+}
+
+// Load the whole gdt with a single read
 void MetaDataManager::gdt_fill() {
   uint32_t group_num = block_groups_count();
+  uint32_t desc_size = group_desc_size();
   gdt_table_.resize(group_num);
+  ssd_group_mutex_.reset(new std::mutex[group_num]);
+  memset(gdt_table_.data(), 0, group_num * sizeof(ext4_group_desc));
 
+  std::vector<std::byte> buf((size_t)group_num * desc_size);
+  GET_INSTANCE(DiskManager)
+      .metadata_read(buf.data(), buf.size(), gdt_table_entry_offset(0));
+  uint64_t free_blocks = 0;
   for (uint32_t i = 0; i < group_num; i++) {
+    memcpy(&gdt_table_[i], &buf[(size_t)i * desc_size], desc_size);
+    free_blocks += gdt_table_[i].bg_free_blocks_count_lo;
+  }
+  ssd_free_blocks_ = free_blocks;
+}
+
+// Write back gdt entries [first_group, last_group] with a single write
+void MetaDataManager::gdt_write_back(uint32_t first_group,
+                                     uint32_t last_group) {
+  assert(first_group <= last_group && last_group < block_groups_count());
+  uint32_t desc_size = group_desc_size();
+
+  if (first_group == last_group) {
     GET_INSTANCE(DiskManager)
-        .metadata_read(&(gdt_table_.data()[i]), group_desc_size(),
-                       gdt_table_entry_offset(i));
+        .metadata_write(&gdt_table_[first_group], desc_size,
+                        gdt_table_entry_offset(first_group));
+    return;
   }
+
+  std::vector<std::byte> buf((size_t)(last_group - first_group + 1) *
+                             desc_size);
+  for (uint32_t i = first_group; i <= last_group; i++) {
+    memcpy(&buf[(size_t)(i - first_group) * desc_size], &gdt_table_[i],
+           desc_size);
+  }
+  GET_INSTANCE(DiskManager)
+      .metadata_write(buf.data(), buf.size(),
+                      gdt_table_entry_offset(first_group));
 }
 
 // Block size is 2 ^ (10 + s_log_block_size)
@@ -87,8 +155,8 @@ off_t MetaDataManager::inode_table_offset(uint32_t inode_idx) {
   assert(group_idx < block_groups_count());
 
   LOG(INFO) << "Inode idx: #" << n + 1 << " 's Inode table offset: "
-            << gdt_table_[group_idx].bg_inode_table_lo;
-  return block_to_bytes(gdt_table_[group_idx].bg_inode_table_lo);
+            << inode_table_block_idx(group_idx);
+  return block_to_bytes(inode_table_block_idx(group_idx));
 }
 
 off_t MetaDataManager::inode_table_entry_offset(uint32_t inode_idx) {
@@ -115,12 +183,15 @@ MetaDataManager::get_inode_bitmap_free_block_count(uint32_t group_idx) {
 void MetaDataManager::set_block_bitmap_free_block_count(
     uint32_t group_idx, uint64_t free_block_count) {
   assert(group_idx < block_groups_count());
+  ssd_free_blocks_ +=
+      free_block_count - gdt_table_[group_idx].bg_free_blocks_count_lo;
   gdt_table_[group_idx].bg_free_blocks_count_lo = free_block_count;
 }
 
 void MetaDataManager::inc_block_bitmap_free_block_count(uint32_t group_idx) {
   assert(group_idx < block_groups_count());
   gdt_table_[group_idx].bg_free_blocks_count_lo++;
+  ssd_free_blocks_++;
 }
 
 void MetaDataManager::set_inode_bitmap_free_block_count(
@@ -129,14 +200,43 @@ void MetaDataManager::set_inode_bitmap_free_block_count(
   gdt_table_[group_idx].bg_free_inodes_count_lo = free_block_count;
 }
 
+uint32_t MetaDataManager::get_used_dirs_count(uint32_t group_idx) {
+  assert(group_idx < block_groups_count());
+  return gdt_table_[group_idx].bg_used_dirs_count_lo;
+}
+
+void MetaDataManager::set_used_dirs_count(uint32_t group_idx,
+                                          uint32_t used_dirs_count) {
+  assert(group_idx < block_groups_count());
+  gdt_table_[group_idx].bg_used_dirs_count_lo = used_dirs_count;
+}
+
+// the _hi halves are zero unless the descriptors are 64 bytes long
 uint64_t MetaDataManager::block_bitmap_block_idx(uint32_t group_idx) {
   assert(group_idx < block_groups_count());
-  return gdt_table_[group_idx].bg_block_bitmap_lo;
+  return gdt_table_[group_idx].bg_block_bitmap_lo |
+         (uint64_t)gdt_table_[group_idx].bg_block_bitmap_hi << 32;
+}
+
+// The bitmap location is tagged with HDD_MASK, or with bit 31 when it was
+// written before the addresses were widened
+pblock_t MetaDataManager::hdd_bitmap_block_idx(uint32_t group_idx) {
+  uint64_t bitmap = hdd_gdt_table_[group_idx].bg_block_bitmap;
+  if ((bitmap & HDD_MASK) != 0)
+    return bitmap;
+  return pblock_from32(bitmap);
 }
 
 uint64_t MetaDataManager::inode_bitmap_block_idx(uint32_t group_idx) {
   assert(group_idx < block_groups_count());
-  return gdt_table_[group_idx].bg_inode_bitmap_lo;
+  return gdt_table_[group_idx].bg_inode_bitmap_lo |
+         (uint64_t)gdt_table_[group_idx].bg_inode_bitmap_hi << 32;
+}
+
+uint64_t MetaDataManager::inode_table_block_idx(uint32_t group_idx) {
+  assert(group_idx < block_groups_count());
+  return gdt_table_[group_idx].bg_inode_table_lo |
+         (uint64_t)gdt_table_[group_idx].bg_inode_table_hi << 32;
 }
 
 off_t MetaDataManager::gdt_table_entry_offset(uint32_t group_idx) {
@@ -146,7 +246,7 @@ off_t MetaDataManager::gdt_table_entry_offset(uint32_t group_idx) {
   return gdt_off;
 }
 
-uint32_t MetaDataManager::alloc_new_pblock(uint32_t lblock) {
+pblock_t MetaDataManager::alloc_new_pblock(uint32_t lblock) {
   if (lblock < SSD_MAX_LBLOCK) {
     return alloc_new_ssd_pblock();
   } else {
@@ -154,91 +254,141 @@ uint32_t MetaDataManager::alloc_new_pblock(uint32_t lblock) {
   }
 }
 
-uint32_t MetaDataManager::alloc_new_ssd_pblock() {
-  assert(block_size() % sizeof(uint32_t) == 0);
-
-  std::shared_lock lock(ssd_mutex_);
-  for (uint32_t group_id = 0; group_id < block_groups_count(); group_id++) {
-    uint64_t free_block_count = get_block_bitmap_free_block_count(group_id);
-    if (free_block_count > 0) {
-      uint64_t bitmap_pblock = block_bitmap_block_idx(group_id);
-      Bitmap bitmap(block_size());
-      bitmap.load(bitmap_pblock);
-
-      // LOG(INFO) << "SSD group #" << group_id << " found " << free_block_count
-      //           << " free block, block bitmap idx: " << bitmap_pblock;
-
-      uint32_t idx = 0;
-      uint32_t begin_idx = (group_id == 0) ? 1 : 0;
-      for (uint32_t i = begin_idx; i < bitmap.size(); i++) {
-        if (!bitmap.lookup(i)) {
-          idx = i;
-          break;
-        }
-      }
-
-      // set idx's bitmap
-      bitmap.set(idx);
-      bitmap.save(bitmap_pblock);
+pblock_t MetaDataManager::alloc_new_ssd_pblock() {
+  std::vector<pblock_t> pblock_vec;
+  alloc_new_ssd_pblocks(1, pblock_vec);
+  return pblock_vec[0];
+}
 
-      // update gdt
-      set_block_bitmap_free_block_count(group_id, free_block_count - 1);
-      GET_INSTANCE(DiskManager)
-          .metadata_write(&(gdt_table_.data()[group_id]), group_desc_size(),
-                          gdt_table_entry_offset(group_id));
+// hand the thread the next chunk, consecutive chunks are in different groups
+void MetaDataManager::next_window(AllocWindow &window,
+                                  std::atomic<uint64_t> &cursor,
+                                  uint32_t groups, uint32_t group_size,
+                                  uint32_t chunk) {
+  uint64_t k = cursor++;
+  uint32_t chunks_per_group = std::max(group_size / chunk, 1u);
+  window.group = k % groups;
+  window.begin = (k / groups) % chunks_per_group * chunk;
+  window.end = std::min(window.begin + chunk, group_size);
+}
 
-      uint32_t alloc_pblock = group_id * blocks_per_group() + idx;
-      // LOG(INFO) << "SSD return new free block idx: " << alloc_pblock;
-      return alloc_pblock;
+// Orlov placement. Directories under the root are spread over the groups
+// with more free inodes and blocks than average, taking the one with the
+// fewest directories; deeper directories stay near their parent unless its
+// group is crowded. Files go to the group of their parent.
+uint32_t MetaDataManager::find_inode_group(uint32_t parent_idx, bool dir) {
+  uint32_t groups = block_groups_count();
+  uint32_t parent_group = (parent_idx - 1) / inodes_per_group();
+  if (!dir)
+    return parent_group;
+
+  uint64_t free_inodes = 0, free_blocks = 0, dirs = 0;
+  for (uint32_t group_id = 0; group_id < groups; group_id++) {
+    free_inodes += get_inode_bitmap_free_block_count(group_id);
+    free_blocks += get_block_bitmap_free_block_count(group_id);
+    dirs += get_used_dirs_count(group_id);
+  }
+  uint64_t avg_free_inodes = free_inodes / groups;
+  uint64_t avg_free_blocks = free_blocks / groups;
+
+  if (parent_idx == ROOT_INODE) {
+    // start from a different group each time so that ties are spread
+    uint32_t start = inode_cursor_++ % groups;
+    uint32_t best_group = groups, best_dirs = UINT32_MAX;
+    for (uint32_t i = 0; i < groups; i++) {
+      uint32_t group_id = (start + i) % groups;
+      uint64_t group_free_inodes = get_inode_bitmap_free_block_count(group_id);
+      if (group_free_inodes == 0 || group_free_inodes < avg_free_inodes ||
+          get_block_bitmap_free_block_count(group_id) < avg_free_blocks)
+        continue;
+      if (get_used_dirs_count(group_id) < best_dirs) {
+        best_group = group_id;
+        best_dirs = get_used_dirs_count(group_id);
+      }
     }
+    if (best_group < groups)
+      return best_group;
   }
-  LOG(FATAL) << "SSD no free blocks!";
-  return 0;
+
+  uint64_t max_dirs = dirs / groups + inodes_per_group() / 16;
+  uint64_t min_inodes = std::max(avg_free_inodes / 4, (uint64_t)1);
+  uint64_t min_blocks = avg_free_blocks / 4;
+  for (uint32_t i = 0; i < groups; i++) {
+    uint32_t group_id = (parent_group + i) % groups;
+    if (get_used_dirs_count(group_id) <= max_dirs &&
+        get_inode_bitmap_free_block_count(group_id) >= min_inodes &&
+        get_block_bitmap_free_block_count(group_id) >= min_blocks)
+      return group_id;
+  }
+  return parent_group;
 }
 
-uint32_t MetaDataManager::get_new_inode_idx() {
+uint32_t MetaDataManager::get_new_inode_idx(uint32_t parent_idx, bool dir) {
   assert(block_size() % sizeof(uint32_t) == 0);
-
-  std::shared_lock lock(ssd_mutex_);
-  for (uint32_t group_id = 0; group_id < block_groups_count(); group_id++) {
-    uint64_t free_inode_count = get_inode_bitmap_free_block_count(group_id);
-    if (free_inode_count > 0) {
-      uint64_t bitmap_pblock = inode_bitmap_block_idx(group_id);
-      Bitmap bitmap(block_size());
-      bitmap.load(bitmap_pblock);
-
-      LOG(INFO) << "Group #" << group_id << " found " << free_inode_count
-                << " inodes, inode bitmap pblock: " << bitmap_pblock;
-
-      uint32_t idx = 0;
-      uint32_t begin_idx = (group_id == 0) ? 11 : 0;
-      for (uint32_t i = begin_idx; i < bitmap.size(); i++) {
-        if (!bitmap.lookup(i)) {
-          idx = i;
-          break;
-        }
-      }
-
-      // set and update inode's bitmap
-      bitmap.set(idx);
-      bitmap.save(bitmap_pblock);
-
-      // update gdt
-      set_inode_bitmap_free_block_count(group_id, free_inode_count - 1);
-      GET_INSTANCE(DiskManager)
-          .metadata_write(&(gdt_table_.data()[group_id]), group_desc_size(),
-                          gdt_table_entry_offset(group_id));
-
+  assert(parent_idx > 0);
+
+  uint32_t groups = block_groups_count();
+  uint32_t group = find_inode_group(parent_idx, dir);
+
+  // the window of the thread remembers where its last search in the group
+  // stopped
+  AllocWindow &window = inode_window_;
+  uint32_t begin = window.group == group ? window.begin : 0;
+  for (uint32_t i = 0; i < groups; i++) {
+    uint32_t group_id = (group + i) % groups;
+    uint32_t idx;
+    if (alloc_inode_in_group(group_id, begin, inodes_per_group(), dir, idx) ||
+        (begin > 0 && alloc_inode_in_group(group_id, 0, begin, dir, idx))) {
+      window = {group_id, idx + 1, inodes_per_group()};
       // inode numbers start from 1 rather than 0
       uint32_t alloc_inode_idx = group_id * inodes_per_group() + idx + 1;
       LOG(INFO) << "Allocate inode: " << alloc_inode_idx;
       return alloc_inode_idx;
     }
+    begin = 0;
   }
   LOG(FATAL) << "No free inodes!";
   return 0;
 }
 
+// take the first free inode in [begin, end) of the group
+bool MetaDataManager::alloc_inode_in_group(uint32_t group_id, uint32_t begin,
+                                           uint32_t end, bool dir,
+                                           uint32_t &idx) {
+  std::lock_guard group_lock(ssd_group_mutex_[group_id]);
+  uint64_t free_inode_count = get_inode_bitmap_free_block_count(group_id);
+  if (free_inode_count == 0)
+    return false;
+
+  uint64_t bitmap_pblock = inode_bitmap_block_idx(group_id);
+  Bitmap bitmap(block_size());
+  bitmap.load(bitmap_pblock);
+
+  // the first inodes of group 0 are reserved
+  if (group_id == 0)
+    begin = std::max(begin, 11u);
+  for (idx = begin; idx < end && idx < bitmap.size(); idx++) {
+    if (!bitmap.lookup(idx))
+      break;
+  }
+  if (idx >= end || idx >= bitmap.size())
+    return false;
+
+  // set and update inode's bitmap
+  bitmap.set(idx);
+  bitmap.save(bitmap_pblock);
+
+  // update gdt
+  set_inode_bitmap_free_block_count(group_id, free_inode_count - 1);
+  if (dir)
+    set_used_dirs_count(group_id, get_used_dirs_count(group_id) + 1);
+  gdt_write_back(group_id, group_id);
+  return true;
+}
+
+// blocks per group = block_size() * 8, one bitmap block per hdd group
+uint32_t MetaDataManager::hdd_blocks_per_group() { return block_size() * 8; }
+
 uint32_t MetaDataManager::group_desc_size() {
   if (!super_.s_desc_size)
     return GROUP_DESC_MIN_SIZE;
@@ -246,217 +396,760 @@ uint32_t MetaDataManager::group_desc_size() {
     return sizeof(struct ext4_group_desc);
 }
 
-uint32_t MetaDataManager::alloc_new_hdd_pblock() {
-  std::shared_lock lock(hdd_mutex_);
+pblock_t MetaDataManager::alloc_new_hdd_pblock() {
+  std::vector<pblock_t> pblock_vec;
+  alloc_new_hdd_pblocks(1, pblock_vec);
+  return pblock_vec[0];
+}
 
-  uint32_t hdd_group_count = hdd_super_.s_group_count;
-  for (uint32_t group_id = 0; group_id < hdd_group_count; group_id++) {
-    uint64_t free_block_count = hdd_gdt_table_[group_id].bg_free_blocks_count;
-    if (free_block_count > 0) {
-      uint64_t bitmap_pblock =
-          HDD_BLOCK_IDX(hdd_gdt_table_[group_id].bg_block_bitmap);
-      Bitmap bitmap(block_size());
-      bitmap.load(bitmap_pblock);
-
-      // LOG(INFO) << "HDD group #" << group_id << " found " << free_block_count
-      //           << " free block, block bitmap idx: " << (bitmap_pblock &
-      //           (~HDD_MASK));
-
-      uint32_t idx = 0;
-      for (uint32_t i = 0; i < bitmap.size(); i++) {
-        if (!bitmap.lookup(i)) {
-          idx = i;
-          break;
-        }
-      }
+void MetaDataManager::alloc_new_pblocks(uint32_t lblock, uint32_t count,
+                                        std::vector<pblock_t> &pblock_vec,
+                                        Tier tier, pblock_t goal) {
+  uint32_t ssd_count = 0;
+  if (tier == Tier::SSD)
+    ssd_count = count;
+  else if (tier == Tier::AUTO && lblock < SSD_MAX_LBLOCK)
+    ssd_count = std::min(count, SSD_MAX_LBLOCK - lblock);
+
+  // data spills to the hdd when the ssd is over its watermark, the space
+  // reserved for the metadata is never handed out to data
+  if (ssd_count > 0) {
+    uint64_t quota = ssd_data_quota(tier);
+    if (quota < ssd_count) {
+      LOG_EVERY_N(WARNING, 1024) << "SSD over its watermark, " << quota
+                                 << " blocks left for data";
+      GET_INSTANCE(DemoteManager).wake();
+      ssd_count = quota;
+    }
+    count -= try_alloc_ssd_pblocks(ssd_count, pblock_vec);
+  }
 
-      // set idx's bitmap
-      bitmap.set(idx);
-      bitmap.save(bitmap_pblock);
+  if (count > 0) {
+    alloc_new_hdd_pblocks(count, pblock_vec, goal);
+  }
+}
 
-      // update gdt
-      uint32_t hdd_metadata_pblock = HDD_BLOCK_IDX(0);
-      hdd_gdt_table_[group_id].bg_free_blocks_count = free_block_count - 1;
-      size_t nbyte = sizeof(hdd_group_desc);
-      off_t offset =
-          sizeof(hdd_super_block) + group_id * sizeof(hdd_group_desc);
-      GET_INSTANCE(DiskManager)
-          .disk_write(&(hdd_gdt_table_.data()[group_id]), nbyte,
-                      hdd_metadata_pblock, offset);
+uint32_t MetaDataManager::alloc_bitmap_run(Bitmap &bitmap, uint32_t begin_idx,
+                                           uint32_t end_idx, uint32_t count,
+                                           uint64_t free_count, uint64_t base,
+                                           std::vector<pblock_t> &pblock_vec) {
+  uint32_t want = std::min((uint64_t)count, free_count);
+  uint32_t idx, run_len = 0;
+  end_idx = std::min(end_idx, bitmap.size());
+  if (want == 0)
+    return 0;
+
+  // look for a single free run which is long enough
+  idx = begin_idx;
+  while ((idx = bitmap.find_free_run(idx, want, run_len)) < end_idx &&
+         std::min(run_len, end_idx - idx) < want) {
+    idx += run_len;
+  }
+
+  // otherwise fill in the free runs from the beginning
+  uint32_t alloc_count = 0;
+  idx = (idx < end_idx) ? idx : begin_idx;
+  while (alloc_count < want) {
+    idx = bitmap.find_free_run(idx, want - alloc_count, run_len);
+    if (idx >= end_idx)
+      break;
+    run_len = std::min(run_len, end_idx - idx);
 
-      uint32_t alloc_pblock = HDD_BLOCK_IDX(group_id * hdd_group_count + idx);
-      // LOG(INFO) << "HDD return new free block idx: " << (alloc_pblock &
-      // (~HDD_MASK));
-      return alloc_pblock;
+    for (uint32_t i = idx; i < idx + run_len; i++) {
+      bitmap.set(i);
+      pblock_vec.push_back(base + i);
     }
+    alloc_count += run_len;
+    idx += run_len;
   }
-  LOG(FATAL) << "HDD no free blocks!";
-  return 0;
+  return alloc_count;
 }
 
-void MetaDataManager::free_inode(uint32_t inode_idx) {
-  assert(inode_idx > 0);
-  std::shared_lock ssd_lock(ssd_mutex_);
+// allocate up to count ssd blocks in [begin, end) of the group
+uint32_t MetaDataManager::alloc_in_group(uint32_t group_id, uint32_t begin,
+                                         uint32_t end, uint32_t count,
+                                         std::vector<pblock_t> &pblock_vec) {
+  std::lock_guard group_lock(ssd_group_mutex_[group_id]);
+  uint64_t free_block_count = get_block_bitmap_free_block_count(group_id);
+  if (free_block_count == 0)
+    return 0;
 
-  uint32_t n = inode_idx - 1;
-  uint32_t group_id = n / inodes_per_group();
-  uint64_t bitmap_pblock = inode_bitmap_block_idx(group_id);
-  uint64_t free_inode_count = get_inode_bitmap_free_block_count(group_id);
+  pblock_t bitmap_pblock = block_bitmap_block_idx(group_id);
   Bitmap bitmap(block_size());
   bitmap.load(bitmap_pblock);
 
-  // set and update inode's bitmap
-  bitmap.unset(n % inodes_per_group());
+  pblock_t base = (pblock_t)group_id * blocks_per_group();
+  if (group_id == 0)
+    begin = std::max(begin, 1u);
+  uint32_t alloc_count = alloc_bitmap_run(bitmap, begin, end, count,
+                                          free_block_count, base, pblock_vec);
+  if (alloc_count == 0)
+    return 0;
+
   bitmap.save(bitmap_pblock);
 
   // update gdt
-  set_inode_bitmap_free_block_count(group_id, free_inode_count - 1);
-  GET_INSTANCE(DiskManager)
-      .metadata_write(&(gdt_table_.data()[group_id]), group_desc_size(),
-                      gdt_table_entry_offset(group_id));
+  set_block_bitmap_free_block_count(group_id, free_block_count - alloc_count);
+  gdt_write_back(group_id, group_id);
+  return alloc_count;
+}
+
+// metadata may use the reserve, running out of it is fatal
+void MetaDataManager::alloc_new_ssd_pblocks(uint32_t count,
+                                            std::vector<pblock_t> &pblock_vec) {
+  if (try_alloc_ssd_pblocks(count, pblock_vec) < count) {
+    LOG(FATAL) << "SSD no free blocks for metadata!";
+  }
+}
+
+// Small requests are served from the window of the thread, so that threads
+// allocate in different groups and the blocks written by one thread stay
+// together. Large requests, and small ones once the windows run dry, look
+// for runs in whole groups.
+uint32_t
+MetaDataManager::try_alloc_ssd_pblocks(uint32_t count,
+                                       std::vector<pblock_t> &pblock_vec) {
+  uint32_t want = count;
+  uint32_t groups = block_groups_count();
+  uint32_t group_size = blocks_per_group();
+  AllocWindow &window = ssd_window_;
+
+  // blocks of the inode being worked on go to the group of the inode first,
+  // continuing after the last blocks taken there
+  if (goal_group_ < groups) {
+    uint32_t begin = window.group == goal_group_ ? window.begin : 0;
+    count -= alloc_in_group(goal_group_, begin, group_size, count, pblock_vec);
+    if (count > 0 && begin > 0)
+      count -= alloc_in_group(goal_group_, 0, begin, count, pblock_vec);
+
+    if (count == 0) {
+      window = {goal_group_, (uint32_t)(pblock_vec.back() % group_size + 1),
+                group_size};
+      return want;
+    }
+    window.begin = window.end;
+  }
+
+  if (count <= RESERVE_BLOCKS) {
+    for (uint32_t tries = 0; tries < groups && count > 0; tries++) {
+      if (window.begin >= window.end || window.group >= groups) {
+        next_window(window, ssd_cursor_, groups, group_size, RESERVE_BLOCKS);
+      }
+
+      count -= alloc_in_group(window.group, window.begin, window.end, count,
+                              pblock_vec);
+      if (count == 0) {
+        window.begin = pblock_vec.back() % group_size + 1;
+        return want;
+      }
+      window.begin = window.end;
+    }
+  }
+
+  uint32_t start = window.group < groups ? window.group : 0;
+  for (uint32_t i = 0; i < groups && count > 0; i++) {
+    count -= alloc_in_group((start + i) % groups, 0, group_size, count,
+                            pblock_vec);
+  }
+  return want - count;
+}
+
+// HDD blocks come from the free extent index, the bitmaps are only updated
+// to match. goal is the block the allocation would best start at.
+void MetaDataManager::alloc_new_hdd_pblocks(uint32_t count,
+                                            std::vector<pblock_t> &pblock_vec,
+                                            pblock_t goal) {
+  uint64_t goal_idx = (goal & HDD_MASK) != 0 ? goal & ~HDD_MASK : UINT64_MAX;
+
+  while (count > 0) {
+    uint64_t start, len;
+    {
+      std::lock_guard extent_lock(hdd_extent_mutex_);
+      if (!hdd_extents_.alloc(count, goal_idx, start, len))
+        LOG(FATAL) << "HDD no free blocks!";
+    }
+    mark_hdd_used(start, len);
+
+    for (uint64_t i = start; i < start + len; i++)
+      pblock_vec.push_back(HDD_BLOCK_IDX(i));
+    count -= len;
+    goal_idx = start + len;
+  }
+}
+
+uint64_t MetaDataManager::hdd_largest_extent() {
+  std::lock_guard extent_lock(hdd_extent_mutex_);
+  return hdd_extents_.largest();
+}
+
+uint64_t MetaDataManager::hdd_free_blocks() {
+  std::lock_guard extent_lock(hdd_extent_mutex_);
+  return hdd_extents_.free_blocks();
+}
+
+void MetaDataManager::set_ssd_watermarks(uint32_t high, uint32_t low,
+                                         uint32_t reserve) {
+  assert(low <= high && high <= 100 && reserve < 100);
+  ssd_high_ = high;
+  ssd_low_ = low;
+  ssd_reserve_ = reserve;
+}
+
+uint64_t MetaDataManager::ssd_free_blocks() { return ssd_free_blocks_; }
+
+// blocks are counted against the whole ssd, the fixed metadata included
+uint64_t MetaDataManager::ssd_data_quota(Tier tier) {
+  uint64_t total = super_.s_blocks_count_lo;
+  uint64_t keep = total * ssd_reserve_ / 100;
+  // explicit ssd data may fill the ssd up to the reserve
+  if (tier != Tier::SSD)
+    keep = std::max(keep, total * (100 - ssd_high_) / 100);
+  uint64_t free_blocks = ssd_free_blocks_;
+  return free_blocks > keep ? free_blocks - keep : 0;
+}
+
+uint64_t MetaDataManager::ssd_demote_target() {
+  uint64_t total = super_.s_blocks_count_lo;
+  uint64_t used = total - std::min(total, (uint64_t)ssd_free_blocks_);
+  if (used * 100 < total * ssd_high_)
+    return 0;
+  return used - total * ssd_low_ / 100;
+}
+
+uint32_t MetaDataManager::inodes_count() { return super_.s_inodes_count; }
+
+// mark [start, start + len) of the hdd block space used in the bitmaps and
+// the gdt, the range has been taken out of the extent index already
+void MetaDataManager::mark_hdd_used(uint64_t start, uint64_t len) {
+  uint32_t blocks_per_group = hdd_blocks_per_group();
+  while (len > 0) {
+    uint32_t group_id = start / blocks_per_group;
+    uint32_t idx = start % blocks_per_group;
+    uint32_t n = std::min((uint64_t)blocks_per_group - idx, len);
+
+    std::lock_guard group_lock(hdd_group_mutex_[group_id]);
+    pblock_t bitmap_pblock = hdd_bitmap_block_idx(group_id);
+    Bitmap bitmap(block_size());
+    bitmap.load(bitmap_pblock);
+    for (uint32_t i = idx; i < idx + n; i++) {
+      assert(!bitmap.lookup(i));
+      bitmap.set(i);
+    }
+    bitmap.save(bitmap_pblock);
+
+    hdd_gdt_table_[group_id].bg_free_blocks_count -= n;
+    hdd_gdt_write_back(group_id, group_id);
+
+    start += n;
+    len -= n;
+  }
 }
 
-void MetaDataManager::free_pblock(const std::vector<uint32_t> &pblock_vec) {
-  std::shared_lock ssd_lock(ssd_mutex_);
-  std::shared_lock hdd_lock(hdd_mutex_);
+// the free extents are rebuilt from the bitmaps at every mount
+void MetaDataManager::build_hdd_extents() {
+  std::lock_guard extent_lock(hdd_extent_mutex_);
+  hdd_extents_.clear();
 
-  std::vector<bool> ssd_dirty(block_groups_count(), false);
-  std::vector<bool> hdd_dirty(hdd_super_.s_group_count, false);
-  std::vector<Bitmap> ssd_bitmap_vec(block_groups_count(), block_size());
-  std::vector<Bitmap> hdd_bitmap_vec(hdd_super_.s_group_count, block_size());
+  uint32_t blocks_per_group = hdd_blocks_per_group();
+  for (uint32_t group_id = 0; group_id < hdd_gdt_table_.size(); group_id++) {
+    if (hdd_gdt_table_[group_id].bg_free_blocks_count == 0)
+      continue;
+
+    Bitmap bitmap(block_size());
+    bitmap.load(hdd_bitmap_block_idx(group_id));
+    uint32_t idx = 0, run_len;
+    while ((idx = bitmap.find_free_run(idx, UINT32_MAX, run_len)) <
+           bitmap.size()) {
+      hdd_extents_.insert((uint64_t)group_id * blocks_per_group + idx,
+                          run_len);
+      idx += run_len;
+    }
+  }
+
+  LOG(INFO) << "HDD free extents: " << hdd_extents_.extent_count()
+            << ", free blocks: " << hdd_extents_.free_blocks()
+            << ", largest: " << hdd_extents_.largest();
+}
+
+// Write back hdd gdt entries [first_group, last_group] with a single write
+void MetaDataManager::hdd_gdt_write_back(uint32_t first_group,
+                                         uint32_t last_group) {
+  assert(first_group <= last_group && last_group < hdd_gdt_table_.size());
+  size_t nbyte = (last_group - first_group + 1) * sizeof(hdd_group_desc);
+  off_t offset = sizeof(hdd_super_block) + first_group * sizeof(hdd_group_desc);
+  GET_INSTANCE(DiskManager)
+      .metadata_write(&hdd_gdt_table_[first_group], nbyte, HDD_BLOCK_IDX(0),
+                      offset);
+}
+
+void MetaDataManager::free_inode(uint32_t inode_idx, bool dir) {
+  if (dir)
+    free_inodes({inode_idx}, {inode_idx});
+  else
+    free_inodes({inode_idx});
+}
 
-  for (uint32_t i = 0; i < block_groups_count(); i++) {
-    uint64_t bitmap_pblock = block_bitmap_block_idx(i);
-    ssd_bitmap_vec[i].load(bitmap_pblock);
+// Load the bitmaps, coalescing the ones which are consecutive on disk
+// into a single vectored read
+static void load_bitmaps(std::vector<std::pair<uint64_t, Bitmap *>> bitmaps) {
+  // mapped bitmaps need no read
+  bitmaps.erase(std::remove_if(bitmaps.begin(), bitmaps.end(),
+                               [](const auto &b) {
+                                 return b.second->map(b.first);
+                               }),
+                bitmaps.end());
+  std::sort(bitmaps.begin(), bitmaps.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  size_t i = 0;
+  while (i < bitmaps.size()) {
+    std::vector<iovec> iov;
+    size_t j = i;
+    do {
+      iov.push_back({bitmaps[j].second->data(), bitmaps[j].second->bytes()});
+      j++;
+    } while (j < bitmaps.size() && bitmaps[j].first == bitmaps[j - 1].first + 1);
+
+    GET_INSTANCE(DiskManager).metadata_block_readv(iov, bitmaps[i].first);
+    i = j;
   }
+}
 
-  for (uint32_t i = 0; i < hdd_super_.s_group_count; i++) {
-    uint64_t bitmap_pblock = HDD_BLOCK_IDX(hdd_gdt_table_[i].bg_block_bitmap);
-    ssd_bitmap_vec[i].load(bitmap_pblock);
+static void save_bitmaps(std::vector<std::pair<uint64_t, Bitmap *>> bitmaps) {
+  // mapped bitmaps only need to be marked dirty
+  bitmaps.erase(std::remove_if(bitmaps.begin(), bitmaps.end(),
+                               [](const auto &b) {
+                                 if (!b.second->mapped())
+                                   return false;
+                                 b.second->save(b.first);
+                                 return true;
+                               }),
+                bitmaps.end());
+  std::sort(bitmaps.begin(), bitmaps.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  size_t i = 0;
+  while (i < bitmaps.size()) {
+    std::vector<iovec> iov;
+    size_t j = i;
+    do {
+      iov.push_back({bitmaps[j].second->data(), bitmaps[j].second->bytes()});
+      j++;
+    } while (j < bitmaps.size() && bitmaps[j].first == bitmaps[j - 1].first + 1);
+
+    GET_INSTANCE(DiskManager).metadata_block_writev(iov, bitmaps[i].first);
+    i = j;
   }
+}
+
+void MetaDataManager::free_pblock(const std::vector<pblock_t> &pblock_vec) {
+  if (pblock_vec.empty())
+    return;
 
-  void *buf = new std::byte[block_size()];
-  memset(buf, 0, block_size());
-  uint32_t bitmap_size = block_size() * sizeof(uint32_t) * 8;
+  // with the journal, the blocks can only be reused once the transaction
+  // dropping their last reference is committed
+  if (GET_INSTANCE(JournalManager).defer_free(pblock_vec))
+    return;
+  free_pblock_now(pblock_vec);
+}
+
+void MetaDataManager::free_pblock_now(
+    const std::vector<pblock_t> &pblock_vec) {
+  if (pblock_vec.empty())
+    return;
+
+  // only the groups touched by pblock_vec need to be loaded
+  std::map<uint32_t, Bitmap> ssd_bitmap_map, hdd_bitmap_map;
   for (auto &pblock : pblock_vec) {
-    uint32_t group_id = (pblock & (~HDD_MASK)) / bitmap_size;
-    uint32_t idx = (pblock & (~HDD_MASK)) % bitmap_size;
+    if ((pblock & HDD_MASK) != 0) {
+      uint32_t group_id = (pblock & (~HDD_MASK)) / hdd_blocks_per_group();
+      hdd_bitmap_map.try_emplace(group_id, block_size());
+    } else {
+      uint32_t group_id = pblock / blocks_per_group();
+      ssd_bitmap_map.try_emplace(group_id, block_size());
+    }
+  }
 
+  // the groups are locked in order, allocators hold one group at a time
+  std::vector<std::unique_lock<std::mutex>> group_locks;
+  std::vector<std::pair<uint64_t, Bitmap *>> bitmaps;
+  for (auto &[group_id, bitmap] : ssd_bitmap_map) {
+    group_locks.emplace_back(ssd_group_mutex_[group_id]);
+    bitmaps.emplace_back(block_bitmap_block_idx(group_id), &bitmap);
+  }
+  for (auto &[group_id, bitmap] : hdd_bitmap_map) {
+    group_locks.emplace_back(hdd_group_mutex_[group_id]);
+    bitmaps.emplace_back(hdd_bitmap_block_idx(group_id), &bitmap);
+  }
+  load_bitmaps(bitmaps);
+
+  std::vector<uint64_t> hdd_freed;
+  for (auto &pblock : pblock_vec) {
     if ((pblock & HDD_MASK) != 0) {
-      hdd_dirty[group_id] = true;
-      hdd_bitmap_vec[group_id].unset(idx);
-      hdd_gdt_table_[group_id].bg_free_blocks_count++;
+      uint32_t group_id = (pblock & (~HDD_MASK)) / hdd_blocks_per_group();
+      uint32_t idx = (pblock & (~HDD_MASK)) % hdd_blocks_per_group();
+      Bitmap &bitmap = hdd_bitmap_map.at(group_id);
+      if (bitmap.lookup(idx)) {
+        bitmap.unset(idx);
+        hdd_gdt_table_[group_id].bg_free_blocks_count++;
+        hdd_freed.push_back(pblock & (~HDD_MASK));
+      }
     } else {
-      ssd_dirty[group_id] = true;
-      ssd_bitmap_vec[group_id].unset(idx);
+      uint32_t group_id = pblock / blocks_per_group();
+      uint32_t idx = pblock % blocks_per_group();
+      ssd_bitmap_map.at(group_id).unset(idx);
       inc_block_bitmap_free_block_count(group_id);
     }
 
-    // clean block
-    GET_INSTANCE(DiskManager).disk_block_write(buf, pblock);
+    // its journaled images are stale now
+    GET_INSTANCE(JournalManager).revoke(pblock);
+  }
+
+  // clean the blocks, consecutive ones are zeroed with a single write
+  std::vector<pblock_t> sorted_vec(pblock_vec);
+  std::sort(sorted_vec.begin(), sorted_vec.end());
+  std::vector<std::byte> zero(block_size(), std::byte(0));
+  BlockIoBatch batch(block_size());
+  for (auto &pblock : sorted_vec) {
+    batch.add(pblock, (const void *)zero.data(), block_size());
+  }
+  batch.write();
+
+  save_bitmaps(bitmaps);
+
+  // update gdt, the entries of consecutive groups are written back together;
+  // only the locked groups may be written
+  auto it = ssd_bitmap_map.begin();
+  while (it != ssd_bitmap_map.end()) {
+    uint32_t first_group = it->first, last_group = it->first;
+    while (++it != ssd_bitmap_map.end() && it->first == last_group + 1)
+      last_group = it->first;
+    gdt_write_back(first_group, last_group);
+  }
+
+  it = hdd_bitmap_map.begin();
+  while (it != hdd_bitmap_map.end()) {
+    uint32_t first_group = it->first, last_group = it->first;
+    while (++it != hdd_bitmap_map.end() && it->first == last_group + 1)
+      last_group = it->first;
+    hdd_gdt_write_back(first_group, last_group);
+  }
+  group_locks.clear();
+
+  // the extent index is never locked with a group held
+  std::sort(hdd_freed.begin(), hdd_freed.end());
+  std::lock_guard extent_lock(hdd_extent_mutex_);
+  size_t i = 0;
+  while (i < hdd_freed.size()) {
+    size_t j = i + 1;
+    while (j < hdd_freed.size() && hdd_freed[j] == hdd_freed[j - 1] + 1)
+      j++;
+    hdd_extents_.insert(hdd_freed[i], j - i);
+    i = j;
+  }
+}
+
+bool MetaDataManager::inode_in_use(uint32_t inode_idx) {
+  assert(inode_idx > 0);
+  uint32_t group_id = (inode_idx - 1) / inodes_per_group();
+  std::lock_guard group_lock(ssd_group_mutex_[group_id]);
+  Bitmap bitmap(block_size());
+  bitmap.load(inode_bitmap_block_idx(group_id));
+  return bitmap.lookup((inode_idx - 1) % inodes_per_group());
+}
+
+void MetaDataManager::group_inodes_in_use(uint32_t group_id,
+                                          std::vector<uint32_t> &inode_vec) {
+  std::lock_guard group_lock(ssd_group_mutex_[group_id]);
+  Bitmap bitmap(block_size());
+  bitmap.load(inode_bitmap_block_idx(group_id));
+  uint32_t first = group_id * inodes_per_group() + 1;
+  for (uint32_t i = 0; i < inodes_per_group(); i++)
+    if (bitmap.lookup(i))
+      inode_vec.push_back(first + i);
+}
+
+void MetaDataManager::free_inodes(const std::vector<uint32_t> &inode_vec,
+                                  const std::vector<uint32_t> &dir_vec) {
+  if (inode_vec.empty())
+    return;
+
+  // one bitmap per touched group
+  std::map<uint32_t, Bitmap> bitmap_map;
+  for (auto &inode_idx : inode_vec) {
+    assert(inode_idx > 0);
+    bitmap_map.try_emplace((inode_idx - 1) / inodes_per_group(), block_size());
+  }
+
+  std::vector<std::unique_lock<std::mutex>> group_locks;
+  std::vector<std::pair<uint64_t, Bitmap *>> bitmaps;
+  for (auto &[group_id, bitmap] : bitmap_map) {
+    group_locks.emplace_back(ssd_group_mutex_[group_id]);
+    bitmaps.emplace_back(inode_bitmap_block_idx(group_id), &bitmap);
+  }
+  load_bitmaps(bitmaps);
+
+  std::unordered_set<uint32_t> dirs(dir_vec.begin(), dir_vec.end());
+  for (auto &inode_idx : inode_vec) {
+    uint32_t n = inode_idx - 1;
+    uint32_t group_id = n / inodes_per_group();
+    Bitmap &bitmap = bitmap_map.at(group_id);
+    if (!bitmap.lookup(n % inodes_per_group()))
+      continue;
+
+    bitmap.unset(n % inodes_per_group());
+    set_inode_bitmap_free_block_count(
+        group_id, get_inode_bitmap_free_block_count(group_id) + 1);
+    if (dirs.count(inode_idx) != 0 && get_used_dirs_count(group_id) > 0)
+      set_used_dirs_count(group_id, get_used_dirs_count(group_id) - 1);
+  }
+
+  save_bitmaps(bitmaps);
+
+  auto it = bitmap_map.begin();
+  while (it != bitmap_map.end()) {
+    uint32_t first_group = it->first, last_group = it->first;
+    while (++it != bitmap_map.end() && it->first == last_group + 1)
+      last_group = it->first;
+    gdt_write_back(first_group, last_group);
+  }
+}
+
+#define EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER 0x0001
+
+static bool test_root(uint32_t n, uint32_t base) {
+  while (n > 1 && n % base == 0)
+    n /= base;
+  return n == 1;
+}
+
+// groups 0, 1 and powers of 3, 5 and 7
+bool MetaDataManager::group_has_super(uint32_t group_id) {
+  if (!(super_.s_feature_ro_compat & EXT4_FEATURE_RO_COMPAT_SPARSE_SUPER) ||
+      group_id <= 1)
+    return true;
+  return test_root(group_id, 3) || test_root(group_id, 5) ||
+         test_root(group_id, 7);
+}
+
+// The super block copies, gdt, bitmaps and inode tables. The journal and
+// the fragment blocks are allocated like data and striped with it.
+void MetaDataManager::ssd_metadata_ranges(
+    std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
+  uint32_t group_count = block_groups_count();
+  uint32_t gdt_blocks =
+      ((uint64_t)group_count * group_desc_size() + block_size() - 1) /
+      block_size();
+  uint32_t inode_table_blocks =
+      ((uint64_t)inodes_per_group() * inode_size() + block_size() - 1) /
+      block_size();
+
+  ranges.clear();
+  for (uint32_t group_id = 0; group_id < group_count; group_id++) {
+    uint64_t start = (uint64_t)group_id * blocks_per_group();
+    if (group_has_super(group_id)) {
+      ranges.emplace_back(start, start + 1 + gdt_blocks +
+                                     super_.s_reserved_gdt_blocks);
+    }
+
+    uint64_t block_bitmap = block_bitmap_block_idx(group_id);
+    uint64_t inode_bitmap = inode_bitmap_block_idx(group_id);
+    uint64_t inode_table = inode_table_block_idx(group_id);
+    ranges.emplace_back(block_bitmap, block_bitmap + 1);
+    ranges.emplace_back(inode_bitmap, inode_bitmap + 1);
+    ranges.emplace_back(inode_table, inode_table + inode_table_blocks);
   }
 
-  for (uint32_t i = 0; i < block_groups_count(); i++) {
-    if (ssd_dirty[i]) {
-      uint64_t bitmap_pblock = block_bitmap_block_idx(i);
-      ssd_bitmap_vec[i].save(bitmap_pblock);
+  // flex_bg packs the bitmaps and the inode tables of many groups together
+  std::sort(ranges.begin(), ranges.end());
+  size_t n = 0;
+  for (auto &range : ranges) {
+    if (n > 0 && range.first <= ranges[n - 1].second) {
+      ranges[n - 1].second = std::max(ranges[n - 1].second, range.second);
+    } else {
+      ranges[n++] = range;
+    }
+  }
+  ranges.resize(n);
+}
+
+uint32_t MetaDataManager::ssd_device_count() {
+  uint32_t count = super_.s_reserved[HYBRID_SSD_COUNT_SLOT];
+  return count == 0 ? 1 : count;
+}
+
+void MetaDataManager::ssd_layout_init() {
+  uint32_t ssd_count = GET_INSTANCE(DiskManager).ssd_count();
+  if (ssd_count == ssd_device_count()) {
+    if (ssd_count > 1) {
+      // the striped copies are found without the mirror, the gdt read
+      // through them tells which blocks are mirrored
+      GET_INSTANCE(DiskManager).set_ssd_layout(super_.s_blocks_count_lo, {});
+      gdt_fill();
+      std::vector<std::pair<uint64_t, uint64_t>> ranges;
+      ssd_metadata_ranges(ranges);
       GET_INSTANCE(DiskManager)
-          .metadata_write(&(gdt_table_.data()[i]), group_desc_size(),
-                          gdt_table_entry_offset(i));
+          .set_ssd_layout(super_.s_blocks_count_lo, ranges);
     }
+    return;
   }
 
-  for (uint32_t i = 0; i < hdd_super_.s_group_count; i++) {
-    if (hdd_dirty[i]) {
-      uint64_t bitmap_pblock = HDD_BLOCK_IDX(hdd_gdt_table_[i].bg_block_bitmap);
-      ssd_bitmap_vec[i].save(bitmap_pblock);
+  if (ssd_device_count() != 1) {
+    LOG(FATAL) << "The filesystem is spread over " << ssd_device_count()
+               << " ssd files, " << ssd_count << " given";
+  }
+
+  // convert a single ssd file, every used block is copied to the files it
+  // belongs to now. The journal is replayed on the old layout first.
+  LOG(INFO) << "Spread the ssd over " << ssd_count << " files";
+  GET_INSTANCE(JournalManager).recover();
+  gdt_fill();
+
+  std::vector<uint64_t> blocks;
+  Bitmap bitmap(block_size());
+  for (uint32_t group_id = 0; group_id < block_groups_count(); group_id++) {
+    bitmap.load(block_bitmap_block_idx(group_id));
+    uint64_t base = (uint64_t)group_id * blocks_per_group();
+    for (uint32_t i = 0; i < blocks_per_group(); i++) {
+      if (bitmap.lookup(i) && base + i < super_.s_blocks_count_lo)
+        blocks.push_back(base + i);
     }
   }
 
-  // update hdd gdt
-  uint32_t hdd_metadata_pblock = HDD_BLOCK_IDX(0);
-  size_t nbyte = hdd_super_.s_group_count * sizeof(hdd_group_desc);
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  ssd_metadata_ranges(ranges);
+  GET_INSTANCE(DiskManager).set_ssd_layout(super_.s_blocks_count_lo, ranges);
+  GET_INSTANCE(DiskManager).ssd_spread(blocks);
+
+  super_.s_reserved[HYBRID_SSD_COUNT_SLOT] = ssd_count;
   GET_INSTANCE(DiskManager)
-      .disk_write(hdd_gdt_table_.data(), nbyte, hdd_metadata_pblock,
-                  sizeof(hdd_super_block));
+      .metadata_write(&super_, sizeof(ext4_super_block), BOOT_SECTOR_SIZE);
+  GET_INSTANCE(DiskManager).disk_sync();
+}
+
+uint32_t MetaDataManager::hdd_device_count() {
+  uint32_t count = super_.s_reserved[HYBRID_HDD_COUNT_SLOT];
+  return count == 0 ? 1 : count;
+}
+
+bool MetaDataManager::wide_pblocks() {
+  uint64_t hdd_blocks = (uint64_t)hdd_super_.s_group_count * hdd_blocks_per_group();
+  return hdd_blocks > HDD_MASK32 || super_.s_blocks_count_lo > HDD_MASK32;
 }
 
 void MetaDataManager::hdd_disk_init() {
-  uint32_t hdd_metadata_pblock = HDD_BLOCK_IDX(0);
-  GET_INSTANCE(DiskManager)
-      .disk_read(&hdd_super_, sizeof(hdd_super_block), hdd_metadata_pblock, 0);
+  if (hdd_disk_load())
+    return;
+
+  pblock_t hdd_metadata_pblock = HDD_BLOCK_IDX(0);
+  uint32_t hdd_count = GET_INSTANCE(DiskManager).hdd_count();
 
   // initialize hdd group
-  if (hdd_super_.s_group_count == 0) {
-    // blocks per group = block_size() * 8
-    uint32_t hdd_blocks_per_group = block_size() * 8;
-    uint32_t hdd_group_count =
-        hdd_super_.s_file_size / (hdd_blocks_per_group * block_size());
-
-    // update hdd metadata
-    hdd_super_.s_group_count = hdd_group_count;
-    hdd_gdt_table_.resize(hdd_super_.s_group_count);
-
-    uint32_t hdd_gdt_blocks_count =
-        1 + (sizeof(hdd_super_block) +
-             hdd_group_count * sizeof(hdd_group_desc) - 1) /
-                block_size();
-
-    // Initialize bitmap
-    uint32_t hdd_bitmap_pblock;
-    Bitmap bitmap(block_size());
-    bitmap.set(0);
+  uint32_t hdd_blocks_per_group = this->hdd_blocks_per_group();
+  // each hdd file holds the same number of groups
+  uint32_t hdd_group_count =
+      hdd_super_.s_file_size / hdd_count /
+      ((uint64_t)hdd_blocks_per_group * block_size()) * hdd_count;
 
-    // Setup other group
-    for (uint32_t group_id = 1; group_id < hdd_super_.s_group_count;
-         group_id++) {
-      hdd_bitmap_pblock = HDD_BLOCK_IDX(hdd_blocks_per_group * group_id);
-      hdd_gdt_table_[group_id] = {hdd_blocks_per_group - 1, hdd_bitmap_pblock};
+  super_.s_reserved[HYBRID_HDD_COUNT_SLOT] = hdd_count;
+  GET_INSTANCE(DiskManager)
+      .metadata_write(&super_, sizeof(ext4_super_block), BOOT_SECTOR_SIZE);
 
-      // setup bitmap
-      bitmap.save(hdd_bitmap_pblock);
-    }
+  // update hdd metadata
+  hdd_super_.s_group_count = hdd_group_count;
+  hdd_gdt_table_.resize(hdd_super_.s_group_count);
+  hdd_group_mutex_.reset(new std::mutex[hdd_group_count]);
 
-    // set first group
-    hdd_bitmap_pblock = HDD_BLOCK_IDX(hdd_gdt_blocks_count);
-    hdd_gdt_table_[0] = {hdd_blocks_per_group - hdd_gdt_blocks_count - 1,
-                         hdd_bitmap_pblock};
+  uint32_t hdd_gdt_blocks_count =
+      1 + (sizeof(hdd_super_block) +
+           hdd_group_count * sizeof(hdd_group_desc) - 1) /
+              block_size();
 
-    // setup first group bitmap
-    for (uint32_t i = 0; i <= hdd_gdt_blocks_count; i++) {
-      bitmap.set(i);
-    }
+  // Initialize bitmap
+  pblock_t hdd_bitmap_pblock;
+  Bitmap bitmap(block_size());
+  bitmap.set(0);
+
+  // Setup other group
+  for (uint32_t group_id = 1; group_id < hdd_super_.s_group_count;
+       group_id++) {
+    hdd_bitmap_pblock =
+        HDD_BLOCK_IDX((pblock_t)hdd_blocks_per_group * group_id);
+    hdd_gdt_table_[group_id] = {hdd_blocks_per_group - 1, hdd_bitmap_pblock};
+
+    // setup bitmap
     bitmap.save(hdd_bitmap_pblock);
+  }
 
-    // update hdd disk content
-    GET_INSTANCE(DiskManager)
-        .disk_write(&hdd_super_, sizeof(hdd_super_block), hdd_metadata_pblock,
-                    0);
+  // set first group
+  hdd_bitmap_pblock = HDD_BLOCK_IDX(hdd_gdt_blocks_count);
+  hdd_gdt_table_[0] = {hdd_blocks_per_group - hdd_gdt_blocks_count - 1,
+                       hdd_bitmap_pblock};
 
-    // update hdd gdt
-    size_t nbyte = hdd_group_count * sizeof(hdd_group_desc);
-    GET_INSTANCE(DiskManager)
-        .disk_write(hdd_gdt_table_.data(), nbyte, hdd_metadata_pblock,
-                    sizeof(hdd_super_block));
-  } else {
-    uint32_t hdd_group_count = hdd_super_.s_group_count;
-    hdd_gdt_table_.resize(hdd_group_count);
+  // setup first group bitmap
+  for (uint32_t i = 0; i <= hdd_gdt_blocks_count; i++) {
+    bitmap.set(i);
+  }
+  bitmap.save(hdd_bitmap_pblock);
 
-    size_t nbyte = hdd_group_count * sizeof(hdd_group_desc);
-    GET_INSTANCE(DiskManager)
-        .disk_read(hdd_gdt_table_.data(), nbyte, hdd_metadata_pblock,
-                   sizeof(hdd_super_block));
+  // update hdd disk content
+  GET_INSTANCE(DiskManager)
+      .metadata_write(&hdd_super_, sizeof(hdd_super_block), hdd_metadata_pblock,
+                  0);
+
+  // update hdd gdt
+  size_t nbyte = hdd_group_count * sizeof(hdd_group_desc);
+  GET_INSTANCE(DiskManager)
+      .metadata_write(hdd_gdt_table_.data(), nbyte, hdd_metadata_pblock,
+                  sizeof(hdd_super_block));
+
+  LOG(INFO) << "Hdd metadata:";
+  LOG(INFO) << "hdd_file_size: " << hdd_super_.s_file_size;
+  LOG(INFO) << "hdd_group_count: " << hdd_super_.s_group_count;
+
+  build_hdd_extents();
+}
+
+bool MetaDataManager::hdd_disk_load() {
+  pblock_t hdd_metadata_pblock = HDD_BLOCK_IDX(0);
+  uint32_t hdd_count = GET_INSTANCE(DiskManager).hdd_count();
+  GET_INSTANCE(DiskManager)
+      .metadata_read(&hdd_super_, sizeof(hdd_super_block), hdd_metadata_pblock, 0);
+  if (hdd_super_.s_group_count == 0)
+    return false;
+
+  if (hdd_device_count() != hdd_count) {
+    LOG(FATAL) << "The filesystem is striped over " << hdd_device_count()
+               << " hdd files, " << hdd_count << " given";
   }
 
+  uint32_t hdd_group_count = hdd_super_.s_group_count;
+  hdd_gdt_table_.resize(hdd_group_count);
+  hdd_group_mutex_.reset(new std::mutex[hdd_group_count]);
+
+  size_t nbyte = hdd_group_count * sizeof(hdd_group_desc);
+  GET_INSTANCE(DiskManager)
+      .metadata_read(hdd_gdt_table_.data(), nbyte, hdd_metadata_pblock,
+                 sizeof(hdd_super_block));
+
   LOG(INFO) << "Hdd metadata:";
   LOG(INFO) << "hdd_file_size: " << hdd_super_.s_file_size;
   LOG(INFO) << "hdd_group_count: " << hdd_super_.s_group_count;
+
+  build_hdd_extents();
+  return true;
 }
 
+void MetaDataManager::set_fallocate_tier(Tier tier) { fallocate_tier_ = tier; }
+
+Tier MetaDataManager::fallocate_tier() { return fallocate_tier_; }
+
 void MetaDataManager::log_hdd_stat() {
-  uint32_t block_count = hdd_super_.s_file_size / block_size();
+  uint64_t block_count = hdd_super_.s_file_size / block_size();
   for (uint32_t i = 0; i < hdd_gdt_table_.size(); i++) {
     block_count -= hdd_gdt_table_[i].bg_free_blocks_count;
   }
-  LOG(INFO) << "HDD occupy " << block_count << " blocks";
+  std::lock_guard extent_lock(hdd_extent_mutex_);
+  LOG(INFO) << "HDD occupy " << block_count << " blocks, "
+            << hdd_extents_.extent_count() << " free extents";
 }
\ No newline at end of file
@@ -0,0 +1,57 @@
+#include "buffer_pool.h"
+#include <cstdlib>
+#include <glog/logging.h>
+
+// keep at most this many free buffers of each size
+#define MAX_FREE_BUFS_PER_SIZE 64
+// larger buffers are not kept
+#define MAX_POOLED_BUF_SIZE (1 << 20)
+
+static size_t round_size(size_t size) {
+  return (size + DIRECT_IO_ALIGN - 1) / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+}
+
+AlignedBufferPool &AlignedBufferPool::get_instance() {
+  static AlignedBufferPool instance;
+  return instance;
+}
+
+void *AlignedBufferPool::get(size_t size) {
+  size = round_size(size);
+  {
+    std::lock_guard lock(mutex_);
+    auto &bufs = free_bufs_[size];
+    if (!bufs.empty()) {
+      void *buf = bufs.back();
+      bufs.pop_back();
+      return buf;
+    }
+  }
+
+  void *buf = nullptr;
+  if (posix_memalign(&buf, DIRECT_IO_ALIGN, size) != 0) {
+    LOG(FATAL) << "Allocate aligned buffer of " << size << " bytes failed!";
+  }
+  return buf;
+}
+
+void AlignedBufferPool::put(void *buf, size_t size) {
+  size = round_size(size);
+  if (size <= MAX_POOLED_BUF_SIZE) {
+    std::lock_guard lock(mutex_);
+    auto &bufs = free_bufs_[size];
+    if (bufs.size() < MAX_FREE_BUFS_PER_SIZE) {
+      bufs.push_back(buf);
+      return;
+    }
+  }
+  free(buf);
+}
+
+AlignedBufferPool::~AlignedBufferPool() {
+  for (auto &[size, bufs] : free_bufs_) {
+    for (void *buf : bufs) {
+      free(buf);
+    }
+  }
+}
@@ -0,0 +1,270 @@
+#include "defrag.h"
+#include "MetaData.h"
+#include "common.h"
+#include "disk.h"
+#include "inode.h"
+#include "journal.h"
+#include "types/ext4_inode.h"
+#include "writeback.h"
+#include <algorithm>
+#include <cstddef>
+#include <glog/logging.h>
+
+// blocks looked at (and locked) at a time
+#define DEFRAG_CHUNK_BLOCKS 256
+
+DefragManager &DefragManager::get_instance() {
+  static DefragManager instance;
+  return instance;
+}
+
+DefragManager::DefragManager() : rate_(0), running_(false), stop_(false) {}
+
+void DefragManager::set_rate(uint64_t rate) { rate_ = rate; }
+
+void DefragManager::start() {
+  if (running_)
+    return;
+  stop_ = false;
+  running_ = true;
+  thread_ = std::thread(&DefragManager::defrag_thread, this);
+}
+
+void DefragManager::shutdown() {
+  if (!running_)
+    return;
+
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  running_ = false;
+
+  // the queue is not persistent
+  queue_.clear();
+  queued_.clear();
+}
+
+bool DefragManager::enqueue(uint32_t inode_idx) {
+  {
+    std::lock_guard lock(mutex_);
+    if (!queued_.insert(inode_idx).second)
+      return false;
+    queue_.push_back(inode_idx);
+  }
+  cv_.notify_all();
+  return true;
+}
+
+std::shared_mutex &DefragManager::inode_lock(uint32_t inode_idx) {
+  return inode_locks_[inode_idx % DEFRAG_LOCKS];
+}
+
+std::vector<std::shared_lock<std::shared_mutex>> DefragManager::lock_all() {
+  std::vector<std::shared_lock<std::shared_mutex>> locks;
+  for (auto &inode_lock : inode_locks_)
+    locks.emplace_back(inode_lock);
+  return locks;
+}
+
+void DefragManager::defrag_thread() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [&] { return stop_ || !queue_.empty(); });
+    if (stop_)
+      break;
+
+    uint32_t inode_idx = queue_.front();
+    queue_.pop_front();
+    lock.unlock();
+    defrag_file(inode_idx);
+    lock.lock();
+    queued_.erase(inode_idx);
+  }
+}
+
+void DefragManager::defrag_file(uint32_t inode_idx) {
+  LOG(INFO) << "Defrag inode " << inode_idx << " begin";
+  uint32_t block_size = GET_INSTANCE(MetaDataManager).block_size();
+  uint64_t blocks;
+  {
+    std::shared_lock lock(inode_lock(inode_idx));
+    ext4_inode inode;
+    if (GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode) < 0)
+      return;
+    blocks = (GET_INSTANCE(InodeManager).get_file_size(inode) + block_size -
+              1) /
+             block_size;
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  uint64_t copied = 0;
+  pblock_t goal = 0;
+  for (uint64_t lblock = 0; lblock < blocks; lblock += DEFRAG_CHUNK_BLOCKS) {
+    uint32_t count = std::min((uint64_t)DEFRAG_CHUNK_BLOCKS, blocks - lblock);
+    int64_t bytes = defrag_chunk(inode_idx, lblock, count, goal);
+    if (bytes < 0)
+      break;
+
+    copied += bytes;
+    if (!throttle(begin, copied))
+      break;
+  }
+
+  LOG(INFO) << "Defrag inode " << inode_idx << " done, " << copied
+            << " bytes moved";
+}
+
+uint64_t DefragManager::demote_file(uint32_t inode_idx) {
+  uint32_t block_size = GET_INSTANCE(MetaDataManager).block_size();
+  uint64_t blocks;
+  {
+    std::shared_lock lock(inode_lock(inode_idx));
+    ext4_inode inode;
+    if (GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode) < 0)
+      return 0;
+    blocks = (GET_INSTANCE(InodeManager).get_file_size(inode) + block_size -
+              1) /
+             block_size;
+  }
+
+  uint64_t moved = 0;
+  pblock_t goal = 0;
+  for (uint64_t lblock = 0; lblock < blocks; lblock += DEFRAG_CHUNK_BLOCKS) {
+    uint32_t count = std::min((uint64_t)DEFRAG_CHUNK_BLOCKS, blocks - lblock);
+    int64_t bytes = defrag_chunk(inode_idx, lblock, count, goal, true);
+    if (bytes < 0)
+      break;
+    moved += bytes / block_size;
+  }
+  if (moved > 0)
+    LOG(INFO) << "Demote inode " << inode_idx << ", " << moved << " blocks";
+  return moved;
+}
+
+int64_t DefragManager::defrag_chunk(uint32_t inode_idx, uint32_t lblock,
+                                    uint32_t count, pblock_t &goal,
+                                    bool demote) {
+  auto &inode_manager = GET_INSTANCE(InodeManager);
+  auto &meta = GET_INSTANCE(MetaDataManager);
+  uint32_t block_size = meta.block_size();
+
+  JournalManager::Handle handle;
+  // delayed data has no block yet, write it back first; if more comes in
+  // before the lock is taken the chunk is left alone
+  GET_INSTANCE(WriteBackManager).flush(inode_idx);
+  std::unique_lock lock(inode_lock(inode_idx));
+  if (GET_INSTANCE(WriteBackManager).has_dirty(inode_idx))
+    return 0;
+
+  // the file may have been deleted since the last chunk
+  ext4_inode inode;
+  if (!meta.inode_in_use(inode_idx) ||
+      inode_manager.get_inode_by_idx(inode_idx, inode) < 0 ||
+      (inode.i_mode & S_IFMT) != S_IFREG || inode_manager.is_inline(inode) ||
+      inode_manager.is_frag(inode))
+    return -1;
+
+  uint64_t file_blocks =
+      (inode_manager.get_file_size(inode) + block_size - 1) / block_size;
+  if (lblock >= file_blocks)
+    return -1;
+  count = std::min((uint64_t)count, file_blocks - lblock);
+
+  std::vector<pblock_t> pblock_vec;
+  inode_manager.get_data_pblocks(inode, lblock, count, pblock_vec);
+
+  // blocks on the other tier of a pinned file are moved to the pinned one
+  Tier pin = inode_manager.tier_hint(inode);
+  if (demote && pin == Tier::SSD)
+    return -1;
+  if (demote)
+    pin = Tier::HDD;
+  auto misplaced = [&](pblock_t pblock) {
+    bool hdd = (pblock & HDD_MASK) != 0;
+    return pblock != 0 &&
+           ((pin == Tier::SSD && hdd) || (pin == Tier::HDD && !hdd));
+  };
+
+  std::vector<pblock_t> old_vec;
+  uint32_t i = 0;
+  while (i < count) {
+    uint32_t j = i + 1;
+    std::vector<pblock_t> new_vec;
+    if (misplaced(pblock_vec[i])) {
+      while (j < count && misplaced(pblock_vec[j]))
+        j++;
+      meta.alloc_new_pblocks(lblock + i, j - i, new_vec, pin,
+                             pin == Tier::HDD ? goal : 0);
+    } else if (!demote && (pblock_vec[i] & HDD_MASK) != 0) {
+      // a run of mapped hdd blocks, moved only if it is not contiguous
+      bool contiguous = true;
+      while (j < count && (pblock_vec[j] & HDD_MASK) != 0) {
+        contiguous &= pblock_vec[j] == pblock_vec[j - 1] + 1;
+        j++;
+      }
+      if (contiguous || meta.hdd_largest_extent() < j - i) {
+        goal = pblock_vec[j - 1] + 1;
+        i = j;
+        continue;
+      }
+
+      meta.alloc_new_hdd_pblocks(j - i, new_vec, goal);
+      if (new_vec.back() != new_vec.front() + (j - i) - 1) {
+        // raced with another allocation, the free space is too fragmented
+        meta.free_pblock(new_vec);
+        goal = pblock_vec[j - 1] + 1;
+        i = j;
+        continue;
+      }
+    } else {
+      i++;
+      continue;
+    }
+
+    uint32_t n = j - i;
+    std::vector<std::byte> buf((size_t)n * block_size);
+    BlockIoBatch read_batch(block_size);
+    BlockIoBatch write_batch(block_size);
+    for (uint32_t k = 0; k < n; k++) {
+      read_batch.add(pblock_vec[i + k], buf.data() + (size_t)k * block_size,
+                     block_size);
+      write_batch.add(new_vec[k],
+                      (const void *)(buf.data() + (size_t)k * block_size),
+                      block_size);
+    }
+    read_batch.read();
+    write_batch.write();
+
+    for (uint32_t k = 0; k < n; k++) {
+      inode_manager.set_data_pblock(inode, lblock + i + k, new_vec[k]);
+      old_vec.push_back(pblock_vec[i + k]);
+    }
+    if ((new_vec.back() & HDD_MASK) != 0)
+      goal = new_vec.back() + 1;
+    i = j;
+  }
+
+  if (old_vec.empty())
+    return 0;
+
+  // the old blocks are only reused after the new map is committed
+  inode_manager.update_disk_inode(inode_idx, inode);
+  meta.free_pblock(old_vec);
+  LOG(INFO) << "Defrag inode " << inode_idx << ": moved " << old_vec.size()
+            << " blocks of [" << lblock << ", " << lblock + count << ")";
+  return (int64_t)old_vec.size() * block_size;
+}
+
+bool DefragManager::throttle(std::chrono::steady_clock::time_point begin,
+                             uint64_t bytes) {
+  std::unique_lock lock(mutex_);
+  if (rate_ != 0) {
+    auto deadline =
+        begin + std::chrono::microseconds(bytes * 1000000 / rate_);
+    cv_.wait_until(lock, deadline, [&] { return stop_; });
+  }
+  return !stop_;
+}
@@ -0,0 +1,136 @@
+#include "demote.h"
+#include "MetaData.h"
+#include "common.h"
+#include "defrag.h"
+#include "inode.h"
+#include "journal.h"
+#include "types/ext4_inode.h"
+#include <chrono>
+#include <glog/logging.h>
+#include <vector>
+
+// how often the ssd usage is checked without a wake up
+#define DEMOTE_INTERVAL std::chrono::seconds(1)
+// free hdd blocks left when the demotion gives up
+#define DEMOTE_MIN_HDD_FREE 1024
+
+DemoteManager &DemoteManager::get_instance() {
+  static DemoteManager instance;
+  return instance;
+}
+
+DemoteManager::DemoteManager()
+    : cursor_(ROOT_INODE), idle_target_(0), running_(false), stop_(false), woken_(false) {}
+
+void DemoteManager::start() {
+  if (running_)
+    return;
+  stop_ = false;
+  running_ = true;
+  thread_ = std::thread(&DemoteManager::demote_thread, this);
+}
+
+void DemoteManager::shutdown() {
+  if (!running_)
+    return;
+
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  running_ = false;
+}
+
+void DemoteManager::wake() {
+  {
+    std::lock_guard lock(mutex_);
+    woken_ = true;
+  }
+  cv_.notify_all();
+}
+
+void DemoteManager::demote_thread() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    cv_.wait_for(lock, DEMOTE_INTERVAL, [&] { return stop_ || woken_; });
+    if (stop_)
+      break;
+    woken_ = false;
+
+    uint64_t target = GET_INSTANCE(MetaDataManager).ssd_demote_target();
+    // the last sweep found nothing to move, wait for the usage or the
+    // watermarks to change the target
+    if (target == 0 || target == idle_target_)
+      continue;
+
+    lock.unlock();
+    LOG(INFO) << "Demote " << target << " blocks from the ssd";
+    uint64_t moved = demote(target);
+    // the moved blocks are only freed at commit, the next check would see
+    // the ssd as full as before
+    if (GET_INSTANCE(JournalManager).active())
+      GET_INSTANCE(JournalManager).commit();
+    LOG(INFO) << "Demote done, " << moved << " blocks moved";
+    idle_target_ =
+        moved == 0 ? GET_INSTANCE(MetaDataManager).ssd_demote_target() : 0;
+    lock.lock();
+  }
+}
+
+uint64_t DemoteManager::demote(uint64_t count) {
+  auto &meta = GET_INSTANCE(MetaDataManager);
+  auto &inode_manager = GET_INSTANCE(InodeManager);
+  uint32_t inodes = meta.inodes_count();
+  uint32_t per_group = meta.inodes_per_group();
+
+  uint64_t moved = 0;
+  uint64_t scanned = 0;
+  bool done = false;
+  std::vector<uint32_t> inode_vec;
+  // one bitmap read per group, the free inodes are never looked at
+  while (!done && moved < count && scanned < inodes) {
+    uint32_t group_id = (cursor_ - 1) / per_group;
+    uint32_t begin = cursor_;
+    uint32_t next = (group_id + 1) * per_group + 1;
+    inode_vec.clear();
+    meta.group_inodes_in_use(group_id, inode_vec);
+
+    for (uint32_t inode_idx : inode_vec) {
+      if (inode_idx < begin)
+        continue;
+      if (moved >= count) {
+        next = inode_idx;
+        break;
+      }
+      {
+        std::lock_guard lock(mutex_);
+        done = stop_;
+      }
+      // the hdd has to hold what comes off the ssd
+      if (!done && meta.hdd_free_blocks() < DEMOTE_MIN_HDD_FREE) {
+        LOG(WARNING) << "Demote stopped, the hdd is full";
+        done = true;
+      }
+      if (done) {
+        next = inode_idx;
+        break;
+      }
+
+      // a hint only, the file is checked again under its lock
+      ext4_inode inode;
+      if (inode_manager.get_inode_by_idx(inode_idx, inode) < 0 ||
+          (inode.i_mode & S_IFMT) != S_IFREG ||
+          inode_manager.is_inline(inode) || inode_manager.is_frag(inode) ||
+          inode_manager.tier_hint(inode) == Tier::SSD)
+        continue;
+
+      moved += GET_INSTANCE(DefragManager).demote_file(inode_idx);
+    }
+
+    scanned += next - begin;
+    cursor_ = next > inodes ? ROOT_INODE : next;
+  }
+  return moved;
+}
@@ -1,72 +1,375 @@
 #include "disk.h"
+#include "buffer_pool.h"
+#include "journal.h"
 #include "types/hdd_super.h"
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
+#include <climits>
+#include <cstring>
 #include <fcntl.h>
 #include <glog/logging.h>
 #include <shared_mutex>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 #define BLOCKS2BYTES(__blks) ((uint64_t)(__blks)*block_size_)
+// data blocks are striped over the ssds in units of this many blocks
+#define SSD_STRIPE_BLOCKS 16
+// ssd_spread copies at most this many blocks at once
+#define SSD_SPREAD_BLOCKS 256
 
 static ssize_t pread_wrapper(int fd, void *buf, size_t nbytes, off_t offset);
 static ssize_t pwrite_wrapper(int fd, const void *buf, size_t nbytes, off_t offset);
+static ssize_t preadv_wrapper(int fd, std::vector<iovec> iov, off_t offset);
+static ssize_t pwritev_wrapper(int fd, std::vector<iovec> iov, off_t offset);
 
 DiskManager &DiskManager::get_instance() {
   static DiskManager instance;
   return instance;
 }
 
-void DiskManager::disk_open(std::string ssd_filename,
-                            std::string hdd_filename) {
-  ssd_fd_ = open(ssd_filename.c_str(), O_RDWR);
-  if (ssd_fd_ < 0) {
-    LOG(FATAL) << "Open " << ssd_filename << " failed!";
+IoQueue::IoQueue() : stop_(false), thread_(&IoQueue::run, this) {}
+
+IoQueue::~IoQueue() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+}
+
+void IoQueue::push(std::function<void()> io) {
+  {
+    std::lock_guard lock(mutex_);
+    ios_.push_back(std::move(io));
+  }
+  cv_.notify_one();
+}
+
+void IoQueue::run() {
+  std::unique_lock lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this] { return stop_ || !ios_.empty(); });
+    if (ios_.empty())
+      return;
+
+    auto io = std::move(ios_.front());
+    ios_.pop_front();
+    lock.unlock();
+    io();
+    lock.lock();
   }
+}
+
+void DiskManager::open_devices(const std::vector<std::string> &filenames,
+                               int flags, std::vector<Device> &devs,
+                               uint64_t &min_size) {
+  min_size = UINT64_MAX;
+  for (auto &filename : filenames) {
+    int fd = open(filename.c_str(), flags);
+    if (fd < 0) {
+      LOG(FATAL) << "Open " << filename << " failed!";
+    }
 
-  hdd_fd_ = open(hdd_filename.c_str(), O_RDWR);
-  if (hdd_fd_ < 0) {
-    LOG(FATAL) << "Open " << hdd_filename << " failed!";
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1) {
+      LOG(FATAL) << "Get " << filename << " stat failed!";
+    }
+    min_size = std::min(min_size, (uint64_t)file_stat.st_size);
+
+    devs.push_back({fd, std::make_unique<std::shared_mutex>(),
+                    std::make_unique<IoQueue>()});
   }
+}
+
+void DiskManager::disk_open(const std::vector<std::string> &ssd_filenames,
+                            const std::vector<std::string> &hdd_filenames,
+                            bool direct_io, bool read_only) {
+  direct_io_ = direct_io;
+  int flags = (read_only ? O_RDONLY : O_RDWR) | (direct_io_ ? O_DIRECT : 0);
+
+  if (ssd_filenames.empty() || hdd_filenames.empty()) {
+    LOG(FATAL) << "Both ssd and hdd files are required!";
+  }
+
+  // the ssd file sizes are checked once the layout is known
+  uint64_t min_ssd_size;
+  open_devices(ssd_filenames, flags, ssds_, min_ssd_size);
+
+  // every hdd holds the same number of groups, bounded by the smallest one
+  uint64_t min_hdd_size;
+  open_devices(hdd_filenames, flags, hdds_, min_hdd_size);
 
   // check if hdd file initialize
   hdd_super_block hdd_super_;
   hdd_disk_read(&hdd_super_, sizeof(hdd_super_block), 0);
-  if (hdd_super_.s_file_size == 0) {
-    struct stat hdd_file_stat;
-    int ret = fstat(hdd_fd_, &hdd_file_stat);
-    if (ret == -1) {
-      LOG(FATAL) << "Get " << hdd_filename << " stat failed!";
+  if (hdd_super_.s_file_size == 0 && !read_only) {
+    hdd_super_.s_file_size = min_hdd_size * hdds_.size();
+    hdd_disk_write(&hdd_super_, sizeof(hdd_super_block), 0);
+  }
+}
+
+uint32_t DiskManager::ssd_count() { return ssds_.size(); }
+
+uint32_t DiskManager::hdd_count() { return hdds_.size(); }
+
+void DiskManager::set_ssd_layout(
+    uint64_t blocks_count,
+    const std::vector<std::pair<uint64_t, uint64_t>> &metadata) {
+  assert(block_size_ > 0);
+  uint32_t n = ssds_.size();
+  uint64_t units = (blocks_count + SSD_STRIPE_BLOCKS - 1) / SSD_STRIPE_BLOCKS;
+  ssd_stripe_blocks_ = (units + n - 1) / n * SSD_STRIPE_BLOCKS;
+
+  ssd_mirror_.clear();
+  std::vector<uint64_t> rank(n, 0);
+  for (auto &[begin, end] : metadata) {
+    ssd_mirror_.push_back({begin, end, rank});
+    for (uint32_t dev = 0; dev < n; dev++)
+      rank[dev] += ssd_dev_blocks(dev, end) - ssd_dev_blocks(dev, begin);
+  }
+
+  // ssd d holds its stripes and the mirror of the metadata of ssd d - 1
+  for (uint32_t dev = 0; dev < n; dev++) {
+    uint64_t need = BLOCKS2BYTES(ssd_stripe_blocks_ + rank[(dev + n - 1) % n]);
+    struct stat file_stat;
+    if (fstat(ssds_[dev].fd, &file_stat) == -1) {
+      LOG(FATAL) << "Get ssd file stat failed!";
+    }
+    if ((uint64_t)file_stat.st_size < need) {
+      LOG(FATAL) << "Ssd file #" << dev << " needs " << need << " bytes";
     }
+  }
+  ssd_layout_set_ = true;
+}
 
-    hdd_super_.s_file_size = hdd_file_stat.st_size;
-    hdd_disk_write(&hdd_super_, sizeof(hdd_super_block), 0);
+// Blocks only move down on the first ssd, so copying them in ascending order
+// never overwrites a block not copied yet. The mirror copies may land on
+// the old place of any block and are written once everything has moved.
+void DiskManager::ssd_spread(const std::vector<uint64_t> &blocks) {
+  assert(ssd_layout_set_ && block_size_ > 0);
+
+  // copy runs of consecutive blocks
+  std::vector<std::byte> buf;
+  size_t i = 0;
+  while (i < blocks.size()) {
+    size_t j = i + 1;
+    while (j < blocks.size() && j - i < SSD_SPREAD_BLOCKS &&
+           blocks[j] == blocks[j - 1] + 1)
+      j++;
+
+    buf.resize(BLOCKS2BYTES(j - i));
+    off_t offset = BLOCKS2BYTES(blocks[i]);
+    dev_pread(ssds_[0].fd, *ssds_[0].mutex, buf.data(), buf.size(), offset);
+
+    std::vector<IoSegment> segments;
+    ssd_split({{buf.data(), buf.size()}}, offset, true, segments, false);
+    run_segments(segments, true);
+    i = j;
+  }
+
+  for (auto &range : ssd_mirror_) {
+    for (uint64_t block = range.begin; block < range.end;
+         block += SSD_SPREAD_BLOCKS) {
+      uint64_t count = std::min((uint64_t)SSD_SPREAD_BLOCKS, range.end - block);
+      buf.resize(BLOCKS2BYTES(count));
+      off_t offset = BLOCKS2BYTES(block);
+      std::vector<IoSegment> segments;
+      ssd_split({{buf.data(), buf.size()}}, offset, false, segments, false);
+      run_segments(segments, false);
+      segments.clear();
+      ssd_split({{buf.data(), buf.size()}}, offset, true, segments);
+      run_segments(segments, true);
+    }
   }
 }
 
 ssize_t DiskManager::metadata_read(void *buf, size_t nbytes, off_t offset) {
-  std::shared_lock lock(ssd_mutex_);
-  return pread_wrapper(ssd_fd_, buf, nbytes, offset);
+  if (void *ptr = metadata_ptr(offset, nbytes)) {
+    memcpy(buf, ptr, nbytes);
+    return nbytes;
+  }
+  if (JournalManager::get_instance().active())
+    return JournalManager::get_instance().read(buf, nbytes, 0, offset);
+  return ssd_disk_read(buf, nbytes, offset);
 }
 
 ssize_t DiskManager::metadata_write(const void *buf, size_t nbytes, off_t offset) {
-  std::shared_lock lock(ssd_mutex_);
-  return pwrite_wrapper(ssd_fd_, buf, nbytes, offset);
+  if (void *ptr = metadata_ptr(offset, nbytes)) {
+    memcpy(ptr, buf, nbytes);
+    metadata_mark_dirty(offset, nbytes);
+    return nbytes;
+  }
+  if (JournalManager::get_instance().active())
+    return JournalManager::get_instance().write(buf, nbytes, 0, offset);
+  return ssd_disk_write(buf, nbytes, offset);
+}
+
+ssize_t DiskManager::metadata_read(void *buf, size_t nbytes, pblock_t pblock,
+                                   off_t pblock_offset) {
+  if (JournalManager::get_instance().active())
+    return JournalManager::get_instance()
+        .read(buf, nbytes, pblock, pblock_offset);
+  return disk_read(buf, nbytes, pblock, pblock_offset);
+}
+
+ssize_t DiskManager::metadata_write(const void *buf, size_t nbytes,
+                                    pblock_t pblock, off_t pblock_offset) {
+  if (JournalManager::get_instance().active())
+    return JournalManager::get_instance()
+        .write(buf, nbytes, pblock, pblock_offset);
+  return disk_write(buf, nbytes, pblock, pblock_offset);
+}
+
+ssize_t DiskManager::metadata_block_read(void *buf, pblock_t pblock) {
+  return metadata_read(buf, block_size_, pblock, 0);
+}
+
+ssize_t DiskManager::metadata_block_write(const void *buf, pblock_t pblock) {
+  return metadata_write(buf, block_size_, pblock, 0);
+}
+
+ssize_t DiskManager::metadata_block_readv(const std::vector<iovec> &iov,
+                                          pblock_t pblock) {
+  if (JournalManager::get_instance().active())
+    return JournalManager::get_instance().readv(iov, pblock);
+  return disk_block_readv(iov, pblock);
+}
+
+ssize_t DiskManager::metadata_block_writev(const std::vector<iovec> &iov,
+                                           pblock_t pblock) {
+  if (JournalManager::get_instance().active())
+    return JournalManager::get_instance().writev(iov, pblock);
+  return disk_block_writev(iov, pblock);
 }
 
-ssize_t DiskManager::disk_read(void *buf, size_t nbyte, uint32_t pblock, off_t pblock_offset) {
+void DiskManager::disk_sync() {
+  metadata_sync();
+
+  // flush all the devices in parallel
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t pending = ssds_.size() + hdds_.size();
+  for (auto *devs : {&ssds_, &hdds_}) {
+    for (auto &dev : *devs) {
+      dev.queue->push([&, fd = dev.fd] {
+        if (fdatasync(fd) == -1) {
+          LOG(FATAL) << "Sync disk failed! Errno: " << errno;
+        }
+        std::lock_guard lock(mutex);
+        if (--pending == 0)
+          cv.notify_one();
+      });
+    }
+  }
+  std::unique_lock lock(mutex);
+  cv.wait(lock, [&] { return pending == 0; });
+}
+
+void DiskManager::set_metadata_mmap(bool enabled) { mmap_enabled_ = enabled; }
+
+bool DiskManager::metadata_mmap_enabled() { return mmap_enabled_; }
+
+// Only the fixed metadata is mapped, the data blocks around it keep going
+// through pread and pwrite.
+void DiskManager::metadata_mmap(
+    const std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
+  assert(ssds_.size() == 1 && metadata_maps_.empty());
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t total = 0;
+  for (auto &range : ranges) {
+    // blocks smaller than a page share it with their neighbours
+    off_t begin = BLOCKS2BYTES(range.first);
+    off_t end = BLOCKS2BYTES(range.second);
+    off_t map_begin = begin / page_size * page_size;
+    void *addr = mmap(nullptr, end - map_begin, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, ssds_[0].fd, map_begin);
+    if (addr == MAP_FAILED) {
+      LOG(FATAL) << "Mmap ssd metadata failed! Errno: " << errno;
+    }
+    metadata_maps_.push_back(
+        {begin, end, (std::byte *)addr + (begin - map_begin)});
+    total += end - map_begin;
+  }
+  LOG(INFO) << "Mmap " << total << " bytes of ssd metadata in "
+            << metadata_maps_.size() << " ranges";
+}
+
+void *DiskManager::metadata_ptr(off_t offset, size_t nbytes) {
+  // the ranges are sorted and disjoint
+  auto it = std::upper_bound(
+      metadata_maps_.begin(), metadata_maps_.end(), offset,
+      [](off_t value, const MappedRange &map) { return value < map.begin; });
+  if (it == metadata_maps_.begin())
+    return nullptr;
+  --it;
+  if ((off_t)(offset + nbytes) > it->end)
+    return nullptr;
+  return it->addr + (offset - it->begin);
+}
+
+void *DiskManager::metadata_block_ptr(pblock_t pblock) {
+  if ((pblock & HDD_MASK) != 0)
+    return nullptr;
+  return metadata_ptr(BLOCKS2BYTES(pblock), block_size_);
+}
+
+void DiskManager::metadata_mark_dirty(off_t offset, size_t nbytes) {
+  std::lock_guard lock(dirty_mutex_);
+  if (dirty_begin_ == dirty_end_) {
+    dirty_begin_ = offset;
+    dirty_end_ = offset + nbytes;
+  } else {
+    dirty_begin_ = std::min(dirty_begin_, offset);
+    dirty_end_ = std::max(dirty_end_, (off_t)(offset + nbytes));
+  }
+}
+
+// flush the dirty part of the mapped metadata
+void DiskManager::metadata_sync() {
+  if (metadata_maps_.empty())
+    return;
+
+  off_t begin, end;
+  {
+    std::lock_guard lock(dirty_mutex_);
+    begin = dirty_begin_;
+    end = dirty_end_;
+    dirty_begin_ = dirty_end_ = 0;
+  }
+  if (begin == end)
+    return;
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  for (auto &map : metadata_maps_) {
+    off_t sync_begin = std::max(begin, map.begin);
+    off_t sync_end = std::min(end, map.end);
+    if (sync_begin >= sync_end)
+      continue;
+    // the mapping starts on the page boundary before map.begin
+    sync_begin = sync_begin / page_size * page_size;
+    if (msync(map.addr + (sync_begin - map.begin), sync_end - sync_begin,
+              MS_SYNC) == -1) {
+      LOG(FATAL) << "Msync ssd metadata failed! Errno: " << errno;
+    }
+  }
+}
+
+ssize_t DiskManager::disk_read(void *buf, size_t nbyte, pblock_t pblock, off_t pblock_offset) {
   if ((pblock & HDD_MASK) != 0) {
     pblock = pblock & (~HDD_MASK);
-    off_t offset = pblock * block_size_ + pblock_offset;
+    off_t offset = BLOCKS2BYTES(pblock) + pblock_offset;
     return hdd_disk_read(buf, nbyte, offset);
   } else {
-    off_t offset = pblock * block_size_ + pblock_offset;
+    off_t offset = BLOCKS2BYTES(pblock) + pblock_offset;
     return ssd_disk_read(buf, nbyte, offset);
   }
 }
 
-ssize_t DiskManager::disk_block_read(void *buf, uint32_t pblock) {
+ssize_t DiskManager::disk_block_read(void *buf, pblock_t pblock) {
   if ((pblock & HDD_MASK) != 0) {
     pblock = pblock & (~HDD_MASK);
     return hdd_disk_block_read(buf, pblock);
@@ -75,18 +378,18 @@ ssize_t DiskManager::disk_block_read(void *buf, uint32_t pblock) {
   }
 }
 
-ssize_t DiskManager::disk_write(const void *buf, size_t nbyte, uint32_t pblock, off_t pblock_offset) {
+ssize_t DiskManager::disk_write(const void *buf, size_t nbyte, pblock_t pblock, off_t pblock_offset) {
   if ((pblock & HDD_MASK) != 0) {
     pblock = pblock & (~HDD_MASK);
-    off_t offset = pblock * block_size_ + pblock_offset;
+    off_t offset = BLOCKS2BYTES(pblock) + pblock_offset;
     return hdd_disk_write(buf, nbyte, offset);
   } else {
-    off_t offset = pblock * block_size_ + pblock_offset;
+    off_t offset = BLOCKS2BYTES(pblock) + pblock_offset;
     return ssd_disk_write(buf, nbyte, offset);
   }
 }
 
-ssize_t DiskManager::disk_block_write(const void *buf, uint32_t pblock) {
+ssize_t DiskManager::disk_block_write(const void *buf, pblock_t pblock) {
   if ((pblock & HDD_MASK) != 0) {
     pblock = pblock & (~HDD_MASK);
     return hdd_disk_block_write(buf, pblock);
@@ -95,14 +398,237 @@ ssize_t DiskManager::disk_block_write(const void *buf, uint32_t pblock) {
   }
 }
 
+ssize_t DiskManager::disk_block_readv(const std::vector<iovec> &iov,
+                                      pblock_t pblock) {
+  assert(block_size_ > 0);
+
+  if ((pblock & HDD_MASK) != 0) {
+    pblock = pblock & (~HDD_MASK);
+    return tier_preadv(true, iov, BLOCKS2BYTES(pblock));
+  } else {
+    return tier_preadv(false, iov, BLOCKS2BYTES(pblock));
+  }
+}
+
+ssize_t DiskManager::disk_block_writev(const std::vector<iovec> &iov,
+                                       pblock_t pblock) {
+  assert(block_size_ > 0);
+
+  if ((pblock & HDD_MASK) != 0) {
+    pblock = pblock & (~HDD_MASK);
+    return tier_pwritev(true, iov, BLOCKS2BYTES(pblock));
+  } else {
+    return tier_pwritev(false, iov, BLOCKS2BYTES(pblock));
+  }
+}
+
+void DiskManager::disk_block_submit(
+    const std::vector<std::pair<pblock_t, std::vector<iovec>>> &runs,
+    bool write) {
+  assert(block_size_ > 0);
+
+  std::vector<IoSegment> segments;
+  for (auto &[pblock, iov] : runs) {
+    if ((pblock & HDD_MASK) != 0) {
+      hdd_split(iov, BLOCKS2BYTES(pblock & (~HDD_MASK)), segments);
+    } else {
+      ssd_split(iov, BLOCKS2BYTES(pblock), write, segments);
+    }
+  }
+  run_segments(segments, write);
+}
+
+const DiskManager::MirrorRange *DiskManager::ssd_mirror_range(uint64_t block) {
+  auto it = std::upper_bound(
+      ssd_mirror_.begin(), ssd_mirror_.end(), block,
+      [](uint64_t b, const MirrorRange &range) { return b < range.begin; });
+  if (it == ssd_mirror_.begin() || block >= std::prev(it)->end)
+    return nullptr;
+  return &*std::prev(it);
+}
+
+uint64_t DiskManager::ssd_dev_blocks(uint32_t dev, uint64_t block) {
+  uint32_t n = ssds_.size();
+  uint64_t units = block / SSD_STRIPE_BLOCKS;
+  uint64_t count = units / n * SSD_STRIPE_BLOCKS;
+  if (units % n > dev)
+    count += SSD_STRIPE_BLOCKS;
+  else if (units % n == dev)
+    count += block % SSD_STRIPE_BLOCKS;
+  return count;
+}
+
+// Split an I/O on the ssd address space. Stripe unit u of SSD_STRIPE_BLOCKS
+// blocks is unit u / n of ssd u % n, so the ssds add up to one address
+// space. A mirrored metadata block of ssd d has its second copy on ssd
+// d + 1, packed after the stripes; reads take either copy and writes go to
+// both.
+void DiskManager::ssd_split(const std::vector<iovec> &iov, off_t offset,
+                            bool write, std::vector<IoSegment> &segments,
+                            bool mirror) {
+  uint32_t n = ssds_.size();
+  if (n == 1 || !ssd_layout_set_ || block_size_ == 0) {
+    segments.push_back({&ssds_[0], offset, iov});
+    return;
+  }
+
+  bool read_mirror = mirror_next_++ % 2 == 1;
+  uint64_t pos = offset;
+  // segments receiving the current part, both copies for a mirrored write,
+  // with the device offset each one has reached
+  std::vector<std::pair<size_t, off_t>> cur;
+  for (auto v : iov) {
+    while (v.iov_len > 0) {
+      uint64_t block = pos / block_size_;
+      uint64_t block_offset = pos % block_size_;
+      uint32_t dev = block / SSD_STRIPE_BLOCKS % n;
+      const MirrorRange *range = mirror ? ssd_mirror_range(block) : nullptr;
+
+      std::vector<std::pair<Device *, off_t>> targets;
+      if (range == nullptr || write || !read_mirror) {
+        targets.push_back(
+            {&ssds_[dev],
+             BLOCKS2BYTES(ssd_dev_blocks(dev, block)) + block_offset});
+      }
+      if (range != nullptr && (write || read_mirror)) {
+        uint64_t mirror_block = ssd_stripe_blocks_ + range->rank[dev] +
+                                ssd_dev_blocks(dev, block) -
+                                ssd_dev_blocks(dev, range->begin);
+        targets.push_back({&ssds_[(dev + 1) % n],
+                           BLOCKS2BYTES(mirror_block) + block_offset});
+      }
+
+      // the part extends the current segments if it follows on every device
+      bool follows = cur.size() == targets.size();
+      for (size_t i = 0; follows && i < targets.size(); i++) {
+        follows = segments[cur[i].first].dev == targets[i].first &&
+                  cur[i].second == targets[i].second;
+      }
+      if (!follows) {
+        cur.clear();
+        for (auto &[target_dev, dev_offset] : targets) {
+          cur.push_back({segments.size(), dev_offset});
+          segments.push_back({target_dev, dev_offset, {}});
+        }
+      }
+
+      size_t len = std::min((uint64_t)v.iov_len, block_size_ - block_offset);
+      for (auto &[idx, dev_offset] : cur) {
+        segments[idx].iov.push_back({v.iov_base, len});
+        dev_offset += len;
+      }
+      v.iov_base = (std::byte *)v.iov_base + len;
+      v.iov_len -= len;
+      pos += len;
+    }
+  }
+}
+
+// Split an I/O on the hdd address space at the group boundaries. Group g is
+// group g / n of hdd g % n.
+void DiskManager::hdd_split(const std::vector<iovec> &iov, off_t offset,
+                            std::vector<IoSegment> &segments) {
+  uint32_t n = hdds_.size();
+  if (n == 1 || block_size_ == 0) {
+    segments.push_back({&hdds_[0], offset, iov});
+    return;
+  }
+
+  uint64_t group_bytes = BLOCKS2BYTES((uint64_t)block_size_ * 8);
+  uint64_t pos = offset;
+  IoSegment *cur = nullptr;
+  for (auto v : iov) {
+    while (v.iov_len > 0) {
+      uint64_t group = pos / group_bytes;
+      uint64_t group_left = group_bytes - pos % group_bytes;
+      if (cur == nullptr || pos % group_bytes == 0) {
+        off_t dev_offset = (group / n) * group_bytes + pos % group_bytes;
+        segments.push_back({&hdds_[group % n], dev_offset, {}});
+        cur = &segments.back();
+      }
+
+      size_t len = std::min((uint64_t)v.iov_len, group_left);
+      cur->iov.push_back({v.iov_base, len});
+      v.iov_base = (std::byte *)v.iov_base + len;
+      v.iov_len -= len;
+      pos += len;
+    }
+  }
+}
+
+void DiskManager::run_segments(std::vector<IoSegment> &segments, bool write) {
+  auto do_io = [this, write](IoSegment &segment) {
+    if (write) {
+      dev_pwritev(segment.dev->fd, *segment.dev->mutex, segment.iov,
+                  segment.offset);
+    } else {
+      dev_preadv(segment.dev->fd, *segment.dev->mutex, segment.iov,
+                 segment.offset);
+    }
+  };
+
+  bool one_dev = std::all_of(
+      segments.begin(), segments.end(),
+      [&](const IoSegment &segment) { return segment.dev == segments[0].dev; });
+  if (one_dev) {
+    for (auto &segment : segments)
+      do_io(segment);
+    return;
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  size_t pending = segments.size();
+  for (auto &segment : segments) {
+    segment.dev->queue->push([&] {
+      do_io(segment);
+      std::lock_guard lock(mutex);
+      if (--pending == 0)
+        cv.notify_one();
+    });
+  }
+  std::unique_lock lock(mutex);
+  cv.wait(lock, [&] { return pending == 0; });
+}
+
+ssize_t DiskManager::tier_preadv(bool hdd, const std::vector<iovec> &iov,
+                                 off_t offset) {
+  std::vector<IoSegment> segments;
+  if (hdd) {
+    hdd_split(iov, offset, segments);
+  } else {
+    ssd_split(iov, offset, false, segments);
+  }
+  run_segments(segments, false);
+
+  ssize_t nbytes = 0;
+  for (auto &v : iov)
+    nbytes += v.iov_len;
+  return nbytes;
+}
+
+ssize_t DiskManager::tier_pwritev(bool hdd, const std::vector<iovec> &iov,
+                                  off_t offset) {
+  std::vector<IoSegment> segments;
+  if (hdd) {
+    hdd_split(iov, offset, segments);
+  } else {
+    ssd_split(iov, offset, true, segments);
+  }
+  run_segments(segments, true);
+
+  ssize_t nbytes = 0;
+  for (auto &v : iov)
+    nbytes += v.iov_len;
+  return nbytes;
+}
+
 ssize_t DiskManager::hdd_disk_read(void *buf, size_t nbytes, off_t offset) {
-  std::shared_lock lock(hdd_mutex_);
-  return pread_wrapper(hdd_fd_, buf, nbytes, offset);
+  return tier_preadv(true, {{buf, nbytes}}, offset);
 }
 
 ssize_t DiskManager::ssd_disk_read(void *buf, size_t nbytes, off_t offset) {
-  std::shared_lock lock(ssd_mutex_);
-  return pread_wrapper(ssd_fd_, buf, nbytes, offset);
+  return tier_preadv(false, {{buf, nbytes}}, offset);
 }
 
 ssize_t DiskManager::hdd_disk_block_read(void *buf, uint64_t block_idx) {
@@ -120,29 +646,132 @@ ssize_t DiskManager::ssd_disk_block_read(void *buf, uint64_t block_idx) {
 }
 
 ssize_t DiskManager::hdd_disk_write(const void *buf, size_t nbytes, off_t offset) {
-  std::shared_lock lock(hdd_mutex_);
-  return pwrite_wrapper(hdd_fd_, buf, nbytes, offset);
+  return tier_pwritev(true, {{const_cast<void *>(buf), nbytes}}, offset);
 }
 
 ssize_t DiskManager::ssd_disk_write(const void *buf, size_t nbytes, off_t offset) {
-  std::shared_lock lock(ssd_mutex_);
-  return pwrite_wrapper(ssd_fd_, buf, nbytes, offset);
+  return tier_pwritev(false, {{const_cast<void *>(buf), nbytes}}, offset);
 }
 
 ssize_t DiskManager::hdd_disk_block_write(const void *buf, uint64_t block_idx) {
   assert(block_size_ > 0);
 
-  std::shared_lock lock(hdd_mutex_);
   off_t offset = BLOCKS2BYTES(block_idx);
-  return pwrite_wrapper(hdd_fd_, buf, block_size_, offset);
+  return hdd_disk_write(buf, block_size_, offset);
 }
 
 ssize_t DiskManager::ssd_disk_block_write(const void *buf, uint64_t block_idx) {
   assert(block_size_ > 0);
 
-  std::shared_lock lock(ssd_mutex_);
   off_t offset = BLOCKS2BYTES(block_idx);
-  return pwrite_wrapper(ssd_fd_, buf, block_size_, offset);
+  return ssd_disk_write(buf, block_size_, offset);
+}
+
+static off_t align_down(off_t offset) {
+  return offset / DIRECT_IO_ALIGN * DIRECT_IO_ALIGN;
+}
+
+static off_t align_up(off_t offset) {
+  return align_down(offset + DIRECT_IO_ALIGN - 1);
+}
+
+static bool is_aligned(const void *buf, size_t nbytes, off_t offset) {
+  return ((uintptr_t)buf % DIRECT_IO_ALIGN) == 0 &&
+         (nbytes % DIRECT_IO_ALIGN) == 0 && (offset % DIRECT_IO_ALIGN) == 0;
+}
+
+static bool is_aligned(const std::vector<iovec> &iov, off_t offset) {
+  for (auto &v : iov) {
+    if (!is_aligned(v.iov_base, v.iov_len, offset))
+      return false;
+  }
+  return true;
+}
+
+// With O_DIRECT, unaligned I/O goes through an aligned bounce buffer
+// covering the whole aligned range
+ssize_t DiskManager::dev_pread(int fd, std::shared_mutex &mutex, void *buf,
+                               size_t nbytes, off_t offset) {
+  std::shared_lock lock(mutex);
+  if (!direct_io_ || is_aligned(buf, nbytes, offset)) {
+    return pread_wrapper(fd, buf, nbytes, offset);
+  }
+
+  off_t aligned_begin = align_down(offset);
+  off_t aligned_end = align_up(offset + nbytes);
+  size_t aligned_nbytes = aligned_end - aligned_begin;
+
+  AlignedBuffer bounce(aligned_nbytes);
+  memset(bounce.data(), 0, aligned_nbytes); // in case of reading past EOF
+  pread_wrapper(fd, bounce.data(), aligned_nbytes, aligned_begin);
+  memcpy(buf, bounce.data() + (offset - aligned_begin), nbytes);
+  return nbytes;
+}
+
+ssize_t DiskManager::dev_pwrite(int fd, std::shared_mutex &mutex,
+                                const void *buf, size_t nbytes, off_t offset) {
+  if (!direct_io_ || is_aligned(buf, nbytes, offset)) {
+    std::shared_lock lock(mutex);
+    return pwrite_wrapper(fd, buf, nbytes, offset);
+  }
+
+  // read-modify-write, no other I/O on this disk may interleave
+  std::unique_lock lock(mutex);
+  off_t aligned_begin = align_down(offset);
+  off_t aligned_end = align_up(offset + nbytes);
+  size_t aligned_nbytes = aligned_end - aligned_begin;
+
+  AlignedBuffer bounce(aligned_nbytes);
+  if (aligned_begin != offset || aligned_end != offset + (off_t)nbytes) {
+    memset(bounce.data(), 0, aligned_nbytes);
+    pread_wrapper(fd, bounce.data(), aligned_nbytes, aligned_begin);
+  }
+  memcpy(bounce.data() + (offset - aligned_begin), buf, nbytes);
+  pwrite_wrapper(fd, bounce.data(), aligned_nbytes, aligned_begin);
+  return nbytes;
+}
+
+ssize_t DiskManager::dev_preadv(int fd, std::shared_mutex &mutex,
+                                const std::vector<iovec> &iov, off_t offset) {
+  if (!direct_io_ || is_aligned(iov, offset)) {
+    std::shared_lock lock(mutex);
+    return preadv_wrapper(fd, iov, offset);
+  }
+
+  // read into one bounce buffer, then scatter
+  size_t nbytes = 0;
+  for (auto &v : iov)
+    nbytes += v.iov_len;
+
+  AlignedBuffer bounce(nbytes);
+  dev_pread(fd, mutex, bounce.data(), nbytes, offset);
+  size_t pos = 0;
+  for (auto &v : iov) {
+    memcpy(v.iov_base, bounce.data() + pos, v.iov_len);
+    pos += v.iov_len;
+  }
+  return nbytes;
+}
+
+ssize_t DiskManager::dev_pwritev(int fd, std::shared_mutex &mutex,
+                                 const std::vector<iovec> &iov, off_t offset) {
+  if (!direct_io_ || is_aligned(iov, offset)) {
+    std::shared_lock lock(mutex);
+    return pwritev_wrapper(fd, iov, offset);
+  }
+
+  // gather into one bounce buffer
+  size_t nbytes = 0;
+  for (auto &v : iov)
+    nbytes += v.iov_len;
+
+  AlignedBuffer bounce(nbytes);
+  size_t pos = 0;
+  for (auto &v : iov) {
+    memcpy(bounce.data() + pos, v.iov_base, v.iov_len);
+    pos += v.iov_len;
+  }
+  return dev_pwrite(fd, mutex, bounce.data(), nbytes, offset);
 }
 
 // ensure to read nbytes bytes
@@ -189,9 +818,106 @@ ssize_t pwrite_wrapper(int fd, const void *buf, size_t nbytes, off_t offset) {
   return nbytes;
 }
 
+void BlockIoBatch::add(pblock_t pblock, void *buf, size_t nbyte) {
+  assert(nbyte <= block_size_);
+  ios_.push_back({pblock, {buf, nbyte}});
+}
+
+void BlockIoBatch::add(pblock_t pblock, const void *buf, size_t nbyte) {
+  add(pblock, const_cast<void *>(buf), nbyte);
+}
+
+void BlockIoBatch::read() { submit(false); }
+
+void BlockIoBatch::write() { submit(true); }
+
+void BlockIoBatch::submit(bool write) {
+  std::vector<std::pair<pblock_t, std::vector<iovec>>> runs;
+  size_t i = 0;
+  while (i < ios_.size()) {
+    std::vector<iovec> iov = {ios_[i].iov};
+    size_t j = i + 1;
+    while (j < ios_.size() && ios_[j].pblock == ios_[j - 1].pblock + 1 &&
+           (ios_[j].pblock & HDD_MASK) == (ios_[i].pblock & HDD_MASK) &&
+           ios_[j - 1].iov.iov_len == block_size_) {
+      iov.push_back(ios_[j].iov);
+      j++;
+    }
+
+    runs.emplace_back(ios_[i].pblock, std::move(iov));
+    i = j;
+  }
+  ios_.clear();
+
+  DiskManager::get_instance().disk_block_submit(runs, write);
+}
+
+// drop the iovecs (or the part of the head iovec) which are already done
+static void advance_iovec(std::vector<iovec> &iov, size_t &iov_idx,
+                          size_t nbytes) {
+  while (nbytes > 0 && iov_idx < iov.size()) {
+    if (nbytes >= iov[iov_idx].iov_len) {
+      nbytes -= iov[iov_idx].iov_len;
+      iov_idx++;
+    } else {
+      iov[iov_idx].iov_base = (std::byte *)iov[iov_idx].iov_base + nbytes;
+      iov[iov_idx].iov_len -= nbytes;
+      nbytes = 0;
+    }
+  }
+}
+
+// ensure to read all the bytes described by iov
+ssize_t preadv_wrapper(int fd, std::vector<iovec> iov, off_t offset) {
+  assert(fd >= 0);
+  ssize_t ret, total = 0;
+
+  size_t iov_idx = 0;
+  while (iov_idx < iov.size()) {
+    int iov_cnt = std::min(iov.size() - iov_idx, (size_t)IOV_MAX);
+    ret = preadv(fd, &iov[iov_idx], iov_cnt, offset + total);
+    if (ret == -1) {
+      if (errno == ENOENT)
+        LOG(FATAL) << "File " << fd << " Not Found!";
+      else
+        LOG(FATAL) << "File " << fd << " exists IO Error! Errno: " << errno;
+    }
+    if (ret == 0) // reach the end of file
+      break;
+
+    total += ret;
+    advance_iovec(iov, iov_idx, ret);
+  }
+  return total;
+}
+
+// ensure to write all the bytes described by iov
+ssize_t pwritev_wrapper(int fd, std::vector<iovec> iov, off_t offset) {
+  assert(fd >= 0);
+  ssize_t ret, total = 0;
+
+  size_t iov_idx = 0;
+  while (iov_idx < iov.size()) {
+    int iov_cnt = std::min(iov.size() - iov_idx, (size_t)IOV_MAX);
+    ret = pwritev(fd, &iov[iov_idx], iov_cnt, offset + total);
+    if (ret == -1) {
+      if (errno == ENOENT)
+        LOG(FATAL) << "File " << fd << " Not Found!";
+      else
+        LOG(FATAL) << "File " << fd << " exists IO Error! Errno: " << errno;
+    }
+
+    total += ret;
+    advance_iovec(iov, iov_idx, ret);
+  }
+  return total;
+}
+
 void DiskManager::set_disk_block_size(uint32_t block_size) {
   block_size_ = block_size;
 }
 
-DiskManager::DiskManager() : ssd_fd_(-1), hdd_fd_(-1), block_size_(0) {
-}
\ No newline at end of file
+DiskManager::DiskManager()
+    : block_size_(0), direct_io_(false), ssd_stripe_blocks_(0),
+      ssd_layout_set_(false), mirror_next_(0), mmap_enabled_(false),
+      dirty_begin_(0), dirty_end_(0) {}
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include "extent_index.h"
+#include <algorithm>
+#include <cassert>
+#include <iterator>
+
+void ExtentIndex::clear() {
+  by_offset_.clear();
+  by_size_.clear();
+  free_blocks_ = 0;
+}
+
+void ExtentIndex::add(uint64_t start, uint64_t len) {
+  by_offset_.emplace(start, len);
+  by_size_.emplace(len, start);
+  free_blocks_ += len;
+}
+
+void ExtentIndex::remove(std::map<uint64_t, uint64_t>::iterator it) {
+  by_size_.erase({it->second, it->first});
+  free_blocks_ -= it->second;
+  by_offset_.erase(it);
+}
+
+void ExtentIndex::insert(uint64_t start, uint64_t len) {
+  if (len == 0)
+    return;
+
+  // merge with the extent ending at start and the one beginning at the end
+  auto next = by_offset_.lower_bound(start);
+  if (next != by_offset_.begin()) {
+    auto prev = std::prev(next);
+    assert(prev->first + prev->second <= start);
+    if (prev->first + prev->second == start) {
+      start = prev->first;
+      len += prev->second;
+      remove(prev);
+    }
+  }
+  if (next != by_offset_.end()) {
+    assert(start + len <= next->first);
+    if (start + len == next->first) {
+      len += next->second;
+      remove(next);
+    }
+  }
+  add(start, len);
+}
+
+void ExtentIndex::carve(std::map<uint64_t, uint64_t>::iterator it,
+                        uint64_t start, uint64_t len) {
+  uint64_t ext_start = it->first, ext_end = it->first + it->second;
+  assert(ext_start <= start && start + len <= ext_end);
+  remove(it);
+  if (ext_start < start)
+    add(ext_start, start - ext_start);
+  if (start + len < ext_end)
+    add(start + len, ext_end - start - len);
+}
+
+bool ExtentIndex::alloc(uint64_t count, uint64_t goal, uint64_t &start,
+                        uint64_t &len) {
+  if (count == 0 || by_offset_.empty())
+    return false;
+
+  auto it = by_offset_.upper_bound(goal);
+  if (it != by_offset_.begin()) {
+    --it;
+    if (goal < it->first + it->second) {
+      start = goal;
+      len = std::min(count, it->first + it->second - goal);
+      carve(it, start, len);
+      return true;
+    }
+  }
+
+  auto size_it = by_size_.lower_bound({count, 0});
+  if (size_it == by_size_.end())
+    size_it = std::prev(by_size_.end());
+  start = size_it->second;
+  len = std::min(count, size_it->first);
+  carve(by_offset_.find(start), start, len);
+  return true;
+}
+
+uint64_t ExtentIndex::largest() const {
+  return by_size_.empty() ? 0 : by_size_.rbegin()->first;
+}
@@ -0,0 +1,174 @@
+#include "fragment.h"
+#include "MetaData.h"
+#include "common.h"
+#include "disk.h"
+#include "inode.h"
+#include "journal.h"
+#include "types/ext4_inode.h"
+#include "types/hybrid_fs.h"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <glog/logging.h>
+#include <set>
+#include <vector>
+
+#define ALL_FRAGS_USED (~(uint32_t)0)
+
+// count bits mask starting from start
+static uint32_t frag_mask(uint32_t start, uint32_t count) {
+  assert(start + count <= FRAGS_PER_BLOCK);
+  uint64_t mask = (((uint64_t)1 << count) - 1) << start;
+  return (uint32_t)mask;
+}
+
+FragmentManager &FragmentManager::get_instance() {
+  static FragmentManager instance;
+  return instance;
+}
+
+uint32_t FragmentManager::frag_size() {
+  return GET_INSTANCE(MetaDataManager).block_size() / FRAGS_PER_BLOCK;
+}
+
+uint32_t FragmentManager::max_frag_bytes() {
+  return frag_size() * (FRAGS_PER_BLOCK / 2);
+}
+
+uint32_t FragmentManager::bytes_to_frags(uint64_t bytes) {
+  uint32_t count = (bytes + frag_size() - 1) / frag_size();
+
+  // round up to power of 2 so that appending does not repack every time
+  uint32_t res = 1;
+  while (res < count)
+    res <<= 1;
+  return res;
+}
+
+void FragmentManager::alloc(uint32_t count, pblock_t &pblock,
+                            uint32_t &start) {
+  assert(count > 0 && count < FRAGS_PER_BLOCK);
+  std::lock_guard lock(mutex_);
+
+  pblock = 0;
+  uint32_t used = 0;
+  for (auto &[iter_pblock, iter_used] : partial_blocks_) {
+    for (uint32_t i = 1; i + count <= FRAGS_PER_BLOCK; i++) {
+      if ((iter_used & frag_mask(i, count)) == 0) {
+        pblock = iter_pblock;
+        used = iter_used;
+        start = i;
+        break;
+      }
+    }
+    if (pblock != 0)
+      break;
+  }
+
+  // start a new packed block
+  if (pblock == 0) {
+    pblock = GET_INSTANCE(MetaDataManager).alloc_new_ssd_pblock();
+    used = 1;
+    start = 1;
+  }
+
+  used |= frag_mask(start, count);
+  save_used(pblock, used);
+  if (used == ALL_FRAGS_USED) {
+    partial_blocks_.erase(pblock);
+  } else {
+    partial_blocks_[pblock] = used;
+  }
+
+  // zero the fragments
+  std::vector<std::byte> zero(count * frag_size(), std::byte(0));
+  GET_INSTANCE(DiskManager)
+      .disk_write(zero.data(), zero.size(), pblock, start * frag_size());
+  LOG(INFO) << "Allocate fragments [" << start << ", " << start + count
+            << ") in block #" << pblock;
+}
+
+void FragmentManager::free(pblock_t pblock, uint32_t start, uint32_t count) {
+  if (GET_INSTANCE(JournalManager).defer_frag_free(pblock, start, count))
+    return;
+  free_now(pblock, start, count);
+}
+
+void FragmentManager::free_now(pblock_t pblock, uint32_t start,
+                               uint32_t count) {
+  std::lock_guard lock(mutex_);
+
+  auto it = partial_blocks_.find(pblock);
+  uint32_t used = (it != partial_blocks_.end()) ? it->second : load_used(pblock);
+  used &= ~frag_mask(start, count);
+
+  if (used == 1) { // only the header is left
+    partial_blocks_.erase(pblock);
+    GET_INSTANCE(MetaDataManager).free_pblock({pblock});
+    LOG(INFO) << "Free packed block #" << pblock;
+  } else {
+    partial_blocks_[pblock] = used;
+    save_used(pblock, used);
+  }
+}
+
+// The packed blocks are only known through the inodes in them, every
+// group's inode table is read at once and the header of each packed block
+// met is read once.
+void FragmentManager::load() {
+  auto &meta = GET_INSTANCE(MetaDataManager);
+  uint32_t inodes_per_group = meta.inodes_per_group();
+  uint32_t groups = meta.inodes_count() / inodes_per_group;
+  size_t inode_size = meta.inode_size();
+
+  std::set<pblock_t> pblocks;
+  std::vector<uint32_t> inode_vec;
+  std::vector<std::byte> table((size_t)inodes_per_group * inode_size);
+  for (uint32_t group_id = 0; group_id < groups; group_id++) {
+    inode_vec.clear();
+    meta.group_inodes_in_use(group_id, inode_vec);
+    if (inode_vec.empty())
+      continue;
+
+    uint32_t first = group_id * inodes_per_group + 1;
+    GET_INSTANCE(DiskManager)
+        .metadata_read(table.data(), table.size(),
+                       meta.inode_table_offset(first));
+    for (uint32_t inode_idx : inode_vec) {
+      ext4_inode inode;
+      memset(&inode, 0, sizeof(ext4_inode));
+      memcpy(&inode, &table[(size_t)(inode_idx - first) * inode_size],
+             std::min(inode_size, sizeof(ext4_inode)));
+      if (GET_INSTANCE(InodeManager).is_frag(inode))
+        pblocks.insert(pblock_from32(inode.i_obso_faddr));
+    }
+  }
+
+  std::lock_guard lock(mutex_);
+  partial_blocks_.clear();
+  for (pblock_t pblock : pblocks) {
+    uint32_t used = load_used(pblock);
+    if (used != ALL_FRAGS_USED)
+      partial_blocks_[pblock] = used;
+  }
+  LOG(INFO) << "Load " << pblocks.size() << " packed blocks, "
+            << partial_blocks_.size() << " with free fragments";
+}
+
+uint32_t FragmentManager::load_used(pblock_t pblock) {
+  frag_block_header header;
+  GET_INSTANCE(DiskManager)
+      .disk_read(&header, sizeof(frag_block_header), pblock, 0);
+  if (header.fb_magic != FRAG_BLOCK_MAGIC) {
+    LOG(FATAL) << "Block #" << pblock << " is not a packed block!";
+  }
+  return header.fb_used;
+}
+
+void FragmentManager::save_used(pblock_t pblock, uint32_t used) {
+  frag_block_header header = {FRAG_BLOCK_MAGIC, used};
+  GET_INSTANCE(DiskManager)
+      .disk_write(&header, sizeof(frag_block_header), pblock, 0);
+}
@@ -0,0 +1,105 @@
+#include "ops.h"
+#include "common.h"
+#include "defrag.h"
+#include "inode.h"
+#include "journal.h"
+#include "types/ext4_inode.h"
+#include <algorithm>
+#include <cstdint>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <shared_mutex>
+#include <sys/stat.h>
+#include <vector>
+
+// data is copied through a buffer of this size
+#define COPY_CHUNK_BYTES (1 << 20)
+
+// The copy never leaves the filesystem. Holes of the source are skipped with
+// seek_data and punched in the destination, so sparse files stay sparse.
+ssize_t fs_copy_file_range(const char *path_in, fuse_file_info *fi_in,
+                           off_t off_in, const char *path_out,
+                           fuse_file_info *fi_out, off_t off_out, size_t size,
+                           int flags) {
+  JournalManager::Handle handle;
+  LOG(INFO) << "Copy_file_range begin:";
+  LOG(INFO) << "copy_file_range( " << path_in << ", " << off_in << ", "
+            << path_out << ", " << off_out << ", " << size << " )";
+
+  if (flags != 0 || off_in < 0 || off_out < 0)
+    return -EINVAL;
+  if ((fi_in->flags & O_ACCMODE) == O_WRONLY ||
+      (fi_out->flags & O_ACCMODE) == O_RDONLY)
+    return -EBADF;
+
+  uint32_t in_idx = handle_inode(fi_in), out_idx = handle_inode(fi_out);
+  ext4_inode in_inode, out_inode;
+  int get_inode_ret =
+      GET_INSTANCE(InodeManager).get_inode_by_idx(in_idx, in_inode);
+  if (get_inode_ret < 0)
+    return get_inode_ret;
+  get_inode_ret =
+      GET_INSTANCE(InodeManager).get_inode_by_idx(out_idx, out_inode);
+  if (get_inode_ret < 0)
+    return get_inode_ret;
+  if (S_ISDIR(in_inode.i_mode) || S_ISDIR(out_inode.i_mode))
+    return -EISDIR;
+
+  uint64_t in_size = GET_INSTANCE(InodeManager).get_file_size(in_inode);
+  if ((uint64_t)off_in >= in_size || size == 0)
+    return 0;
+  size = std::min((uint64_t)size, in_size - off_in);
+
+  // overlapping ranges of the same file
+  if (in_idx == out_idx && (uint64_t)off_in < off_out + size &&
+      (uint64_t)off_out < off_in + size)
+    return -EINVAL;
+  if ((uint64_t)off_out + size > GET_INSTANCE(InodeManager).max_file_size())
+    return -EFBIG;
+
+  std::vector<char> buf(COPY_CHUNK_BYTES);
+  uint64_t pos = off_in, end = off_in + size;
+  while (pos < end) {
+    GET_INSTANCE(InodeManager).get_inode_by_idx(in_idx, in_inode);
+    off_t data = GET_INSTANCE(InodeManager).seek_data(in_idx, in_inode, pos, true);
+    uint64_t data_begin = data < 0 ? end : std::min((uint64_t)data, end);
+
+    // hole in the source
+    if (data_begin > pos) {
+      std::shared_lock lock(GET_INSTANCE(DefragManager).inode_lock(out_idx));
+      GET_INSTANCE(InodeManager).get_inode_by_idx(out_idx, out_inode);
+      GET_INSTANCE(InodeManager)
+          .punch_hole(out_idx, out_inode, off_out + (pos - off_in),
+                      data_begin - pos);
+      GET_INSTANCE(InodeManager).update_disk_inode(out_idx, out_inode);
+      pos = data_begin;
+      continue;
+    }
+
+    off_t hole =
+        GET_INSTANCE(InodeManager).seek_data(in_idx, in_inode, pos, false);
+    uint64_t data_end = std::min((uint64_t)hole, end);
+    while (pos < data_end) {
+      size_t bytes = std::min((uint64_t)buf.size(), data_end - pos);
+      int ret = fs_read(path_in, buf.data(), bytes, pos, fi_in);
+      if (ret < 0)
+        return ret;
+      ret = fs_write(path_out, buf.data(), bytes, off_out + (pos - off_in),
+                     fi_out);
+      if (ret < 0)
+        return ret;
+      pos += bytes;
+    }
+  }
+
+  // a hole at the end of the range still extends the destination
+  std::shared_lock lock(GET_INSTANCE(DefragManager).inode_lock(out_idx));
+  GET_INSTANCE(InodeManager).get_inode_by_idx(out_idx, out_inode);
+  if (off_out + size > GET_INSTANCE(InodeManager).get_file_size(out_inode)) {
+    GET_INSTANCE(InodeManager).truncate(out_idx, out_inode, off_out + size);
+    GET_INSTANCE(InodeManager).update_disk_inode(out_idx, out_inode);
+  }
+
+  LOG(INFO) << "Copy_file_range done";
+  return size;
+}
@@ -0,0 +1,28 @@
+#include "ops.h"
+#include "common.h"
+#include "defrag.h"
+#include "demote.h"
+#include "disk.h"
+#include "journal.h"
+#include "writeback.h"
+#include <glog/logging.h>
+
+void fs_destroy(void *private_data) {
+  (void)private_data;
+
+  LOG(INFO) << "Destroy begin:";
+
+  // a file being moved is left at a chunk boundary
+  GET_INSTANCE(DemoteManager).shutdown();
+  GET_INSTANCE(DefragManager).shutdown();
+
+  // write back all the delayed data before unmount
+  {
+    JournalManager::Handle handle;
+    GET_INSTANCE(WriteBackManager).flush_all();
+  }
+  GET_INSTANCE(JournalManager).shutdown();
+  GET_INSTANCE(DiskManager).metadata_sync();
+
+  LOG(INFO) << "Destroy done!";
+}
@@ -0,0 +1,92 @@
+#include "ops.h"
+#include "MetaData.h"
+#include "common.h"
+#include "defrag.h"
+#include "inode.h"
+#include "journal.h"
+#include "types/ext4_inode.h"
+#include <algorithm>
+#include <cstdint>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <linux/falloc.h>
+#include <mutex>
+#include <sys/stat.h>
+
+// blocks preallocated or freed per transaction
+#define FALLOCATE_CHUNK_BLOCKS 1024
+
+// fallocate [offset, offset + length) in a transaction of its own
+static int fallocate_step(uint32_t inode_idx, int mode, uint64_t offset,
+                          uint64_t length, bool keep_size) {
+  JournalManager::Handle handle;
+  // the block map and the size change, writers are kept out
+  std::unique_lock lock(GET_INSTANCE(DefragManager).inode_lock(inode_idx));
+  ext4_inode inode;
+  int get_inode_ret =
+      GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
+  if (get_inode_ret < 0)
+    return get_inode_ret;
+  if (S_ISDIR(inode.i_mode))
+    return -EISDIR;
+  MetaDataManager::Goal goal(inode_idx);
+
+  if ((mode & FALLOC_FL_PUNCH_HOLE) != 0) {
+    GET_INSTANCE(InodeManager).punch_hole(inode_idx, inode, offset, length);
+  } else {
+    GET_INSTANCE(InodeManager).preallocate(inode, offset, length, keep_size);
+  }
+  GET_INSTANCE(InodeManager).update_disk_inode(inode_idx, inode);
+  return 0;
+}
+
+int fs_fallocate(const char *path, int mode, off_t offset, off_t length,
+                 fuse_file_info *fi) {
+  LOG(INFO) << "Fallocate begin:";
+  LOG(INFO) << "fallocate( " << path << ", " << mode << ", " << offset << ", "
+            << length << " )";
+
+  if ((mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) != 0)
+    return -EOPNOTSUPP;
+  // a hole never changes the file size
+  if ((mode & FALLOC_FL_PUNCH_HOLE) != 0 && (mode & FALLOC_FL_KEEP_SIZE) == 0)
+    return -EOPNOTSUPP;
+  if (offset < 0 || length <= 0)
+    return -EINVAL;
+
+  uint32_t inode_idx;
+  if (fi) {
+    if ((fi->flags & O_ACCMODE) == O_RDONLY)
+      return -EBADF;
+    inode_idx = handle_inode(fi);
+  } else {
+    inode_idx = GET_INSTANCE(InodeManager).get_idx_by_path(path);
+    if (inode_idx == 0)
+      return -ENOENT;
+  }
+
+  uint64_t max_size = GET_INSTANCE(InodeManager).max_file_size();
+  if ((uint64_t)offset > max_size || (uint64_t)length > max_size - offset)
+    return -EFBIG;
+
+  // A large range is preallocated or punched a chunk at a time, so that the
+  // block vectors stay small and no transaction outgrows the journal. The
+  // size only changes with the last chunk.
+  bool keep_size = (mode & FALLOC_FL_KEEP_SIZE) != 0;
+  uint64_t chunk_bytes = (uint64_t)FALLOCATE_CHUNK_BLOCKS *
+                         GET_INSTANCE(MetaDataManager).block_size();
+  uint64_t end = offset + length;
+  uint64_t pos = offset;
+  while (pos < end) {
+    uint64_t next = std::min(end, (pos / chunk_bytes + 1) * chunk_bytes);
+    int ret = fallocate_step(inode_idx, mode, pos, next - pos,
+                             keep_size || next < end);
+    if (ret < 0)
+      return ret;
+    GET_INSTANCE(JournalManager).commit_if_large();
+    pos = next;
+  }
+
+  LOG(INFO) << "Fallocate done";
+  return 0;
+}
@@ -0,0 +1,18 @@
+#include "ops.h"
+#include "common.h"
+#include "journal.h"
+#include "writeback.h"
+#include <glog/logging.h>
+
+int fs_flush(const char *path, fuse_file_info *fi) {
+  JournalManager::Handle handle;
+  LOG(INFO) << "Flush begin:";
+  LOG(INFO) << "Flush file: " << path << " inode: #" << handle_inode(fi);
+
+  // close() should report write back errors, so the dirty pages go to disk
+  // here, durability is left to fsync
+  GET_INSTANCE(WriteBackManager).flush(handle_inode(fi));
+
+  LOG(INFO) << "Flush done";
+  return 0;
+}
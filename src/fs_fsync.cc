@@ -0,0 +1,36 @@
+#include "ops.h"
+#include "common.h"
+#include "journal.h"
+#include "sync.h"
+#include "writeback.h"
+#include <glog/logging.h>
+
+int fs_fsync(const char *path, int datasync, fuse_file_info *fi) {
+  (void)datasync;
+  LOG(INFO) << "Fsync begin:";
+  LOG(INFO) << "Fsync file: " << path;
+
+  if (fi != nullptr) {
+    // the handle must be gone before the group commit waits for a journal
+    // commit
+    JournalManager::Handle handle;
+    GET_INSTANCE(WriteBackManager).flush(handle_inode(fi));
+  }
+  GET_INSTANCE(SyncManager).sync();
+
+  LOG(INFO) << "Fsync done";
+  return 0;
+}
+
+int fs_fsyncdir(const char *path, int datasync, fuse_file_info *fi) {
+  (void)datasync;
+  (void)fi;
+  LOG(INFO) << "Fsyncdir begin:";
+  LOG(INFO) << "Fsyncdir directory: " << path;
+
+  // directory entries are written in place, only the devices need a flush
+  GET_INSTANCE(SyncManager).sync();
+
+  LOG(INFO) << "Fsyncdir done";
+  return 0;
+}
@@ -5,6 +5,18 @@
 #include <glog/logging.h>
 #include <regex>
 
+void fs_fill_stat(const ext4_inode &inode, struct stat *stbuf) {
+  stbuf->st_mode = inode.i_mode;
+  stbuf->st_nlink = inode.i_links_count;
+  stbuf->st_size = GET_INSTANCE(InodeManager).get_file_size(inode);
+  stbuf->st_blocks = inode.i_blocks_lo;
+  stbuf->st_uid = inode.i_uid;
+  stbuf->st_gid = inode.i_gid;
+  stbuf->st_atime = inode.i_atime;
+  stbuf->st_mtime = inode.i_mtime;
+  stbuf->st_ctime = inode.i_ctime;
+}
+
 int fs_getattr(const char *path, struct stat *stbuf, fuse_file_info *fi) {
   LOG(INFO) << "Getattr begin:";
   
@@ -12,7 +24,7 @@ int fs_getattr(const char *path, struct stat *stbuf, fuse_file_info *fi) {
   
   int ret;
   if (fi) {
-    ret = GET_INSTANCE(InodeManager).get_inode_by_idx(fi->fh, inode);
+    ret = GET_INSTANCE(InodeManager).get_inode_by_idx(handle_inode(fi), inode);
   } else {
     ret = GET_INSTANCE(InodeManager).get_inode_by_path(path, inode);
   }
@@ -21,15 +33,7 @@ int fs_getattr(const char *path, struct stat *stbuf, fuse_file_info *fi) {
     return ret;
   }
 
-  stbuf->st_mode = inode.i_mode;
-  stbuf->st_nlink = inode.i_links_count;
-  stbuf->st_size = GET_INSTANCE(InodeManager).get_file_size(inode);
-  stbuf->st_blocks = inode.i_blocks_lo;
-  stbuf->st_uid = inode.i_uid;
-  stbuf->st_gid = inode.i_gid;
-  stbuf->st_atime = inode.i_atime;
-  stbuf->st_mtime = inode.i_mtime;
-  stbuf->st_ctime = inode.i_ctime;
+  fs_fill_stat(inode, stbuf);
 
   LOG(INFO) << path << " 's stat: mode=" << stbuf->st_mode << " size=" << stbuf->st_size << " blocks=" << stbuf->st_blocks;
   LOG(INFO) << "Getattr done!";
@@ -1,8 +1,15 @@
 #include "ops.h"
 #include "MetaData.h"
 #include "common.h"
+#include "defrag.h"
+#include "demote.h"
+#include "disk.h"
+#include "fragment.h"
 #include "inode.h"
+#include "journal.h"
 #include <glog/logging.h>
+#include <utility>
+#include <vector>
 
 void *fs_init(fuse_conn_info *conn, fuse_config *cfg) {
   (void)cfg;
@@ -14,15 +21,37 @@ void *fs_init(fuse_conn_info *conn, fuse_config *cfg) {
   // fill in super block
   GET_INSTANCE(MetaDataManager).super_block_fill();
 
+  // the gdt and everything after it is found through the ssd layout
+  GET_INSTANCE(MetaDataManager).ssd_layout_init();
+
+  // replay the journal before any other metadata is loaded
+  GET_INSTANCE(JournalManager).recover();
+
   // fill in gdt
   GET_INSTANCE(MetaDataManager).gdt_fill();
 
+  // only the fixed metadata is mapped, it is known once the gdt is filled
+  if (GET_INSTANCE(DiskManager).metadata_mmap_enabled()) {
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    GET_INSTANCE(MetaDataManager).ssd_metadata_ranges(ranges);
+    GET_INSTANCE(DiskManager).metadata_mmap(ranges);
+  }
+
   // initialize hdd disk
   GET_INSTANCE(MetaDataManager).hdd_disk_init();
 
+  // metadata writes go through the journal from now on
+  GET_INSTANCE(JournalManager).start();
+
   // Initialize root inode
   GET_INSTANCE(InodeManager).init();
 
+  // the small files packed before the mount keep sharing their blocks
+  GET_INSTANCE(FragmentManager).load();
+
+  GET_INSTANCE(DefragManager).start();
+  GET_INSTANCE(DemoteManager).start();
+
    LOG(INFO) << "Init done!";
   return NULL;
 }
\ No newline at end of file
@@ -0,0 +1,40 @@
+#include "ops.h"
+#include "common.h"
+#include "defrag.h"
+#include "inode.h"
+#include "types/ext4_inode.h"
+#include <glog/logging.h>
+#include <sys/stat.h>
+
+int fs_ioctl(const char *path, unsigned int cmd, void *arg,
+             fuse_file_info *fi, unsigned int flags, void *data) {
+  (void)arg;
+  (void)data;
+  LOG(INFO) << "Ioctl begin:";
+  LOG(INFO) << "ioctl( " << path << ", " << cmd << " )";
+
+  if ((flags & FUSE_IOCTL_COMPAT) != 0)
+    return -ENOSYS;
+
+  switch (cmd) {
+  case HYBRID_IOC_DEFRAG: {
+    uint32_t inode_idx = handle_inode(fi);
+    ext4_inode inode;
+    int get_inode_ret =
+        GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
+    if (get_inode_ret < 0)
+      return get_inode_ret;
+    if (!S_ISREG(inode.i_mode))
+      return -EINVAL;
+
+    // a file queued already is left where it is
+    GET_INSTANCE(DefragManager).enqueue(inode_idx);
+    break;
+  }
+  default:
+    return -ENOTTY;
+  }
+
+  LOG(INFO) << "Ioctl done";
+  return 0;
+}
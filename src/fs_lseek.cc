@@ -0,0 +1,51 @@
+#include "ops.h"
+#include "common.h"
+#include "inode.h"
+#include "types/ext4_inode.h"
+#include <cstdint>
+#include <glog/logging.h>
+#include <unistd.h>
+
+off_t fs_lseek(const char *path, off_t off, int whence, fuse_file_info *fi) {
+  LOG(INFO) << "Lseek begin:";
+  LOG(INFO) << "lseek( " << path << ", " << off << ", " << whence << " )";
+
+  uint32_t inode_idx;
+  if (fi) {
+    inode_idx = handle_inode(fi);
+  } else {
+    inode_idx = GET_INSTANCE(InodeManager).get_idx_by_path(path);
+    if (inode_idx == 0)
+      return -ENOENT;
+  }
+
+  ext4_inode inode;
+  int get_inode_ret =
+      GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
+  if (get_inode_ret < 0)
+    return get_inode_ret;
+
+  off_t ret;
+  switch (whence) {
+  case SEEK_SET:
+    ret = off;
+    break;
+  case SEEK_END:
+    ret = GET_INSTANCE(InodeManager).get_file_size(inode) + off;
+    break;
+  case SEEK_DATA:
+  case SEEK_HOLE:
+    if (off < 0)
+      return -ENXIO;
+    ret = GET_INSTANCE(InodeManager)
+              .seek_data(inode_idx, inode, off, whence == SEEK_DATA);
+    break;
+  default:
+    return -EINVAL;
+  }
+  if (ret < 0 && ret != -ENXIO)
+    return -EINVAL;
+
+  LOG(INFO) << "Lseek done: " << ret;
+  return ret;
+}
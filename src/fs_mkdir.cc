@@ -1,9 +1,11 @@
 #include "ops.h"
 #include "MetaData.h"
 #include "common.h"
+#include "journal.h"
 #include "inode.h"
 #include "types/ext4_dentry.h"
 #include "types/ext4_inode.h"
+#include "types/hybrid_fs.h"
 #include <asm-generic/errno-base.h>
 #include <asm-generic/errno.h>
 #include <cassert>
@@ -15,6 +17,7 @@
 
 // Only call this function when it is really want to create a new directory
 int fs_mkdir(const char *path_cstr, mode_t mode) {
+  JournalManager::Handle handle;
   LOG(INFO) << "Mkdir begin:";
   LOG(INFO) << "New directory: " << path_cstr;
   std::string parent_path, dirname;
@@ -34,14 +37,19 @@ int fs_mkdir(const char *path_cstr, mode_t mode) {
 
   // Create new directory file
   // Allocate inode for new directory
-  cur_inode_idx = GET_INSTANCE(MetaDataManager).get_new_inode_idx();
+  MetaDataManager::Goal goal(parent_inode_idx);
+  cur_inode_idx =
+      GET_INSTANCE(MetaDataManager).get_new_inode_idx(parent_inode_idx, true);
 
   // Initialize new dir inode
   memset(&cur_inode, 0, sizeof(ext4_inode));
   uint16_t i_mode = mode | __S_IFDIR;
   cur_inode = {
       .i_mode = i_mode,
+      .i_flags = EXT4_INLINE_DATA_FL,
   };
+  // the tier policy of the directory applies to what is created in it
+  cur_inode.i_flags |= prefix_inode.i_flags & HYBRID_TIER_FL;
 
   // Initialize on-disk cur_inode file content
   ext4_dir_entry_2 dot, dotdot;
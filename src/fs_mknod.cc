@@ -1,10 +1,13 @@
 #include "ops.h"
 #include "common.h"
+#include "journal.h"
 #include "inode.h"
 #include "types/ext4_inode.h"
+#include "types/hybrid_fs.h"
 #include <glog/logging.h>
 
 int fs_mknod(const char *path_cstr, mode_t mode, dev_t rdev) {
+  JournalManager::Handle handle;
   LOG(INFO) << "Mknod begin:";
   LOG(INFO) << "mknod( " << path_cstr << ", " << mode << " , " << rdev << " )";
   std::string parent_path, filename;
@@ -25,7 +28,9 @@ int fs_mknod(const char *path_cstr, mode_t mode, dev_t rdev) {
 
   // Create new file
   // Allocate inode for new file
-  cur_inode_idx = GET_INSTANCE(MetaDataManager).get_new_inode_idx();
+  MetaDataManager::Goal goal(parent_inode_idx);
+  cur_inode_idx =
+      GET_INSTANCE(MetaDataManager).get_new_inode_idx(parent_inode_idx, false);
 
   // Initialize new file inode
   memset(&cur_inode, 0, sizeof(ext4_inode));
@@ -34,6 +39,15 @@ int fs_mknod(const char *path_cstr, mode_t mode, dev_t rdev) {
       .i_mode = i_mode,
   };
 
+  // small regular file keeps its data inline until it grows
+  if (S_ISREG(mode))
+    cur_inode.i_flags = EXT4_INLINE_DATA_FL;
+  // narrow maps can not reach the whole filesystem, start with a wide one
+  if (S_ISREG(mode) && GET_INSTANCE(MetaDataManager).wide_pblocks())
+    cur_inode.i_flags |= HYBRID_WIDE_MAP_FL;
+  // the tier policy of the directory applies to what is created in it
+  cur_inode.i_flags |= prefix_inode.i_flags & HYBRID_TIER_FL;
+
   // Update on-disk parent_inode file content
   ext4_dir_entry_2 cur_dentry;
   set_dir_dentry(cur_dentry, cur_inode_idx, filename, 0x1);
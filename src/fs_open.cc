@@ -11,8 +11,8 @@ int fs_open(const char *path, fuse_file_info *fi) {
   uint32_t inode_num = GET_INSTANCE(InodeManager).get_idx_by_path(path);
   if (inode_num == 0)
     return -ENOENT;
-  fi->fh = inode_num;
-  LOG(INFO) << "Open " << path << " in inode: #" << fi->fh;
+  fi->fh = (uint64_t)new FileHandle(inode_num);
+  LOG(INFO) << "Open " << path << " in inode: #" << inode_num;
   LOG(INFO) << "Open done";
   return 0;
 }
\ No newline at end of file
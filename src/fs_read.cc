@@ -1,14 +1,18 @@
 #include "disk.h"
 #include "ops.h"
 #include "common.h"
+#include "defrag.h"
 #include "inode.h"
 #include "MetaData.h"
 #include "types/ext4_inode.h"
+#include "writeback.h"
 #include <cassert>
 #include <cstddef>
 #include <cstring>
 #include <fcntl.h>
 #include <glog/logging.h>
+#include <shared_mutex>
+#include <vector>
 
 // truncate the read size if exceeds file size
 static size_t truncate_size(const ext4_inode &inode, size_t size, size_t offset) {
@@ -26,7 +30,7 @@ static size_t truncate_size(const ext4_inode &inode, size_t size, size_t offset)
   return size;
 }
 
-static size_t first_read(const ext4_inode &inode, char *buf, size_t size, off_t offset) {
+static size_t first_read(uint32_t inode_idx, const ext4_inode &inode, char *buf, size_t size, off_t offset) {
   // offset = 0 size = BLOCK_SIZE on the same block
   uint32_t block_size = GET_INSTANCE(MetaDataManager).block_size();
   uint32_t start_lblock = offset / block_size;
@@ -41,9 +45,15 @@ static size_t first_read(const ext4_inode &inode, char *buf, size_t size, off_t
     first_read_size = ALIGN_TO(offset, block_size) - offset;
   }
 
+  // dirty page not written back yet
+  if (GET_INSTANCE(WriteBackManager).read_page(inode_idx, start_lblock, buf, first_read_size, start_offset))
+    return first_read_size;
+
   uint64_t start_pblock = GET_INSTANCE(InodeManager).get_data_pblock(inode, start_lblock);
-  if (start_pblock == 0) // sparse file
+  if (start_pblock == 0) { // sparse file
+    memset(buf, 0, first_read_size);
     return first_read_size;
+  }
 
   GET_INSTANCE(DiskManager).disk_read(buf, first_read_size, start_pblock, start_offset);
   LOG(INFO) << "Read " << first_read_size << "bytes from block #" << start_pblock;
@@ -54,8 +64,9 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset,
          fuse_file_info *fi) {
   assert(offset >= 0);
   LOG(INFO) << "Read begin:";
+  uint32_t inode_idx = handle_inode(fi);
   LOG(INFO) << "read(" << path << ", buf, " << size << ", " << offset
-             << ", fi->fh=" << fi->fh << ")";
+             << ", inode=" << inode_idx << ")";
 
   if (((fi->flags & O_ACCMODE) == O_WRONLY))
       return -EACCES;
@@ -66,28 +77,57 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset,
   uint32_t block_size = GET_INSTANCE(MetaDataManager).block_size();
   ext4_inode inode;
 
+  // the blocks can not be moved while they are read
+  std::shared_lock lock(GET_INSTANCE(DefragManager).inode_lock(inode_idx));
   int get_inode_ret =
-      GET_INSTANCE(InodeManager).get_inode_by_idx(fi->fh, inode);
+      GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
   if (get_inode_ret < 0) {
     return get_inode_ret;
   }
   
+  // tiny file, the data is in the inode
+  if (GET_INSTANCE(InodeManager).is_inline(inode)) {
+    ret = GET_INSTANCE(InodeManager).read_inline(inode, buf, size, offset);
+    LOG(INFO) << "Read " << ret << " bytes of inline data";
+    LOG(INFO) << "Read done";
+    return ret;
+  }
+
+  // small file packed in fragments
+  if (GET_INSTANCE(InodeManager).is_frag(inode)) {
+    ret = GET_INSTANCE(InodeManager).read_frag(inode, buf, size, offset);
+    LOG(INFO) << "Read " << ret << " bytes of packed data";
+    LOG(INFO) << "Read done";
+    return ret;
+  }
+
   // truncate size
   size = truncate_size(inode, size, offset);
 
   // read the first block and doing the alignment
-  bytes = first_read(inode, buf, size, offset);
+  bytes = first_read(inode_idx, inode, buf, size, offset);
 
   ret = bytes;
   buf += bytes;
   un_offset += bytes;
-  for (uint32_t lblock = un_offset / block_size; size > ret; lblock++) {
+
+  // look up all the remaining blocks at once
+  uint32_t first_lblock = un_offset / block_size;
+  uint32_t lblock_count = (size - ret + block_size - 1) / block_size;
+  std::vector<pblock_t> pblock_vec;
+  GET_INSTANCE(InodeManager).get_data_pblocks(inode, first_lblock, lblock_count, pblock_vec);
+
+  // reads of consecutive pblocks are merged into one
+  BlockIoBatch batch(block_size);
+  for (uint32_t i = 0; size > ret; i++) {
+    uint32_t lblock = first_lblock + i;
+    pblock_t pblock = pblock_vec[i];
     bytes = (size - ret) > block_size ? block_size : size - ret;
 
-    uint64_t pblock = GET_INSTANCE(InodeManager).get_data_pblock(inode, lblock);
-    if (pblock) { 
-      GET_INSTANCE(DiskManager).disk_read(buf, bytes, pblock, 0);
-      LOG(INFO) << "Read " << bytes << " from block #" << pblock;
+    if (GET_INSTANCE(WriteBackManager).read_page(inode_idx, lblock, buf, bytes, 0)) {
+      LOG(INFO) << "Read " << bytes << " from dirty page of lblock #" << lblock;
+    } else if (pblock) { 
+      batch.add(pblock, buf, bytes);
     } else {  // deal with sparse file
       memset(buf, 0, bytes);
       LOG(INFO) << "Sparse file, skipping " << bytes << " bytes";
@@ -95,6 +135,7 @@ int fs_read(const char *path, char *buf, size_t size, off_t offset,
     ret += bytes;
     buf += bytes;
   }
+  batch.read();
   assert(size == ret);
   LOG(INFO) << "Read done";
   return ret;
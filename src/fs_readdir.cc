@@ -5,19 +5,43 @@
 #include "types/ext4_dentry.h"
 #include "types/ext4_inode.h"
 #include <cstddef>
+#include <cstring>
 #include <fcntl.h>
 #include <glog/logging.h>
+#include <string>
+#include <vector>
+
+static mode_t dtype_to_mode(uint8_t file_type) {
+  switch (file_type) {
+  case EXT4_FT_REG_FILE:
+    return S_IFREG;
+  case EXT4_FT_DIR:
+    return S_IFDIR;
+  case EXT4_FT_CHRDEV:
+    return S_IFCHR;
+  case EXT4_FT_BLKDEV:
+    return S_IFBLK;
+  case EXT4_FT_FIFO:
+    return S_IFIFO;
+  case EXT4_FT_SOCK:
+    return S_IFSOCK;
+  case EXT4_FT_SYMLINK:
+    return S_IFLNK;
+  default:
+    return 0;
+  }
+}
 
 int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
             fuse_file_info *fi, fuse_readdir_flags flags) {
   LOG(INFO) << "Readdir begin:";
+  LOG(INFO) << "Readdir " << path << " from offset: " << offset;
   (void)fi;
-  (void)offset;
-  (void)flags;
 
-  struct stat st;
   ext4_inode inode;
-  fuse_fill_dir_flags fill_flags = FUSE_FILL_DIR_PLUS;  // fix Input/output error
+  bool plus = (flags & FUSE_READDIR_PLUS) != 0;
+  fuse_fill_dir_flags fill_flags =
+      plus ? FUSE_FILL_DIR_PLUS : (fuse_fill_dir_flags)0;
 
   uint32_t block_size = GET_INSTANCE(MetaDataManager).block_size();
   DirCtx dir_ctx(block_size);
@@ -26,26 +50,63 @@ int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset
   if (ret < 0)
     return ret;
 
-  off_t dentry_off = 0;
+  // resume from the entry at offset, each entry is filled with the offset of
+  // the next one
+  off_t dentry_off = offset;
   ext4_dir_entry_2 *dentry = nullptr;
-  while ((dentry =
-              GET_INSTANCE(InodeManager).get_dentry(inode, dentry_off, dir_ctx)) !=
-         nullptr) {
-    dentry_off += dentry->rec_len;
+  bool full = false;
+  while (!full) {
+    // collect the entries of one directory block, so their inodes are read
+    // in one batch
+    std::vector<std::string> names;
+    std::vector<uint32_t> idx_vec;
+    std::vector<uint8_t> types;
+    std::vector<off_t> next_offs;
+    uint32_t lblock = dentry_off / block_size;
+    while (dentry_off / block_size == lblock &&
+           (dentry = GET_INSTANCE(InodeManager)
+                         .get_dentry(inode, dentry_off, dir_ctx)) != nullptr) {
+      dentry_off += dentry->rec_len;
+
+      if (dentry->inode == 0)
+        continue;
+
+      names.emplace_back(dentry->name, (size_t)dentry->name_len);
+      idx_vec.push_back(dentry->inode);
+      types.push_back(dentry->file_type);
+      next_offs.push_back(dentry_off);
+    }
+
+    // a plain listing is usually followed by a getattr of every entry, so
+    // the inodes are prefetched either way
+    std::vector<ext4_inode> inodes;
+    if (plus) {
+      GET_INSTANCE(InodeManager).get_inodes(idx_vec, inodes);
+    } else {
+      GET_INSTANCE(InodeManager).prefetch_inodes(idx_vec);
+    }
 
-    if (dentry->inode == 0)
-      continue;
+    for (size_t i = 0; i < names.size(); i++) {
+      struct stat st;
+      memset(&st, 0, sizeof(struct stat));
+      if (plus) {
+        fs_fill_stat(inodes[i], &st);
+      } else {
+        st.st_mode = dtype_to_mode(types[i]);
+      }
+      st.st_ino = idx_vec[i];
 
-    // since cfg->use_ino is not set, no need to set this
-    // st.st_ino = dentry->inode;
-    st.st_mode = inode.i_mode;
-    std::string filename(dentry->name, (size_t)dentry->name_len);
+      LOG(INFO) << st.st_ino << " " << st.st_mode << " " << names[i];
+      if (filler(buf, names[i].c_str(), &st, next_offs[i], fill_flags)) {
+        full = true;
+        break;
+      }
+    }
 
-    LOG(INFO) << st.st_ino << " " << st.st_mode << " " << filename;
-    if (filler(buf, filename.c_str(), &st, 0, fill_flags))
+    if (dentry == nullptr)
       break;
   }
 
   LOG(INFO) << "Readdir done!";
   return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,45 @@
+#include "ops.h"
+#include "MetaData.h"
+#include "common.h"
+#include "defrag.h"
+#include "inode.h"
+#include "journal.h"
+#include "types/ext4_inode.h"
+#include "writeback.h"
+#include <glog/logging.h>
+#include <mutex>
+
+int fs_release(const char *path, fuse_file_info *fi) {
+  JournalManager::Handle handle;
+  LOG(INFO) << "Release begin:";
+  FileHandle *fh = file_handle(fi);
+  uint32_t inode_idx = fh->inode_idx;
+  LOG(INFO) << "Release file: " << path << " inode: #" << inode_idx;
+
+  // the file is closed, write back its delayed data
+  GET_INSTANCE(WriteBackManager).flush(inode_idx);
+
+  // the blocks a stream preallocated past the end of file are given back.
+  // The block index changes, so other writers of the inode are kept out
+  // like defrag does, and the size is taken from the inode read under it.
+  if (fh->prealloc_end > 0) {
+    std::unique_lock lock(GET_INSTANCE(DefragManager).inode_lock(inode_idx));
+    ext4_inode inode;
+    if (GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode) >= 0) {
+      uint32_t block_size = GET_INSTANCE(MetaDataManager).block_size();
+      uint64_t size_blocks =
+          (GET_INSTANCE(InodeManager).get_file_size(inode) + block_size - 1) /
+          block_size;
+      if (fh->prealloc_end > size_blocks) {
+        GET_INSTANCE(InodeManager)
+            .free_data_range(inode, size_blocks,
+                             fh->prealloc_end - size_blocks);
+        GET_INSTANCE(InodeManager).update_disk_inode(inode_idx, inode);
+      }
+    }
+  }
+  delete fh;
+
+  LOG(INFO) << "Release done";
+  return 0;
+}
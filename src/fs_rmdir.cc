@@ -1,6 +1,8 @@
 #include "ops.h"
 #include "MetaData.h"
 #include "common.h"
+#include "defrag.h"
+#include "journal.h"
 #include "inode.h"
 #include "types/ext4_dentry.h"
 #include "types/ext4_inode.h"
@@ -10,6 +12,7 @@
 #include <vector>
 
 int fs_rmdir(const char *path) {
+  JournalManager::Handle handle;
   LOG(INFO) << "Rmdir begin:";
   LOG(INFO) << "rmdir( " << path  << " )";
   std::string parent_path, dirname;
@@ -19,6 +22,9 @@ int fs_rmdir(const char *path) {
   get_parent_dir(path, parent_path, dirname);
   LOG(INFO) << "parent directory: " << parent_path << " dirname: " << dirname;
 
+  // the whole tree is freed, no file in it may be moved meanwhile
+  auto locks = GET_INSTANCE(DefragManager).lock_all();
+
   uint32_t parent_inode_idx, cur_inode_idx;
   ext4_inode prefix_inode, cur_inode;
   cur_inode_idx = GET_INSTANCE(InodeManager).get_idx_by_path(path);
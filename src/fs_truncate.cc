@@ -0,0 +1,67 @@
+#include "ops.h"
+#include "common.h"
+#include "defrag.h"
+#include "inode.h"
+#include "journal.h"
+#include "types/ext4_inode.h"
+#include <cstdint>
+#include <glog/logging.h>
+#include <mutex>
+#include <sys/stat.h>
+
+// blocks freed per transaction when a file shrinks
+#define TRUNCATE_CHUNK_BLOCKS 1024
+
+// truncate in a transaction of its own, a large shrink only frees the last
+// chunk of blocks and leaves done false
+static int truncate_step(uint32_t inode_idx, uint64_t size, bool &done) {
+  JournalManager::Handle handle;
+  // shrinking frees blocks and rewrites the index, writers are kept out
+  std::unique_lock lock(GET_INSTANCE(DefragManager).inode_lock(inode_idx));
+  ext4_inode inode;
+  int get_inode_ret =
+      GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
+  if (get_inode_ret < 0)
+    return get_inode_ret;
+  if (S_ISDIR(inode.i_mode))
+    return -EISDIR;
+
+  done = !GET_INSTANCE(InodeManager)
+              .truncate_tail(inode_idx, inode, size, TRUNCATE_CHUNK_BLOCKS);
+  if (done)
+    GET_INSTANCE(InodeManager).truncate(inode_idx, inode, size);
+  GET_INSTANCE(InodeManager).update_disk_inode(inode_idx, inode);
+  return 0;
+}
+
+int fs_truncate(const char *path, off_t size, fuse_file_info *fi) {
+  LOG(INFO) << "Truncate begin:";
+  LOG(INFO) << "truncate( " << path << ", " << size << " )";
+
+  if (size < 0)
+    return -EINVAL;
+
+  uint32_t inode_idx;
+  if (fi) {
+    inode_idx = handle_inode(fi);
+  } else {
+    inode_idx = GET_INSTANCE(InodeManager).get_idx_by_path(path);
+    if (inode_idx == 0)
+      return -ENOENT;
+  }
+  if ((uint64_t)size > GET_INSTANCE(InodeManager).max_file_size())
+    return -EFBIG;
+
+  // a large file is shrunk from its end a chunk at a time, so that the
+  // block vectors stay small and no transaction outgrows the journal
+  bool done = false;
+  while (!done) {
+    int ret = truncate_step(inode_idx, size, done);
+    if (ret < 0)
+      return ret;
+    GET_INSTANCE(JournalManager).commit_if_large();
+  }
+
+  LOG(INFO) << "Truncate done";
+  return 0;
+}
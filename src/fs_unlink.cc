@@ -1,12 +1,16 @@
 #include "ops.h"
 #include "MetaData.h"
 #include "common.h"
+#include "defrag.h"
+#include "journal.h"
 #include "inode.h"
 #include <cstdint>
 #include <glog/logging.h>
+#include <shared_mutex>
 #include <vector>
 
 int fs_unlink(const char *path) {
+  JournalManager::Handle handle;
   LOG(INFO) << "Unlink begin:";
   LOG(INFO) << "unlink( " << path  << " )";
   std::string parent_path, filename;
@@ -19,6 +23,7 @@ int fs_unlink(const char *path) {
   uint32_t parent_inode_idx, cur_inode_idx;
   ext4_inode prefix_inode, cur_inode;
   cur_inode_idx = GET_INSTANCE(InodeManager).get_idx_by_path(path);
+  std::shared_lock lock(GET_INSTANCE(DefragManager).inode_lock(cur_inode_idx));
   GET_INSTANCE(InodeManager).get_inode_by_idx(cur_inode_idx, cur_inode);
   GET_INSTANCE(InodeManager).get_inode_by_path(parent_path, prefix_inode);
 
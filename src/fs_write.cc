@@ -1,14 +1,20 @@
 #include "ops.h"
 #include "MetaData.h"
 #include "common.h"
+#include "defrag.h"
 #include "disk.h"
 #include "inode.h"
+#include "journal.h"
 #include "types/ext4_inode.h"
+#include "writeback.h"
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
 #include <fcntl.h>
 #include <glog/logging.h>
+#include <shared_mutex>
+#include <vector>
 
 static size_t first_write(ext4_inode &inode, const char *buf, size_t size, off_t offset) {
   uint32_t block_size = GET_INSTANCE(MetaDataManager).block_size();
@@ -21,8 +27,8 @@ static size_t first_write(ext4_inode &inode, const char *buf, size_t size, off_t
 
   uint64_t start_pblock = GET_INSTANCE(InodeManager).get_data_pblock(inode, start_lblock);
   if (start_pblock == 0) {  // fill in empty block
-    start_pblock = GET_INSTANCE(MetaDataManager).alloc_new_pblock(start_lblock);
-    GET_INSTANCE(InodeManager).set_data_pblock(inode, start_lblock, start_pblock);
+    GET_INSTANCE(InodeManager).alloc_data_pblocks(inode, start_lblock, 1);
+    start_pblock = GET_INSTANCE(InodeManager).get_data_pblock(inode, start_lblock);
   }
   
   size_t first_write_size = size;
@@ -38,9 +44,9 @@ static size_t first_write(ext4_inode &inode, const char *buf, size_t size, off_t
 int fs_write(const char *path, const char *buf, size_t size, off_t offset,
              struct fuse_file_info *fi) {
   assert(offset >= 0);
+  JournalManager::Handle handle;
   LOG(INFO) << "Write begin: ";
-  LOG(INFO) << "write( " << path << ", buf, " << size << ", " << offset
-            << ", fi->fh=" << fi->fh << ")";
+  LOG(INFO) << "write( " << path << ", buf, " << size << ", " << offset << ")";
   GET_INSTANCE(MetaDataManager).log_hdd_stat();
 
   uint32_t inode_idx;
@@ -48,41 +54,106 @@ int fs_write(const char *path, const char *buf, size_t size, off_t offset,
   if (fi) {
     if (((fi->flags & O_ACCMODE) == O_RDONLY))
       return -EACCES;
-    inode_idx = fi->fh;
+    inode_idx = handle_inode(fi);
   } else {
     inode_idx= GET_INSTANCE(InodeManager).get_idx_by_path(path);
   }
 
+  std::shared_lock lock(GET_INSTANCE(DefragManager).inode_lock(inode_idx));
   int get_inode_ret = GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
   if (get_inode_ret < 0) {
     return get_inode_ret;
   }
+  MetaDataManager::Goal goal(inode_idx);
+
+  // a long sequential stream (a backup, a copy) would only push hot data out
+  // of the ssd, it goes to the hdd unless the file asks for a tier
+  Tier tier = Tier::AUTO;
+  if (fi && file_handle(fi)->sequential(offset, size) &&
+      GET_INSTANCE(InodeManager).tier_hint(inode) == Tier::AUTO)
+    tier = Tier::HDD;
+
+  // tiny file, keep the data in the inode
+  if (GET_INSTANCE(InodeManager).is_inline(inode)) {
+    if (GET_INSTANCE(InodeManager).write_inline(inode, buf, size, offset)) {
+      GET_INSTANCE(InodeManager).update_disk_inode(inode_idx, inode);
+      LOG(INFO) << "Write done";
+      return size;
+    }
+
+    if (!GET_INSTANCE(InodeManager).pack_inline(inode, offset + size))
+      GET_INSTANCE(InodeManager).spill_inline(inode);
+    GET_INSTANCE(InodeManager).update_disk_inode(inode_idx, inode);
+  }
+
+  // small file, packed with other small files
+  if (GET_INSTANCE(InodeManager).is_frag(inode)) {
+    if (GET_INSTANCE(InodeManager).write_frag(inode, buf, size, offset)) {
+      GET_INSTANCE(InodeManager).update_disk_inode(inode_idx, inode);
+      LOG(INFO) << "Write done";
+      return size;
+    }
+
+    GET_INSTANCE(InodeManager).spill_frag(inode);
+    GET_INSTANCE(InodeManager).update_disk_inode(inode_idx, inode);
+  }
+
+  // delayed allocation, blocks are allocated when the pages are written back
+  if (GET_INSTANCE(WriteBackManager).enabled()) {
+    size_t ret = GET_INSTANCE(WriteBackManager).write(inode_idx, buf, size, offset, tier);
+    LOG(INFO) << "Write done";
+    return ret;
+  }
 
   size_t bytes;
   size_t ret = 0;
   size_t un_offset = (size_t)offset;
   uint32_t block_size = GET_INSTANCE(MetaDataManager).block_size();
 
+  // allocate the missing blocks of the whole range together
+  if (size > 0) {
+    uint32_t start_lblock = offset / block_size;
+    uint32_t end_lblock = (offset + size - 1) / block_size;
+    uint64_t count = end_lblock - start_lblock + 1;
+
+    // a stream allocates ahead, so that its blocks stay contiguous while
+    // other files are written, the rest is given back at release
+    if (tier == Tier::HDD &&
+        GET_INSTANCE(InodeManager).get_data_pblock(inode, end_lblock) == 0) {
+      uint64_t max_blocks =
+          GET_INSTANCE(InodeManager).max_file_size() / block_size;
+      count = std::min(count + STREAM_PREALLOC_BLOCKS, max_blocks - start_lblock);
+      FileHandle *fh = file_handle(fi);
+      uint64_t prealloc_end = start_lblock + count;
+      if (fh->prealloc_end < prealloc_end)
+        fh->prealloc_end = prealloc_end;
+    }
+    GET_INSTANCE(InodeManager).alloc_data_pblocks(inode, start_lblock, count, tier);
+  }
+
   // write the first block and doing the alignment
   bytes = first_write(inode, buf, size, offset);
 
   ret = bytes;
   buf += bytes;
   un_offset += bytes;
-  for (uint32_t lblock = un_offset / block_size; size > ret; lblock++) {
-    uint64_t pblock = GET_INSTANCE(InodeManager).get_data_pblock(inode, lblock);
-    if (pblock == 0) {  // fill in empty block
-      pblock = GET_INSTANCE(MetaDataManager).alloc_new_pblock(lblock);
-      GET_INSTANCE(InodeManager).set_data_pblock(inode, lblock, pblock);
-    }
 
+  uint32_t first_lblock = un_offset / block_size;
+  uint32_t lblock_count = (size - ret + block_size - 1) / block_size;
+  std::vector<pblock_t> pblock_vec;
+  GET_INSTANCE(InodeManager).get_data_pblocks(inode, first_lblock, lblock_count, pblock_vec);
+
+  // writes to consecutive pblocks are merged into one
+  BlockIoBatch batch(block_size);
+  for (uint32_t i = 0; size > ret; i++) {
     bytes = (size - ret) > block_size ? block_size : size - ret;
-    GET_INSTANCE(DiskManager).disk_write(buf, bytes, pblock, 0);
-    // DLOG(INFO) << "Write " << bytes << " to block #" << pblock;
+    batch.add(pblock_vec[i], buf, bytes);
+    // DLOG(INFO) << "Write " << bytes << " to block #" << pblock_vec[i];
 
     ret += bytes;
     buf += bytes;
   }
+  batch.write();
 
   assert(size == ret);
 
@@ -0,0 +1,166 @@
+#include "ops.h"
+#include "MetaData.h"
+#include "common.h"
+#include "defrag.h"
+#include "inode.h"
+#include "journal.h"
+#include "types/ext4_inode.h"
+#include "types/hybrid_fs.h"
+#include <cstring>
+#include <glog/logging.h>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <sys/xattr.h>
+
+// the tier policy is the only extended attribute, it lives in the inode flags
+
+static const char *tier_name(Tier tier) {
+  switch (tier) {
+  case Tier::SSD:
+    return "ssd";
+  case Tier::HDD:
+    return "hdd";
+  default:
+    return "auto";
+  }
+}
+
+static bool parse_tier(const char *value, size_t size, Tier &tier) {
+  std::string str(value, size);
+  // tolerate the newline of echo and the terminator of a C string
+  while (!str.empty() && (str.back() == '\n' || str.back() == '\0'))
+    str.pop_back();
+
+  if (str == "ssd")
+    tier = Tier::SSD;
+  else if (str == "hdd")
+    tier = Tier::HDD;
+  else if (str == "auto")
+    tier = Tier::AUTO;
+  else
+    return false;
+  return true;
+}
+
+// change the tier policy of path, AUTO removes it
+static int set_tier(const char *path, Tier tier, int flags) {
+  uint32_t inode_idx = GET_INSTANCE(InodeManager).get_idx_by_path(path);
+  if (inode_idx == 0)
+    return -ENOENT;
+
+  // placement is decided under the shared lock, so writers see either policy
+  std::unique_lock lock(GET_INSTANCE(DefragManager).inode_lock(inode_idx));
+  ext4_inode inode;
+  int get_inode_ret =
+      GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
+  if (get_inode_ret < 0)
+    return get_inode_ret;
+
+  bool exist = (inode.i_flags & HYBRID_TIER_FL) != 0;
+  if ((flags & XATTR_CREATE) != 0 && exist)
+    return -EEXIST;
+  if ((flags & XATTR_REPLACE) != 0 && !exist)
+    return -ENODATA;
+
+  Tier old_tier = GET_INSTANCE(InodeManager).tier_hint(inode);
+  GET_INSTANCE(InodeManager).set_tier_hint(inode, tier);
+  GET_INSTANCE(InodeManager).update_disk_inode(inode_idx, inode);
+  lock.unlock();
+
+  // the blocks already written move to the new tier in the background
+  if (tier != Tier::AUTO && tier != old_tier &&
+      (inode.i_mode & S_IFMT) == S_IFREG)
+    GET_INSTANCE(DefragManager).enqueue(inode_idx);
+  return 0;
+}
+
+int fs_setxattr(const char *path, const char *name, const char *value,
+                size_t size, int flags) {
+  JournalManager::Handle handle;
+  LOG(INFO) << "Setxattr begin:";
+  LOG(INFO) << "setxattr( " << path << ", " << name << ", "
+            << std::string(value, size) << " )";
+
+  if (strcmp(name, HYBRID_TIER_XATTR) != 0)
+    return -ENOTSUP;
+  Tier tier;
+  if (!parse_tier(value, size, tier))
+    return -EINVAL;
+
+  int ret = set_tier(path, tier, flags);
+  LOG(INFO) << "Setxattr done";
+  return ret;
+}
+
+int fs_getxattr(const char *path, const char *name, char *value,
+                size_t size) {
+  LOG(INFO) << "Getxattr begin:";
+  LOG(INFO) << "getxattr( " << path << ", " << name << " )";
+
+  if (strcmp(name, HYBRID_TIER_XATTR) != 0)
+    return -ENODATA;
+
+  uint32_t inode_idx = GET_INSTANCE(InodeManager).get_idx_by_path(path);
+  if (inode_idx == 0)
+    return -ENOENT;
+  ext4_inode inode;
+  int get_inode_ret =
+      GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
+  if (get_inode_ret < 0)
+    return get_inode_ret;
+  if ((inode.i_flags & HYBRID_TIER_FL) == 0)
+    return -ENODATA;
+
+  // size 0 asks for the length of the value
+  const char *str = tier_name(GET_INSTANCE(InodeManager).tier_hint(inode));
+  size_t len = strlen(str);
+  if (size == 0)
+    return len;
+  if (size < len)
+    return -ERANGE;
+  memcpy(value, str, len);
+
+  LOG(INFO) << "Getxattr done";
+  return len;
+}
+
+int fs_listxattr(const char *path, char *list, size_t size) {
+  LOG(INFO) << "Listxattr begin:";
+  LOG(INFO) << "listxattr( " << path << " )";
+
+  uint32_t inode_idx = GET_INSTANCE(InodeManager).get_idx_by_path(path);
+  if (inode_idx == 0)
+    return -ENOENT;
+  ext4_inode inode;
+  int get_inode_ret =
+      GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
+  if (get_inode_ret < 0)
+    return get_inode_ret;
+  if ((inode.i_flags & HYBRID_TIER_FL) == 0)
+    return 0;
+
+  // names are separated by their terminators
+  size_t len = sizeof(HYBRID_TIER_XATTR);
+  if (size == 0)
+    return len;
+  if (size < len)
+    return -ERANGE;
+  memcpy(list, HYBRID_TIER_XATTR, len);
+
+  LOG(INFO) << "Listxattr done";
+  return len;
+}
+
+int fs_removexattr(const char *path, const char *name) {
+  JournalManager::Handle handle;
+  LOG(INFO) << "Removexattr begin:";
+  LOG(INFO) << "removexattr( " << path << ", " << name << " )";
+
+  if (strcmp(name, HYBRID_TIER_XATTR) != 0)
+    return -ENODATA;
+
+  int ret = set_tier(path, Tier::AUTO, XATTR_REPLACE);
+  LOG(INFO) << "Removexattr done";
+  return ret;
+}
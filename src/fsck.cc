@@ -0,0 +1,302 @@
+#include "fsck.h"
+#include "MetaData.h"
+#include "bitmap.h"
+#include "common.h"
+#include "disk.h"
+#include "inode.h"
+#include "types/ext4_inode.h"
+#include "types/hdd_super.h"
+#include "types/hybrid_fs.h"
+#include <algorithm>
+#include <cassert>
+#include <glog/logging.h>
+#include <iostream>
+#include <thread>
+
+FsChecker::FsChecker(uint32_t threads, bool repair)
+    : threads_(std::max(threads, 1u)), repair_(repair), block_size_(0),
+      ssd_blocks_(0), hdd_blocks_(0), problems_(0), inodes_(0), blocks_(0) {}
+
+void FsChecker::parallel_for(uint32_t n,
+                             const std::function<void(uint32_t)> &fn) {
+  std::atomic<uint32_t> next(0);
+  std::vector<std::thread> workers;
+  for (uint32_t i = 0; i < std::min(threads_, n); i++) {
+    workers.emplace_back([&] {
+      uint32_t group_id;
+      while ((group_id = next.fetch_add(1)) < n)
+        fn(group_id);
+    });
+  }
+  for (auto &worker : workers)
+    worker.join();
+}
+
+void FsChecker::mark(pblock_t pblock, bool shared) {
+  UsedMap *used = &ssd_used_;
+  uint64_t idx = pblock;
+  uint64_t limit = ssd_blocks_;
+  if ((pblock & HDD_MASK) != 0) {
+    used = &hdd_used_;
+    idx = pblock & (~HDD_MASK);
+    limit = hdd_blocks_;
+  }
+
+  if (idx >= limit) {
+    LOG(WARNING) << "Block #" << pblock << " is out of range";
+    problems_++;
+    return;
+  }
+
+  uint32_t bit = 1u << (idx % 32);
+  uint32_t old = (*used)[idx / 32].fetch_or(bit);
+  if ((old & bit) != 0 && !shared) {
+    LOG(WARNING) << "Block #" << pblock << " is claimed more than once";
+    problems_++;
+  }
+}
+
+// blocks used by the file system itself
+void FsChecker::mark_metadata() {
+  auto &meta = GET_INSTANCE(MetaDataManager);
+  uint32_t group_count = meta.block_groups_count();
+  uint32_t blocks_per_group = meta.blocks_per_group();
+  uint32_t gdt_blocks =
+      ((uint64_t)group_count * meta.group_desc_size() + block_size_ - 1) /
+      block_size_;
+  uint32_t inode_table_blocks =
+      ((uint64_t)meta.inodes_per_group() * meta.inode_size() + block_size_ -
+       1) /
+      block_size_;
+
+  for (uint32_t group_id = 0; group_id < group_count; group_id++) {
+    uint32_t start = group_id * blocks_per_group;
+    if (meta.group_has_super(group_id)) {
+      uint32_t n = 1 + gdt_blocks + meta.super_.s_reserved_gdt_blocks;
+      for (uint32_t i = 0; i < n; i++)
+        mark(start + i, true);
+    }
+
+    mark(meta.block_bitmap_block_idx(group_id), false);
+    mark(meta.inode_bitmap_block_idx(group_id), false);
+    pblock_t inode_table = meta.inode_table_block_idx(group_id);
+    for (uint32_t i = 0; i < inode_table_blocks; i++)
+      mark(inode_table + i, false);
+  }
+
+  // the tail of the last group does not exist
+  for (uint64_t i = meta.super_.s_blocks_count_lo; i < ssd_blocks_; i++)
+    mark(i, true);
+
+  uint32_t journal_pblock, journal_blocks;
+  if (meta.journal_location(journal_pblock, journal_blocks)) {
+    for (uint32_t i = 0; i < journal_blocks; i++)
+      mark(journal_pblock + i, false);
+  }
+
+  // hdd super block, gdt and one bitmap per group
+  uint32_t hdd_gdt_blocks =
+      1 + (sizeof(hdd_super_block) +
+           meta.hdd_gdt_table_.size() * sizeof(hdd_group_desc) - 1) /
+              block_size_;
+  for (uint32_t i = 0; i < hdd_gdt_blocks; i++)
+    mark(HDD_BLOCK_IDX(i), false);
+  for (uint32_t i = 0; i < meta.hdd_gdt_table_.size(); i++)
+    mark(meta.hdd_bitmap_block_idx(i), false);
+}
+
+// walk the allocated inodes of the group and claim their blocks
+void FsChecker::scan_group(uint32_t group_id) {
+  auto &meta = GET_INSTANCE(MetaDataManager);
+  auto &inode_manager = GET_INSTANCE(InodeManager);
+  uint32_t inodes_per_group = meta.inodes_per_group();
+  size_t inode_size = meta.inode_size();
+
+  Bitmap inode_bitmap(block_size_);
+  inode_bitmap.load(meta.inode_bitmap_block_idx(group_id));
+
+  // the whole inode table is read at once
+  std::vector<std::byte> table((size_t)inodes_per_group * inode_size);
+  GET_INSTANCE(DiskManager)
+      .metadata_read(table.data(), table.size(),
+                     meta.block_to_bytes(meta.inode_table_block_idx(group_id)));
+
+  uint32_t used_inodes = 0, used_dirs = 0;
+  std::vector<pblock_t> pblock_vec;
+  for (uint32_t i = 0; i < inodes_per_group; i++) {
+    if (!inode_bitmap.lookup(i))
+      continue;
+    used_inodes++;
+
+    ext4_inode inode;
+    memset(&inode, 0, sizeof(ext4_inode));
+    memcpy(&inode, &table[i * inode_size],
+           std::min(inode_size, sizeof(ext4_inode)));
+    if (inode.i_mode == 0 && inode.i_links_count == 0)
+      continue;
+    if ((inode.i_mode & S_IFMT) == S_IFDIR)
+      used_dirs++;
+
+    uint32_t inode_idx = group_id * inodes_per_group + i + 1;
+    if (inode.i_flags & EXT4_EXTENTS_FL) {
+      LOG(WARNING) << "Inode #" << inode_idx << " uses extents, skipped";
+      continue;
+    }
+
+    if (inode_manager.is_frag(inode)) {
+      mark(pblock_from32(inode.i_obso_faddr), true);
+      continue;
+    }
+
+    // fast symlinks keep the target in i_block
+    if ((inode.i_mode & S_IFMT) == S_IFLNK && inode.i_blocks_lo == 0)
+      continue;
+
+    pblock_vec.clear();
+    inode_manager.collect_file_pblock(inode, pblock_vec);
+    for (auto pblock : pblock_vec)
+      mark(pblock, false);
+    blocks_ += pblock_vec.size();
+  }
+
+  inodes_ += used_inodes;
+  inode_free_[group_id] = inodes_per_group - used_inodes;
+  used_dirs_[group_id] = used_dirs;
+}
+
+uint32_t FsChecker::compare_bitmap(const std::atomic<uint32_t> *used,
+                                   uint32_t *disk, uint32_t count, bool hdd,
+                                   uint32_t group_id) {
+  uint32_t used_blocks = 0, missing = 0, leaked = 0;
+  for (uint32_t i = 0; i < (count + 31) / 32; i++) {
+    uint32_t mask = (count - i * 32 >= 32) ? ~0u : (1u << (count % 32)) - 1;
+    uint32_t expect = used[i].load() & mask;
+    uint32_t actual = disk[i] & mask;
+
+    used_blocks += __builtin_popcount(expect);
+    missing += __builtin_popcount(expect & ~actual);
+    leaked += __builtin_popcount(actual & ~expect);
+    if (repair_)
+      disk[i] = (disk[i] & ~mask) | expect;
+  }
+
+  const char *tier = hdd ? "HDD" : "SSD";
+  if (missing > 0) {
+    LOG(WARNING) << tier << " group " << group_id << ": " << missing
+                 << " blocks in use are marked free";
+    problems_ += missing;
+  }
+  if (leaked > 0) {
+    LOG(WARNING) << tier << " group " << group_id << ": " << leaked
+                 << " blocks are marked used but not referenced";
+    problems_ += leaked;
+  }
+  return used_blocks;
+}
+
+void FsChecker::check_ssd_group(uint32_t group_id) {
+  auto &meta = GET_INSTANCE(MetaDataManager);
+  uint32_t blocks_per_group = meta.blocks_per_group();
+
+  Bitmap bitmap(block_size_);
+  pblock_t bitmap_pblock = meta.block_bitmap_block_idx(group_id);
+  bitmap.load(bitmap_pblock);
+  uint32_t used_blocks = compare_bitmap(
+      &ssd_used_[(uint64_t)group_id * blocks_per_group / 32],
+      (uint32_t *)bitmap.data(), blocks_per_group, false, group_id);
+
+  uint32_t free_blocks = blocks_per_group - used_blocks;
+  bool dirty = false;
+  if (meta.get_block_bitmap_free_block_count(group_id) != free_blocks) {
+    LOG(WARNING) << "SSD group " << group_id << ": free blocks count is "
+                 << meta.get_block_bitmap_free_block_count(group_id)
+                 << ", should be " << free_blocks;
+    problems_++;
+    meta.set_block_bitmap_free_block_count(group_id, free_blocks);
+    dirty = true;
+  }
+  if (meta.get_inode_bitmap_free_block_count(group_id) !=
+      inode_free_[group_id]) {
+    LOG(WARNING) << "SSD group " << group_id << ": free inodes count is "
+                 << meta.get_inode_bitmap_free_block_count(group_id)
+                 << ", should be " << inode_free_[group_id];
+    problems_++;
+    meta.set_inode_bitmap_free_block_count(group_id, inode_free_[group_id]);
+    dirty = true;
+  }
+  if (meta.get_used_dirs_count(group_id) != used_dirs_[group_id]) {
+    LOG(WARNING) << "SSD group " << group_id << ": directories count is "
+                 << meta.get_used_dirs_count(group_id) << ", should be "
+                 << used_dirs_[group_id];
+    problems_++;
+    meta.set_used_dirs_count(group_id, used_dirs_[group_id]);
+    dirty = true;
+  }
+
+  if (repair_) {
+    bitmap.save(bitmap_pblock);
+    if (dirty)
+      meta.gdt_write_back(group_id, group_id);
+  }
+}
+
+void FsChecker::check_hdd_group(uint32_t group_id) {
+  auto &meta = GET_INSTANCE(MetaDataManager);
+  uint32_t blocks_per_group = meta.hdd_blocks_per_group();
+  hdd_group_desc &desc = meta.hdd_gdt_table_[group_id];
+
+  Bitmap bitmap(block_size_);
+  bitmap.load(meta.hdd_bitmap_block_idx(group_id));
+  uint32_t used_blocks = compare_bitmap(
+      &hdd_used_[(uint64_t)group_id * blocks_per_group / 32],
+      (uint32_t *)bitmap.data(), blocks_per_group, true, group_id);
+
+  uint32_t free_blocks = blocks_per_group - used_blocks;
+  if (desc.bg_free_blocks_count != free_blocks) {
+    LOG(WARNING) << "HDD group " << group_id << ": free blocks count is "
+                 << desc.bg_free_blocks_count << ", should be "
+                 << free_blocks;
+    problems_++;
+    desc.bg_free_blocks_count = free_blocks;
+  }
+
+  if (repair_)
+    bitmap.save(meta.hdd_bitmap_block_idx(group_id));
+}
+
+uint64_t FsChecker::check() {
+  auto &meta = GET_INSTANCE(MetaDataManager);
+  block_size_ = meta.block_size();
+
+  uint32_t ssd_groups = meta.block_groups_count();
+  uint32_t hdd_groups = meta.hdd_gdt_table_.size();
+  ssd_blocks_ = (uint64_t)ssd_groups * meta.blocks_per_group();
+  hdd_blocks_ = (uint64_t)hdd_groups * meta.hdd_blocks_per_group();
+  ssd_used_ = UsedMap((ssd_blocks_ + 31) / 32);
+  hdd_used_ = UsedMap((hdd_blocks_ + 31) / 32);
+  inode_free_.assign(ssd_groups, 0);
+  used_dirs_.assign(ssd_groups, 0);
+
+  std::cout << "Pass 1: scanning " << ssd_groups << " groups with "
+            << threads_ << " threads" << std::endl;
+  mark_metadata();
+  parallel_for(ssd_groups, [this](uint32_t g) { scan_group(g); });
+  std::cout << "  " << inodes_ << " inodes, " << blocks_ << " blocks"
+            << std::endl;
+
+  std::cout << "Pass 2: checking bitmaps and free counts" << std::endl;
+  parallel_for(ssd_groups, [this](uint32_t g) { check_ssd_group(g); });
+  parallel_for(hdd_groups, [this](uint32_t g) { check_hdd_group(g); });
+
+  if (repair_ && problems_ > 0) {
+    GET_INSTANCE(DiskManager)
+        .metadata_write(meta.hdd_gdt_table_.data(),
+                        hdd_groups * sizeof(hdd_group_desc), HDD_BLOCK_IDX(0),
+                        sizeof(hdd_super_block));
+    GET_INSTANCE(DiskManager).disk_sync();
+  }
+
+  std::cout << problems_ << " problems found"
+            << (repair_ && problems_ > 0 ? ", repaired" : "") << std::endl;
+  return problems_;
+}
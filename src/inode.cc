@@ -5,17 +5,32 @@
 #include "disk.h"
 #include "types/ext4_dentry.h"
 #include "types/ext4_inode.h"
+#include "writeback.h"
 #include <algorithm>
+#include <atomic>
 #include <bits/types/time_t.h>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
+#include <functional>
 #include <glog/logging.h>
+#include <iterator>
+#include <mutex>
 #include <string>
 #include <sys/types.h>
+#include <thread>
 #include <vector>
 
-#define ROOT_INODE 2
+// the cache holds at most this many inodes
+#define INODE_CACHE_SIZE 65536
+// inode table prefetch reads at most this many blocks at once, skipping over
+// holes up to PREFETCH_MAX_GAP blocks
+#define PREFETCH_MAX_BLOCKS 64
+#define PREFETCH_MAX_GAP 4
+// recursive removal walks the tree with at most this many threads, handing
+// out RM_TREE_CHUNK entries at a time
+#define RM_TREE_MAX_THREADS 8
+#define RM_TREE_CHUNK 256
 
 inline static uint16_t cal_min_rec_len(const ext4_dir_entry_2 &dentry) {
   uint16_t res = sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint8_t) * 2 +
@@ -50,10 +65,14 @@ InodeManager &InodeManager::get_instance() {
 
 // Called after Super Block initialized
 int InodeManager::init() {
+  load_layout();
+  return GET_INSTANCE(DCacheManager).init_root(ROOT_INODE);
+}
+
+void InodeManager::load_layout() {
   block_size_ = GET_INSTANCE(MetaDataManager).block_size();
   inode_size_ = std::min((size_t)GET_INSTANCE(MetaDataManager).inode_size(),
                          sizeof(ext4_inode));
-  return GET_INSTANCE(DCacheManager).init_root(ROOT_INODE);
 }
 
 int InodeManager::get_inode_by_path(const std::string &path,
@@ -68,9 +87,28 @@ int InodeManager::get_inode_by_idx(uint32_t n, ext4_inode &res) {
   if (n == 0)
     return -ENOENT;
 
+  uint64_t gen;
+  {
+    std::lock_guard lock(inode_cache_mutex_);
+    auto it = inode_cache_.find(n);
+    if (it != inode_cache_.end()) {
+      res = it->second.inode;
+      inode_lru_.splice(inode_lru_.begin(), inode_lru_, it->second.lru);
+      return 0;
+    }
+    gen = inode_gen_[n % INODE_GEN_SLOTS];
+  }
+
   off_t off = GET_INSTANCE(MetaDataManager).inode_table_entry_offset(n);
-  GET_INSTANCE(DiskManager).metadata_read(&res, inode_size_, off);
+  if (void *ptr =
+          GET_INSTANCE(DiskManager).metadata_ptr(off, inode_size_)) {
+    // mmap-backed inode table, no syscall needed
+    memcpy(&res, ptr, inode_size_);
+  } else {
+    GET_INSTANCE(DiskManager).metadata_read(&res, inode_size_, off);
+  }
   LOG(INFO) << "Read Inode #" << n << " from offset: " << off;
+  cache_inode(n, res, false, gen);
   return 0;
 }
 
@@ -79,10 +117,132 @@ void InodeManager::update_disk_inode(uint32_t inode_idx, const ext4_inode &inode
 
   off_t offset =
       GET_INSTANCE(MetaDataManager).inode_table_entry_offset(inode_idx);
-  GET_INSTANCE(DiskManager).metadata_write(&inode, inode_size_, offset);
+  if (void *ptr =
+          GET_INSTANCE(DiskManager).metadata_ptr(offset, inode_size_)) {
+    memcpy(ptr, &inode, inode_size_);
+    GET_INSTANCE(DiskManager).metadata_mark_dirty(offset, inode_size_);
+  } else {
+    GET_INSTANCE(DiskManager).metadata_write(&inode, inode_size_, offset);
+  }
+  // after the write, a read missing the cache from now on sees the new copy
+  cache_inode(inode_idx, inode, true);
   LOG(INFO) << "Write Inode #" << inode_idx << " from offset: " << offset << " : " << inode_str(inode);
 }
 
+// A read must not replace a newer copy cached by an update. It is dropped
+// if an update or an eviction came in since gen was taken, as the disk may
+// have been read before that update reached it.
+void InodeManager::cache_inode(uint32_t inode_idx, const ext4_inode &inode,
+                               bool update, uint64_t gen) {
+  std::lock_guard lock(inode_cache_mutex_);
+  uint64_t &slot_gen = inode_gen_[inode_idx % INODE_GEN_SLOTS];
+  if (update)
+    slot_gen++;
+  else if (slot_gen != gen)
+    return;
+
+  auto it = inode_cache_.find(inode_idx);
+  if (it != inode_cache_.end()) {
+    if (update)
+      it->second.inode = inode;
+    inode_lru_.splice(inode_lru_.begin(), inode_lru_, it->second.lru);
+    return;
+  }
+
+  if (inode_cache_.size() >= INODE_CACHE_SIZE) {
+    uint32_t victim = inode_lru_.back();
+    inode_lru_.pop_back();
+    inode_cache_.erase(victim);
+    inode_gen_[victim % INODE_GEN_SLOTS]++;
+  }
+
+  InodeCtx ctx;
+  ctx.dirty = false;
+  ctx.inode = inode;
+  ctx.lru = inode_lru_.insert(inode_lru_.begin(), inode_idx);
+  inode_cache_.emplace(inode_idx, ctx);
+}
+
+void InodeManager::evict_inode(uint32_t inode_idx) {
+  std::lock_guard lock(inode_cache_mutex_);
+  inode_gen_[inode_idx % INODE_GEN_SLOTS]++;
+  auto it = inode_cache_.find(inode_idx);
+  if (it == inode_cache_.end())
+    return;
+  inode_lru_.erase(it->second.lru);
+  inode_cache_.erase(it);
+}
+
+void InodeManager::get_inodes(const std::vector<uint32_t> &idx_vec,
+                              std::vector<ext4_inode> &res) {
+  prefetch_inodes(idx_vec);
+
+  res.resize(idx_vec.size());
+  for (size_t i = 0; i < idx_vec.size(); i++)
+    get_inode_by_idx(idx_vec[i], res[i]);
+}
+
+// read the inode table blocks holding idx_vec into the cache, blocks of the
+// same group that are close to each other are read with a single read
+void InodeManager::prefetch_inodes(const std::vector<uint32_t> &idx_vec) {
+  auto &meta = GET_INSTANCE(MetaDataManager);
+  uint32_t inodes_per_group = meta.inodes_per_group();
+  size_t disk_inode_size = meta.inode_size();
+  uint32_t inodes_per_block = block_size_ / disk_inode_size;
+
+  // table blocks of the missing inodes, as (group, block in table)
+  std::vector<std::pair<uint32_t, uint32_t>> blocks;
+  {
+    std::lock_guard lock(inode_cache_mutex_);
+    for (auto idx : idx_vec) {
+      if (idx == 0 || inode_cache_.count(idx) != 0)
+        continue;
+      uint32_t n = idx - 1;
+      blocks.emplace_back(n / inodes_per_group,
+                          (n % inodes_per_group) / inodes_per_block);
+    }
+  }
+  std::sort(blocks.begin(), blocks.end());
+  blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+
+  size_t i = 0;
+  std::vector<std::byte> buf;
+  while (i < blocks.size()) {
+    uint32_t group_id = blocks[i].first;
+    uint32_t first = blocks[i].second, last = first;
+    size_t j = i + 1;
+    // small holes are cheaper to read through than to seek over
+    while (j < blocks.size() && blocks[j].first == group_id &&
+           blocks[j].second - last <= PREFETCH_MAX_GAP &&
+           blocks[j].second - first < PREFETCH_MAX_BLOCKS) {
+      last = blocks[j].second;
+      j++;
+    }
+
+    uint32_t first_idx =
+        group_id * inodes_per_group + first * inodes_per_block + 1;
+    uint32_t count = std::min((last - first + 1) * inodes_per_block,
+                              inodes_per_group - first * inodes_per_block);
+    std::vector<uint64_t> gens(count);
+    {
+      std::lock_guard lock(inode_cache_mutex_);
+      for (uint32_t k = 0; k < count; k++)
+        gens[k] = inode_gen_[(first_idx + k) % INODE_GEN_SLOTS];
+    }
+    buf.resize((size_t)count * disk_inode_size);
+    GET_INSTANCE(DiskManager)
+        .metadata_read(buf.data(), buf.size(),
+                       meta.inode_table_entry_offset(first_idx));
+
+    for (uint32_t k = 0; k < count; k++) {
+      ext4_inode inode;
+      memcpy(&inode, &buf[(size_t)k * disk_inode_size], inode_size_);
+      cache_inode(first_idx + k, inode, false, gens[k]);
+    }
+    i = j;
+  }
+}
+
 ext4_dir_entry_2 *InodeManager::get_dentry(const ext4_inode &inode,
                                            off_t offset, DirCtx &ctx) {
   uint32_t lblock = offset / block_size_;
@@ -90,14 +250,26 @@ ext4_dir_entry_2 *InodeManager::get_dentry(const ext4_inode &inode,
   uint32_t file_block_count = get_file_blocks_count(inode);
   size_t un_offset = (size_t)offset;
 
+  if (is_inline(inode)) {
+    if (un_offset >= get_file_size(inode))
+      return nullptr;
+
+    if (ctx.lblock != 0) {
+      memset(ctx.buf, 0, block_size_);
+      memcpy(ctx.buf, inode.i_block, EXT4_MIN_INLINE_DATA_SIZE);
+      ctx.lblock = 0;
+    }
+    return (ext4_dir_entry_2 *)&ctx.buf[block_offset];
+  }
+
   if (file_block_count == lblock) {
     return nullptr;
   }
 
   // check if current block in disk
   if (lblock != ctx.lblock) {
-    uint32_t dir_data_pblock = get_data_pblock(inode, lblock);
-    GET_INSTANCE(DiskManager).disk_block_read(ctx.buf, dir_data_pblock);
+    pblock_t dir_data_pblock = get_data_pblock(inode, lblock);
+    GET_INSTANCE(DiskManager).metadata_block_read(ctx.buf, dir_data_pblock);
     ctx.lblock = lblock;
   }
 
@@ -219,6 +391,12 @@ void InodeManager::set_file_blocks_count(ext4_inode &inode,
 // Add entry to directory and update disk content
 void InodeManager::add_dentry(ext4_inode &prefix_inode,
                               const ext4_dir_entry_2 &new_dentry) {
+  if (is_inline(prefix_inode)) {
+    if (add_dentry_inline(prefix_inode, new_dentry))
+      return;
+    spill_inline(prefix_inode);
+  }
+
   uint16_t new_min_rec_len = cal_min_rec_len(new_dentry);
 
   off_t offset = 0;
@@ -274,7 +452,7 @@ void InodeManager::add_dentry(ext4_inode &prefix_inode,
     uint64_t block_count = get_file_blocks_count(prefix_inode);
 
     // get new data block
-    uint32_t pblock = GET_INSTANCE(MetaDataManager).alloc_new_ssd_pblock();
+    pblock_t pblock = GET_INSTANCE(MetaDataManager).alloc_new_ssd_pblock();
 
     // set new dir data block
     assert(((uint32_t)-1 + 1) == 0);
@@ -295,8 +473,76 @@ void InodeManager::add_dentry(ext4_inode &prefix_inode,
   }
 
   // update directory content in disk
-  uint32_t dir_data_pblock = get_data_pblock(prefix_inode, dir_ctx.lblock);
-  GET_INSTANCE(DiskManager).disk_block_write(dir_ctx.buf, dir_data_pblock);
+  pblock_t dir_data_pblock = get_data_pblock(prefix_inode, dir_ctx.lblock);
+  GET_INSTANCE(DiskManager).metadata_block_write(dir_ctx.buf, dir_data_pblock);
+}
+
+// Add entry to inline directory, the caller updates the inode on disk.
+// Return false if there is no enough space.
+bool InodeManager::add_dentry_inline(ext4_inode &prefix_inode,
+                                     const ext4_dir_entry_2 &new_dentry) {
+  uint16_t new_min_rec_len = cal_min_rec_len(new_dentry);
+  uint16_t inline_size = EXT4_MIN_INLINE_DATA_SIZE;
+  std::byte *buf = (std::byte *)prefix_inode.i_block;
+
+  // empty directory
+  if (get_file_size(prefix_inode) == 0) {
+    if (new_min_rec_len > inline_size)
+      return false;
+
+    ext4_dir_entry_2 *new_add_entry = (ext4_dir_entry_2 *)buf;
+    copy_dentry(new_dentry, new_add_entry);
+    new_add_entry->rec_len = inline_size;
+    set_file_size(prefix_inode, inline_size);
+    LOG(INFO) << "Add inline " << dentry_str(*new_add_entry);
+    return true;
+  }
+
+  off_t offset = 0;
+  while (offset < inline_size) {
+    ext4_dir_entry_2 *iter_dentry = (ext4_dir_entry_2 *)&buf[offset];
+
+    // The case which first entry is deleted
+    if (offset == 0 && iter_dentry->inode == 0) {
+      if (iter_dentry->rec_len >= new_min_rec_len) {
+        uint16_t rec_len = iter_dentry->rec_len;
+        copy_dentry(new_dentry, iter_dentry);
+        iter_dentry->rec_len = rec_len;
+        LOG(INFO) << "Add inline " << dentry_str(*iter_dentry);
+        return true;
+      }
+      offset += iter_dentry->rec_len;
+      continue;
+    }
+
+    uint16_t iter_min_rec_len = cal_min_rec_len(*iter_dentry);
+    if (new_min_rec_len + iter_min_rec_len <= iter_dentry->rec_len) {
+      ext4_dir_entry_2 *new_add_entry =
+          (ext4_dir_entry_2 *)&buf[offset + iter_min_rec_len];
+      copy_dentry(new_dentry, new_add_entry);
+      new_add_entry->rec_len = iter_dentry->rec_len - iter_min_rec_len;
+      iter_dentry->rec_len = iter_min_rec_len;
+      LOG(INFO) << "Add inline " << dentry_str(*new_add_entry);
+      return true;
+    }
+
+    offset += iter_dentry->rec_len;
+  }
+  return false;
+}
+
+// update the directory block held by ctx in disk
+void InodeManager::dir_block_write_back(ext4_inode &prefix_inode,
+                                        uint32_t prefix_inode_idx,
+                                        const DirCtx &ctx) {
+  if (is_inline(prefix_inode)) {
+    memcpy(prefix_inode.i_block, ctx.buf, EXT4_MIN_INLINE_DATA_SIZE);
+    update_disk_inode(prefix_inode_idx, prefix_inode);
+    return;
+  }
+
+  pblock_t dir_data_pblock = get_data_pblock(prefix_inode, ctx.lblock);
+  GET_INSTANCE(DiskManager).metadata_block_write(ctx.buf, dir_data_pblock);
 }
 
 // remove dentry from directory
@@ -323,7 +569,9 @@ void InodeManager::rm_dentry(ext4_inode &prefix_inode, uint32_t cur_inode_idx) {
   }
 
   // check if cur_inode_idx in a single block
-  if (iter_dentry->rec_len == block_size_) {
+  uint32_t dir_block_size =
+      is_inline(prefix_inode) ? EXT4_MIN_INLINE_DATA_SIZE : block_size_;
+  if (iter_dentry->rec_len == dir_block_size) {
     iter_dentry->inode = 0;
   } else {
     pre_dentry->rec_len += iter_dentry->rec_len;
@@ -334,45 +582,156 @@ void InodeManager::rm_dentry(ext4_inode &prefix_inode, uint32_t cur_inode_idx) {
   GET_INSTANCE(DCacheManager).remove(filename, prefix_inode_idx);
 
   // update directory content in disk
-  uint32_t dir_data_pblock = get_data_pblock(prefix_inode, dir_ctx.lblock);
-  GET_INSTANCE(DiskManager).disk_block_write(dir_ctx.buf, dir_data_pblock);
+  dir_block_write_back(prefix_inode, prefix_inode_idx, dir_ctx);
+}
+
+// run fn over [0, n) in chunks of RM_TREE_CHUNK items on a pool of threads
+static void parallel_chunks(size_t n,
+                            const std::function<void(size_t, size_t)> &fn) {
+  size_t chunks = (n + RM_TREE_CHUNK - 1) / RM_TREE_CHUNK;
+  size_t threads = std::min<size_t>(
+      std::max(std::thread::hardware_concurrency(), 1u), RM_TREE_MAX_THREADS);
+  threads = std::min(threads, chunks);
+
+  std::atomic<size_t> next(0);
+  auto worker = [&] {
+    size_t chunk;
+    while ((chunk = next.fetch_add(1)) < chunks) {
+      fn(chunk * RM_TREE_CHUNK, std::min(n, (chunk + 1) * RM_TREE_CHUNK));
+    }
+  };
+
+  // the calling thread works as well
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; i++)
+    workers.emplace_back(worker);
+  worker();
+  for (auto &t : workers)
+    t.join();
 }
 
+// Remove the whole tree under cur_inode, cur_inode itself included. The tree
+// is walked level by level on a pool of threads collecting every inode and
+// block, which are then freed with one pass over the bitmaps.
 void InodeManager::rm_dir(ext4_inode &cur_inode, uint32_t cur_inode_idx) {
-  off_t dentry_off = 0;
-  uint32_t block_size = GET_INSTANCE(MetaDataManager).block_size();
-  DirCtx dir_ctx(block_size);
-
-  // ignore . ..
-  ext4_dir_entry_2 *dentry = get_dentry(cur_inode, dentry_off, dir_ctx);
-  dentry_off += dentry->rec_len;
-  dentry = GET_INSTANCE(InodeManager).get_dentry(cur_inode, dentry_off, dir_ctx);
-  dentry_off += dentry->rec_len;
-
-  while ((dentry =
-              GET_INSTANCE(InodeManager).get_dentry(cur_inode, dentry_off, dir_ctx)) !=
-         nullptr) {
-    dentry_off += dentry->rec_len;
-
-    if (dentry->inode == 0)
-      continue;
+  struct Child {
+    uint32_t parent_idx;
+    uint32_t inode_idx;
+    uint8_t file_type;
+    std::string name;
+  };
+
+  std::vector<std::pair<uint32_t, ext4_inode>> level = {
+      {cur_inode_idx, cur_inode}};
+  std::vector<uint32_t> inode_vec = {cur_inode_idx};
+  std::vector<pblock_t> pblock_vec;
+  std::vector<Child> child_vec;
+  std::vector<std::pair<uint32_t, ext4_inode>> frag_vec;
+  std::mutex mutex;
+
+  while (!level.empty()) {
+    // list the entries of the directories in this level
+    size_t level_child_begin = child_vec.size();
+    parallel_chunks(level.size(), [&](size_t begin, size_t end) {
+      std::vector<pblock_t> local_pblock_vec;
+      std::vector<Child> local_child_vec;
+      DirCtx dir_ctx(block_size_);
+      for (size_t i = begin; i < end; i++) {
+        auto &[dir_idx, dir_inode] = level[i];
+        collect_file_pblock(dir_inode, local_pblock_vec);
+
+        // ignore . ..
+        off_t dentry_off = 0;
+        ext4_dir_entry_2 *dentry = get_dentry(dir_inode, dentry_off, dir_ctx);
+        dentry_off += dentry->rec_len;
+        dentry = get_dentry(dir_inode, dentry_off, dir_ctx);
+        dentry_off += dentry->rec_len;
+
+        std::vector<uint32_t> idx_vec;
+        while ((dentry = get_dentry(dir_inode, dentry_off, dir_ctx)) !=
+               nullptr) {
+          dentry_off += dentry->rec_len;
+          if (dentry->inode == 0)
+            continue;
+
+          idx_vec.push_back(dentry->inode);
+          local_child_vec.push_back(
+              {dir_idx, dentry->inode, dentry->file_type,
+               std::string(dentry->name, dentry->name_len)});
+        }
+        prefetch_inodes(idx_vec);
+      }
 
-    ext4_inode iter_inode;
-    get_inode_by_idx(dentry->inode, iter_inode);
+      std::lock_guard lock(mutex);
+      pblock_vec.insert(pblock_vec.end(), local_pblock_vec.begin(),
+                        local_pblock_vec.end());
+      std::move(local_child_vec.begin(), local_child_vec.end(),
+                std::back_inserter(child_vec));
+    });
+
+    // collect the blocks of the files, the directories form the next level
+    std::vector<std::pair<uint32_t, ext4_inode>> next_level;
+    size_t level_child_count = child_vec.size() - level_child_begin;
+    parallel_chunks(level_child_count, [&](size_t begin, size_t end) {
+      std::vector<pblock_t> local_pblock_vec;
+      std::vector<std::pair<uint32_t, ext4_inode>> local_dir_vec, local_frag_vec;
+      for (size_t i = begin; i < end; i++) {
+        Child &child = child_vec[level_child_begin + i];
+        ext4_inode inode;
+        get_inode_by_idx(child.inode_idx, inode);
+
+        if (child.file_type == EXT4_FT_DIR) {
+          local_dir_vec.emplace_back(child.inode_idx, inode);
+        } else if (is_frag(inode)) {
+          local_frag_vec.emplace_back(child.inode_idx, inode);
+        } else {
+          collect_file_pblock(inode, local_pblock_vec);
+        }
+      }
 
-    if ((dentry->file_type & 0x2) != 0) {
-      rm_dir(iter_inode, dentry->inode);
-    } else {
-      rm_file(iter_inode, dentry->inode);
-    }
+      std::lock_guard lock(mutex);
+      pblock_vec.insert(pblock_vec.end(), local_pblock_vec.begin(),
+                        local_pblock_vec.end());
+      next_level.insert(next_level.end(), local_dir_vec.begin(),
+                        local_dir_vec.end());
+      frag_vec.insert(frag_vec.end(), local_frag_vec.begin(),
+                      local_frag_vec.end());
+    });
+
+    level = std::move(next_level);
+  }
+
+  // the packed fragments and the caches are not thread safe
+  for (auto &[frag_idx, frag_inode] : frag_vec) {
+    free_frag(frag_inode);
+  }
+  std::vector<uint32_t> dir_vec = {cur_inode_idx};
+  for (auto &child : child_vec) {
+    inode_vec.push_back(child.inode_idx);
+    if (child.file_type == EXT4_FT_DIR)
+      dir_vec.push_back(child.inode_idx);
+    GET_INSTANCE(DCacheManager).remove(child.name, child.parent_idx);
+  }
+  for (auto &inode_idx : inode_vec) {
+    GET_INSTANCE(WriteBackManager).drop(inode_idx);
+  }
+
+  GET_INSTANCE(MetaDataManager).free_pblock(pblock_vec);
+  GET_INSTANCE(MetaDataManager).free_inodes(inode_vec, dir_vec);
+  for (auto &inode_idx : inode_vec) {
+    evict_inode(inode_idx);
   }
 }
 
 void InodeManager::rm_file(ext4_inode &cur_inode, uint32_t cur_inode_idx) {
-  std::vector<uint32_t> pblock_to_remove;
+  std::vector<pblock_t> pblock_to_remove;
   
   // rm_dentry(prefix_inode, cur_inode_idx);
+  GET_INSTANCE(WriteBackManager).drop(cur_inode_idx);
+  if (is_frag(cur_inode))
+    free_frag(cur_inode);
   collect_file_pblock(cur_inode, pblock_to_remove);
   GET_INSTANCE(MetaDataManager).free_pblock(pblock_to_remove);
   GET_INSTANCE(MetaDataManager).free_inode(cur_inode_idx);
+  evict_inode(cur_inode_idx);
 }
\ No newline at end of file
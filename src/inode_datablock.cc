@@ -3,250 +3,452 @@
 #include "disk.h"
 #include "inode.h"
 #include "types/ext4_inode.h"
+#include "types/hybrid_fs.h"
+#include <algorithm>
 #include <assert.h>
 #include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <fcntl.h>
 #include <glog/logging.h>
+#include <iterator>
+#include <unordered_map>
 #include <vector>
 
-#define IND_BLOCK_SIZE (block_size_ / sizeof(uint32_t))
-#define DIND_BLOCK_SIZE (IND_BLOCK_SIZE * IND_BLOCK_SIZE)
-#define TIND_BLOCK_SIZE (DIND_BLOCK_SIZE * IND_BLOCK_SIZE)
-#define MAX_IND_BLOCK (EXT4_NDIR_BLOCKS + IND_BLOCK_SIZE)
-#define MAX_DIND_BLOCK (MAX_IND_BLOCK + DIND_BLOCK_SIZE)
-#define MAX_TIND_BLOCK (MAX_DIND_BLOCK + TIND_BLOCK_SIZE)
+// Block map. A narrow inode keeps the ext2 layout: 32 bit entries, 12
+// direct blocks and the roots of the indirect, double and triple indirect
+// trees in i_block. A wide inode (HYBRID_WIDE_MAP_FL) keeps 64 bit entries,
+// i_block holds 3 direct blocks and the roots of 4 trees, each index block
+// holds block_size / 8 entries.
+#define WIDE_NDIR_BLOCKS 3
+#define WIDE_MAP_LEVELS 4
+
+BlockMapLayout InodeManager::map_layout(const ext4_inode &inode) {
+  if ((inode.i_flags & HYBRID_WIDE_MAP_FL) != 0)
+    return {true, WIDE_NDIR_BLOCKS, WIDE_MAP_LEVELS,
+            block_size_ / sizeof(pblock_t)};
+  return {false, EXT4_NDIR_BLOCKS, 3, block_size_ / sizeof(uint32_t)};
+}
 
-// not support extent right now
-uint32_t InodeManager::get_data_pblock(const ext4_inode &inode,
-                                       uint32_t lblock) {
-  // uint32_t data_block_count = get_file_blocks_count(inode);
-  // assert(lblock < data_block_count);
-
-  if (lblock < EXT4_NDIR_BLOCKS) { // direct data block
-    return inode.i_block[lblock];
-  } else if (lblock < MAX_IND_BLOCK) {
-    uint32_t index_block = inode.i_block[EXT4_IND_BLOCK];
-    return get_data_pblock_ind(lblock - EXT4_NDIR_BLOCKS, index_block);
-  } else if (lblock < MAX_DIND_BLOCK) {
-    uint32_t dindex_block = inode.i_block[EXT4_DIND_BLOCK];
-    return get_data_pblock_dind(lblock - MAX_IND_BLOCK, dindex_block);
-  } else if (lblock < MAX_TIND_BLOCK) {
-    uint32_t tindex_block = inode.i_block[EXT4_TIND_BLOCK];
-    return get_data_pblock_tind(lblock - MAX_DIND_BLOCK, tindex_block);
-  } else {
-    LOG(FATAL) << "lblock exceed max data block size";
-    return 0;
+// find the tree holding lblock (depth 0 for a direct block) and the index of
+// lblock within it, return false if lblock is beyond the map
+static bool map_locate(const BlockMapLayout &layout, uint64_t lblock,
+                       uint32_t &depth, uint64_t &n) {
+  if (lblock < layout.ndir) {
+    depth = 0;
+    n = lblock;
+    return true;
   }
-}
 
-// return new lblock
-void InodeManager::set_data_pblock(ext4_inode &inode, uint32_t lblock,
-                                   uint32_t pblock) {
-  if (lblock < EXT4_NDIR_BLOCKS) { // direct data block
-    inode.i_block[lblock] = pblock;
-  } else if (lblock < MAX_IND_BLOCK) {
-    uint32_t index_pblock = inode.i_block[EXT4_IND_BLOCK];
-    if (index_pblock == 0) {
-      index_pblock = GET_INSTANCE(MetaDataManager).alloc_new_ssd_pblock();
-      inode.i_block[EXT4_IND_BLOCK] = index_pblock;
-    }
+  n = lblock - layout.ndir;
+  uint64_t span = 1;
+  for (depth = 1; depth <= layout.levels; depth++) {
+    span *= layout.per_block;
+    if (n < span)
+      return true;
+    n -= span;
+  }
+  return false;
+}
 
-    set_data_lblock_ind(lblock - EXT4_NDIR_BLOCKS, index_pblock, pblock);
-  } else if (lblock < MAX_DIND_BLOCK) {
-    uint32_t dindex_pblock = inode.i_block[EXT4_DIND_BLOCK];
-    if (dindex_pblock == 0) {
-      dindex_pblock = GET_INSTANCE(MetaDataManager).alloc_new_ssd_pblock();
-      inode.i_block[EXT4_DIND_BLOCK] = dindex_pblock;
-    }
+// number of lblocks covered by a tree of the given depth
+static uint64_t tree_span(const BlockMapLayout &layout, uint32_t depth) {
+  uint64_t span = 1;
+  for (uint32_t i = 0; i < depth; i++)
+    span *= layout.per_block;
+  return span;
+}
 
-    set_data_lblock_dind(lblock - MAX_IND_BLOCK, dindex_pblock, pblock);
-  } else if (lblock < MAX_TIND_BLOCK) {
-    uint32_t tindex_pblock = inode.i_block[EXT4_TIND_BLOCK];
-    if (tindex_pblock == 0) {
-      tindex_pblock = GET_INSTANCE(MetaDataManager).alloc_new_ssd_pblock();
-      inode.i_block[EXT4_TIND_BLOCK] = tindex_pblock;
-    }
+pblock_t InodeManager::map_slot(const ext4_inode &inode, uint32_t slot) {
+  if ((inode.i_flags & HYBRID_WIDE_MAP_FL) != 0) {
+    pblock_t pblock;
+    memcpy(&pblock, (const std::byte *)inode.i_block + slot * sizeof(pblock_t),
+           sizeof(pblock_t));
+    return pblock;
+  }
+  return pblock_from32(inode.i_block[slot]);
+}
 
-    set_data_lblock_tind(lblock - MAX_DIND_BLOCK, tindex_pblock, pblock);
+void InodeManager::set_map_slot(ext4_inode &inode, uint32_t slot,
+                                pblock_t pblock) {
+  if ((inode.i_flags & HYBRID_WIDE_MAP_FL) != 0) {
+    memcpy((std::byte *)inode.i_block + slot * sizeof(pblock_t), &pblock,
+           sizeof(pblock_t));
   } else {
-    LOG(FATAL) << "lblock exceed max data block size";
+    inode.i_block[slot] = pblock_to32(pblock);
   }
-
-  // Update inode
-  uint64_t file_block_count = get_file_blocks_count(inode);
-  if (lblock + 1 > file_block_count)
-    set_file_blocks_count(inode, lblock + 1);
 }
 
-uint32_t InodeManager::get_data_pblock_ind(uint32_t lblock,
-                                           uint32_t index_pblock) {
-  assert(lblock < IND_BLOCK_SIZE);
-
-  if (index_pblock == 0)
-    return 0;
+pblock_t InodeManager::read_index_entry(pblock_t index_pblock, uint64_t idx,
+                                        bool wide) {
+  if (wide) {
+    pblock_t pblock;
+    GET_INSTANCE(DiskManager)
+        .metadata_read(&pblock, sizeof(pblock_t), index_pblock,
+                       idx * sizeof(pblock_t));
+    return pblock;
+  }
 
-  uint32_t res;
+  uint32_t pblock32;
   GET_INSTANCE(DiskManager)
-      .disk_read(&res, sizeof(uint32_t), index_pblock,
-                 lblock * sizeof(uint32_t));
-  return res;
+      .metadata_read(&pblock32, sizeof(uint32_t), index_pblock,
+                     idx * sizeof(uint32_t));
+  return pblock_from32(pblock32);
 }
 
-void InodeManager::set_data_lblock_ind(uint32_t lblock, uint32_t index_pblock,
-                                       uint32_t pblock) {
-  assert(lblock < IND_BLOCK_SIZE);
+void InodeManager::write_index_entry(pblock_t index_pblock, uint64_t idx,
+                                     pblock_t pblock, bool wide) {
+  if (wide) {
+    GET_INSTANCE(DiskManager)
+        .metadata_write(&pblock, sizeof(pblock_t), index_pblock,
+                        idx * sizeof(pblock_t));
+    return;
+  }
 
+  uint32_t pblock32 = pblock_to32(pblock);
   GET_INSTANCE(DiskManager)
-      .disk_write(&pblock, sizeof(uint32_t), index_pblock,
-                  lblock * sizeof(uint32_t));
+      .metadata_write(&pblock32, sizeof(uint32_t), index_pblock,
+                      idx * sizeof(uint32_t));
 }
 
-uint32_t InodeManager::get_data_pblock_dind(uint32_t lblock,
-                                            uint32_t dindex_pblock) {
-  assert(lblock < DIND_BLOCK_SIZE);
+void InodeManager::read_index(pblock_t index_pblock, bool wide,
+                              std::vector<pblock_t> &table) {
+  if (wide) {
+    table.resize(block_size_ / sizeof(pblock_t));
+    GET_INSTANCE(DiskManager).metadata_block_read(table.data(), index_pblock);
+    return;
+  }
 
-  if (dindex_pblock == 0)
-    return 0;
+  std::vector<uint32_t> table32(block_size_ / sizeof(uint32_t));
+  GET_INSTANCE(DiskManager).metadata_block_read(table32.data(), index_pblock);
+  table.resize(table32.size());
+  for (size_t i = 0; i < table32.size(); i++)
+    table[i] = pblock_from32(table32[i]);
+}
 
-  uint32_t index_pblock;
-  uint32_t index_block_in_dind_offset =
-      (lblock / MAX_IND_BLOCK) * sizeof(uint32_t);
-  GET_INSTANCE(DiskManager)
-      .disk_read(&index_pblock, sizeof(uint32_t), dindex_pblock,
-                 index_block_in_dind_offset);
+void InodeManager::write_index(pblock_t index_pblock, bool wide,
+                               const std::vector<pblock_t> &table) {
+  if (wide) {
+    GET_INSTANCE(DiskManager).metadata_block_write(table.data(), index_pblock);
+    return;
+  }
 
-  lblock %= MAX_IND_BLOCK; // calculate index in index block
-  return get_data_pblock_ind(lblock, index_pblock);
+  std::vector<uint32_t> table32(table.size());
+  for (size_t i = 0; i < table.size(); i++)
+    table32[i] = pblock_to32(table[i]);
+  GET_INSTANCE(DiskManager).metadata_block_write(table32.data(), index_pblock);
 }
 
-void InodeManager::set_data_lblock_dind(uint32_t lblock, uint32_t dindex_pblock,
-                                        uint32_t pblock) {
-  assert(lblock < DIND_BLOCK_SIZE);
+// not support extent right now
+pblock_t InodeManager::get_data_pblock(const ext4_inode &inode,
+                                       uint32_t lblock) {
+  BlockMapLayout layout = map_layout(inode);
+  uint32_t depth;
+  uint64_t n;
+  if (!map_locate(layout, lblock, depth, n)) {
+    LOG(FATAL) << "lblock exceed max data block size";
+    return 0;
+  }
+  if (depth == 0) // direct data block
+    return map_slot(inode, lblock);
+
+  pblock_t pblock = map_slot(inode, layout.ndir + depth - 1);
+  for (uint32_t level = depth; level >= 1 && pblock != 0; level--) {
+    uint64_t span = tree_span(layout, level - 1);
+    pblock = read_index_entry(pblock, n / span, layout.wide);
+    n %= span;
+  }
+  return pblock;
+}
 
-  uint32_t index_pblock;
-  uint32_t index_block_in_dind_offset =
-      (lblock / MAX_IND_BLOCK) * sizeof(uint32_t);
-  GET_INSTANCE(DiskManager)
-      .disk_read(&index_pblock, sizeof(uint32_t), dindex_pblock,
-                 index_block_in_dind_offset);
+// look up [lblock, lblock + count), reading each index block only once
+void InodeManager::get_data_pblocks(const ext4_inode &inode, uint32_t lblock,
+                                    uint32_t count,
+                                    std::vector<pblock_t> &pblock_vec) {
+  BlockMapLayout layout = map_layout(inode);
+  IndexCache cache;
+  for (uint64_t i = lblock; i < (uint64_t)lblock + count; i++) {
+    uint32_t depth;
+    uint64_t n;
+    if (!map_locate(layout, i, depth, n)) {
+      LOG(FATAL) << "lblock exceed max data block size";
+    }
 
-  // determine if need to create need index block
-  if (index_pblock == 0) {
-    index_pblock = GET_INSTANCE(MetaDataManager).alloc_new_ssd_pblock();
-    GET_INSTANCE(DiskManager)
-        .disk_write(&index_pblock, sizeof(uint32_t), dindex_pblock,
-                    index_block_in_dind_offset);
+    pblock_t pblock;
+    if (depth == 0) {
+      pblock = map_slot(inode, i);
+    } else {
+      pblock = map_slot(inode, layout.ndir + depth - 1);
+      for (uint32_t level = depth; level >= 1 && pblock != 0; level--) {
+        uint64_t span = tree_span(layout, level - 1);
+        pblock = get_index_entry(cache, pblock, n / span, layout.wide);
+        n %= span;
+      }
+    }
+    pblock_vec.push_back(pblock);
   }
-
-  lblock %= MAX_IND_BLOCK; // calculate index in index block
-  set_data_lblock_ind(lblock, index_pblock, pblock);
 }
 
-uint32_t InodeManager::get_data_pblock_tind(uint32_t lblock,
-                                            uint32_t tindex_pblock) {
-  assert(lblock < TIND_BLOCK_SIZE);
-
-  if (tindex_pblock == 0)
+pblock_t InodeManager::get_index_entry(IndexCache &cache,
+                                       pblock_t index_pblock, uint64_t idx,
+                                       bool wide) {
+  if (index_pblock == 0)
     return 0;
 
-  uint32_t dindex_pblock;
-  uint32_t dindex_block_in_tind_offset =
-      (lblock / MAX_DIND_BLOCK) * sizeof(uint32_t);
+  auto it = cache.find(index_pblock);
+  if (it == cache.end()) {
+    it = cache.emplace(index_pblock, std::vector<pblock_t>()).first;
+    read_index(index_pblock, wide, it->second);
+  }
+  assert(idx < it->second.size());
+  return it->second[idx];
+}
 
-  // Get dindex block from tind block
-  GET_INSTANCE(DiskManager)
-      .disk_read(&dindex_pblock, sizeof(uint32_t), tindex_pblock,
-                 dindex_block_in_tind_offset);
+// allocate the unmapped blocks in [lblock, lblock + count), consecutive
+// unmapped lblocks get physical blocks as contiguous as possible
+void InodeManager::alloc_data_pblocks(ext4_inode &inode, uint32_t lblock,
+                                      uint32_t count, Tier tier) {
+  if (tier == Tier::AUTO)
+    tier = tier_hint(inode);
+
+  std::vector<pblock_t> pblock_vec;
+  get_data_pblocks(inode, lblock, count, pblock_vec);
+
+  uint32_t i = 0;
+  while (i < count) {
+    if (pblock_vec[i] != 0) {
+      i++;
+      continue;
+    }
 
-  lblock %= MAX_DIND_BLOCK;
-  return get_data_pblock_dind(lblock, dindex_pblock);
+    uint32_t j = i + 1;
+    while (j < count && pblock_vec[j] == 0)
+      j++;
+
+    // continue right after the block before the run
+    pblock_t prev = 0;
+    if (i > 0)
+      prev = pblock_vec[i - 1];
+    else if (lblock > 0)
+      prev = get_data_pblock(inode, lblock - 1);
+
+    std::vector<pblock_t> new_pblock_vec;
+    GET_INSTANCE(MetaDataManager)
+        .alloc_new_pblocks(lblock + i, j - i, new_pblock_vec, tier,
+                           prev != 0 ? prev + 1 : 0);
+    assert(new_pblock_vec.size() == j - i);
+    for (uint32_t k = i; k < j; k++) {
+      set_data_pblock(inode, lblock + k, new_pblock_vec[k - i]);
+    }
+    i = j;
+  }
 }
 
-void InodeManager::set_data_lblock_tind(uint32_t lblock, uint32_t tindex_pblock,
-                                        uint32_t pblock) {
-  assert(lblock < TIND_BLOCK_SIZE);
+Tier InodeManager::tier_hint(const ext4_inode &inode) {
+  if ((inode.i_flags & HYBRID_TIER_SSD_FL) != 0)
+    return Tier::SSD;
+  if ((inode.i_flags & HYBRID_TIER_HDD_FL) != 0)
+    return Tier::HDD;
+  return Tier::AUTO;
+}
 
-  uint32_t dindex_pblock;
-  uint32_t dindex_block_in_tind_offset =
-      (lblock / MAX_DIND_BLOCK) * sizeof(uint32_t);
-  GET_INSTANCE(DiskManager)
-      .disk_read(&dindex_pblock, sizeof(uint32_t), tindex_pblock,
-                 dindex_block_in_tind_offset);
+void InodeManager::set_tier_hint(ext4_inode &inode, Tier tier) {
+  inode.i_flags &= ~HYBRID_TIER_FL;
+  if (tier == Tier::SSD)
+    inode.i_flags |= HYBRID_TIER_SSD_FL;
+  else if (tier == Tier::HDD)
+    inode.i_flags |= HYBRID_TIER_HDD_FL;
+}
 
-  // determine if need to create need index block
-  if (dindex_pblock == 0) {
-    dindex_pblock = GET_INSTANCE(MetaDataManager).alloc_new_ssd_pblock();
-    GET_INSTANCE(DiskManager)
-        .disk_write(&dindex_pblock, sizeof(uint32_t), tindex_pblock,
-                    dindex_block_in_tind_offset);
-  }
+// a wide map addresses at least as many blocks as a narrow one
+uint64_t InodeManager::max_file_size() {
+  BlockMapLayout layout = {false, EXT4_NDIR_BLOCKS, 3,
+                           block_size_ / sizeof(uint32_t)};
+  uint64_t blocks = layout.ndir;
+  for (uint32_t depth = 1; depth <= layout.levels; depth++)
+    blocks += tree_span(layout, depth);
+  return std::min(blocks, (uint64_t)UINT32_MAX) * block_size_;
+}
 
-  lblock %= MAX_DIND_BLOCK;
-  set_data_lblock_dind(lblock, dindex_pblock, pblock);
+// rewrite a narrow block map with wide entries, the data blocks stay where
+// they are
+void InodeManager::widen_map(ext4_inode &inode) {
+  assert((inode.i_flags & HYBRID_WIDE_MAP_FL) == 0);
+  uint32_t count = get_file_blocks_count(inode);
+
+  std::vector<pblock_t> data_vec, all_vec, index_vec;
+  get_data_pblocks(inode, 0, count, data_vec);
+  collect_file_pblock(inode, all_vec);
+
+  std::vector<pblock_t> sorted_data(data_vec);
+  std::sort(sorted_data.begin(), sorted_data.end());
+  std::sort(all_vec.begin(), all_vec.end());
+  std::set_difference(all_vec.begin(), all_vec.end(), sorted_data.begin(),
+                      sorted_data.end(), std::back_inserter(index_vec));
+
+  memset(inode.i_block, 0, sizeof(inode.i_block));
+  inode.i_flags |= HYBRID_WIDE_MAP_FL;
+  for (uint32_t i = 0; i < count; i++) {
+    if (data_vec[i] != 0)
+      set_data_pblock(inode, i, data_vec[i]);
+  }
+  GET_INSTANCE(MetaDataManager).free_pblock(index_vec);
+  LOG(INFO) << "Widen the block map of " << count << " blocks";
 }
 
-void InodeManager::collect_file_pblock(ext4_inode &inode, std::vector<uint32_t> &pblock_vec) {
-  for (uint32_t i = 0; i < EXT4_NDIR_BLOCKS; i++) {
-    if (inode.i_block[i] != 0) {
-      pblock_vec.push_back(inode.i_block[i]);
-    }
+// return new lblock
+void InodeManager::set_data_pblock(ext4_inode &inode, uint32_t lblock,
+                                   pblock_t pblock) {
+  // a narrow map can not address the block
+  if ((inode.i_flags & HYBRID_WIDE_MAP_FL) == 0 && !pblock_fits32(pblock))
+    widen_map(inode);
+
+  BlockMapLayout layout = map_layout(inode);
+  uint32_t depth;
+  uint64_t n;
+  if (!map_locate(layout, lblock, depth, n)) {
+    LOG(FATAL) << "lblock exceed max data block size";
   }
 
-  if (inode.i_block[EXT4_IND_BLOCK] != 0) {
-    collect_file_pblock_ind(inode.i_block[EXT4_IND_BLOCK], pblock_vec);
+  if (depth == 0) { // direct data block
+    set_map_slot(inode, lblock, pblock);
+  } else {
+    uint32_t slot = layout.ndir + depth - 1;
+    pblock_t index_pblock = map_slot(inode, slot);
+    if (index_pblock == 0) {
+      index_pblock = GET_INSTANCE(MetaDataManager).alloc_new_ssd_pblock();
+      set_map_slot(inode, slot, index_pblock);
+    }
+
+    // determine if need to create the lower index blocks
+    for (uint32_t level = depth; level > 1; level--) {
+      uint64_t span = tree_span(layout, level - 1);
+      pblock_t next = read_index_entry(index_pblock, n / span, layout.wide);
+      if (next == 0) {
+        next = GET_INSTANCE(MetaDataManager).alloc_new_ssd_pblock();
+        write_index_entry(index_pblock, n / span, next, layout.wide);
+      }
+      index_pblock = next;
+      n %= span;
+    }
+    write_index_entry(index_pblock, n, pblock, layout.wide);
   }
 
-  if (inode.i_block[EXT4_DIND_BLOCK] != 0) {
-    collect_file_pblock_dind(inode.i_block[EXT4_DIND_BLOCK], pblock_vec);
+  // Update inode
+  uint64_t file_block_count = get_file_blocks_count(inode);
+  if (lblock + 1 > file_block_count)
+    set_file_blocks_count(inode, lblock + 1);
+}
+
+void InodeManager::collect_file_pblock(ext4_inode &inode,
+                                       std::vector<pblock_t> &pblock_vec) {
+  // inline or packed data does not occupy any block of its own
+  if (is_inline(inode) || is_frag(inode))
+    return;
+
+  BlockMapLayout layout = map_layout(inode);
+  for (uint32_t i = 0; i < layout.ndir; i++) {
+    pblock_t pblock = map_slot(inode, i);
+    if (pblock != 0)
+      pblock_vec.push_back(pblock);
   }
 
-  if (inode.i_block[EXT4_TIND_BLOCK] != 0) {
-    collect_file_pblock_tind(inode.i_block[EXT4_TIND_BLOCK], pblock_vec);
+  for (uint32_t depth = 1; depth <= layout.levels; depth++) {
+    pblock_t index_pblock = map_slot(inode, layout.ndir + depth - 1);
+    if (index_pblock != 0)
+      collect_index_pblock(index_pblock, depth, layout.wide, pblock_vec);
   }
 }
 
-void InodeManager::collect_file_pblock_ind(uint32_t index_block, std::vector<uint32_t> &pblock_vec) {
-  uint32_t entry_num = block_size_ / sizeof(uint32_t);
-  std::vector<uint32_t> index_table(entry_num, 0);
-  GET_INSTANCE(DiskManager).disk_block_read(index_table.data(), index_block);
-  
+void InodeManager::collect_index_pblock(pblock_t index_pblock, uint32_t depth,
+                                        bool wide,
+                                        std::vector<pblock_t> &pblock_vec) {
+  std::vector<pblock_t> index_table;
+  read_index(index_pblock, wide, index_table);
+
   // iter over index block
-  for (uint32_t i = 0; i < entry_num; i++) {
-    if (index_table[i] != 0) {
-      pblock_vec.push_back(index_table[i]);
+  for (auto pblock : index_table) {
+    if (pblock == 0)
+      continue;
+    if (depth > 1) {
+      collect_index_pblock(pblock, depth - 1, wide, pblock_vec);
+    } else {
+      pblock_vec.push_back(pblock);
     }
   }
 
-  pblock_vec.push_back(index_block);
+  pblock_vec.push_back(index_pblock);
 }
 
-void InodeManager::collect_file_pblock_dind(uint32_t dindex_block, std::vector<uint32_t> &pblock_vec) {
-  uint32_t entry_num = block_size_ / sizeof(uint32_t);
-  std::vector<uint32_t> dindex_table(entry_num, 0);
-  GET_INSTANCE(DiskManager).disk_block_read(dindex_table.data(), dindex_block);
-  
-  // iter over index block
-  for (uint32_t i = 0; i < entry_num; i++) {
-    if (dindex_table[i] != 0) {
-      collect_file_pblock_ind(dindex_table[i], pblock_vec);
+// clear the entries for [begin, end) under an index block of the given depth
+// (1 for an indirect block), return true if the index block is empty after
+bool InodeManager::clear_index_range(pblock_t index_pblock, uint32_t depth,
+                                     bool wide, uint64_t begin, uint64_t end,
+                                     std::vector<pblock_t> &pblock_vec) {
+  std::vector<pblock_t> index_table;
+  read_index(index_pblock, wide, index_table);
+  uint64_t span = 1;
+  for (uint32_t i = 1; i < depth; i++)
+    span *= index_table.size();
+
+  bool dirty = false;
+  for (uint64_t i = begin / span; i < index_table.size() && i * span < end;
+       i++) {
+    if (index_table[i] == 0)
+      continue;
+
+    if (depth > 1) {
+      uint64_t sub_begin = std::max(begin, i * span) - i * span;
+      uint64_t sub_end = std::min(end, (i + 1) * span) - i * span;
+      if (!clear_index_range(index_table[i], depth - 1, wide, sub_begin,
+                             sub_end, pblock_vec))
+        continue;
     }
+
+    pblock_vec.push_back(index_table[i]);
+    index_table[i] = 0;
+    dirty = true;
   }
 
-  pblock_vec.push_back(dindex_block);
+  bool empty = std::all_of(index_table.begin(), index_table.end(),
+                           [](pblock_t pblock) { return pblock == 0; });
+  if (dirty && !empty)
+    write_index(index_pblock, wide, index_table);
+  return empty;
 }
 
-void InodeManager::collect_file_pblock_tind(uint32_t tindex_block, std::vector<uint32_t> &pblock_vec) {
-  uint32_t entry_num = block_size_ / sizeof(uint32_t);
-  std::vector<uint32_t> tindex_table(entry_num, 0);
-  GET_INSTANCE(DiskManager).disk_block_read(tindex_table.data(), tindex_block);
-  
-  // iter over index block
-  for (uint32_t i = 0; i < entry_num; i++) {
-    if (tindex_table[i] != 0) {
-      collect_file_pblock_dind(tindex_table[i], pblock_vec);
+void InodeManager::free_data_range(ext4_inode &inode, uint32_t lblock,
+                                   uint64_t count) {
+  BlockMapLayout layout = map_layout(inode);
+  uint64_t begin = lblock;
+  uint64_t end = begin + count;
+  std::vector<pblock_t> pblock_vec;
+
+  for (uint64_t i = begin; i < std::min(end, (uint64_t)layout.ndir); i++) {
+    pblock_t pblock = map_slot(inode, i);
+    if (pblock != 0) {
+      pblock_vec.push_back(pblock);
+      set_map_slot(inode, i, 0);
     }
   }
 
-  pblock_vec.push_back(tindex_block);
-}
\ No newline at end of file
+  // the part of [begin, end) under each index tree
+  uint64_t first = layout.ndir;
+  for (uint32_t depth = 1; depth <= layout.levels; depth++) {
+    uint32_t slot = layout.ndir + depth - 1;
+    uint64_t last = first + tree_span(layout, depth);
+    pblock_t root = map_slot(inode, slot);
+    if (root != 0 && end > first && begin < last) {
+      uint64_t sub_begin = std::max(begin, first) - first;
+      uint64_t sub_end = std::min(end, last) - first;
+      if (clear_index_range(root, depth, layout.wide, sub_begin, sub_end,
+                            pblock_vec)) {
+        pblock_vec.push_back(root);
+        set_map_slot(inode, slot, 0);
+      }
+    }
+    first = last;
+  }
+
+  GET_INSTANCE(MetaDataManager).free_pblock(pblock_vec);
+}
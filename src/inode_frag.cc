@@ -0,0 +1,150 @@
+#include "MetaData.h"
+#include "common.h"
+#include "disk.h"
+#include "fragment.h"
+#include "inode.h"
+#include "types/ext4_inode.h"
+#include "types/hybrid_fs.h"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <glog/logging.h>
+#include <vector>
+
+// Small files which outgrow the inline area are packed into fragments of a
+// shared SSD block, until they grow beyond max_frag_bytes()
+
+bool InodeManager::is_frag(const ext4_inode &inode) {
+  return (inode.i_flags & HYBRID_FRAG_FL) != 0;
+}
+
+void InodeManager::get_frag(const ext4_inode &inode, pblock_t &pblock,
+                            uint32_t &start, uint32_t &count) {
+  assert(is_frag(inode));
+  pblock = pblock_from32(inode.i_obso_faddr);
+  start = inode.osd2.linux2.l_i_reserved2 & 0xff;
+  count = (inode.osd2.linux2.l_i_reserved2 >> 8) & 0xff;
+}
+
+void InodeManager::set_frag(ext4_inode &inode, pblock_t pblock, uint32_t start,
+                            uint32_t count) {
+  if (pblock == 0) {
+    inode.i_flags &= ~HYBRID_FRAG_FL;
+  } else {
+    inode.i_flags |= HYBRID_FRAG_FL;
+  }
+  inode.i_obso_faddr = pblock_to32(pblock);
+  inode.osd2.linux2.l_i_reserved2 = start | (count << 8);
+}
+
+size_t InodeManager::read_frag(const ext4_inode &inode, char *buf, size_t size,
+                               off_t offset) {
+  uint64_t file_size = get_file_size(inode);
+  if ((uint64_t)offset >= file_size)
+    return 0;
+
+  pblock_t pblock;
+  uint32_t start, count;
+  get_frag(inode, pblock, start, count);
+  uint32_t frag_size = GET_INSTANCE(FragmentManager).frag_size();
+
+  size = std::min((uint64_t)size, file_size - offset);
+  GET_INSTANCE(DiskManager)
+      .disk_read(buf, size, pblock, start * frag_size + offset);
+  return size;
+}
+
+// return false if the file grows beyond max_frag_bytes()
+bool InodeManager::write_frag(ext4_inode &inode, const char *buf, size_t size,
+                              off_t offset) {
+  uint64_t new_size = std::max(get_file_size(inode), (uint64_t)offset + size);
+  if (new_size > GET_INSTANCE(FragmentManager).max_frag_bytes())
+    return false;
+
+  pblock_t pblock;
+  uint32_t start, count;
+  get_frag(inode, pblock, start, count);
+  uint32_t frag_size = GET_INSTANCE(FragmentManager).frag_size();
+
+  // repack into a larger fragment run
+  if (new_size > count * frag_size) {
+    pblock_t new_pblock;
+    uint32_t new_start;
+    uint32_t new_count = GET_INSTANCE(FragmentManager).bytes_to_frags(new_size);
+    GET_INSTANCE(FragmentManager).alloc(new_count, new_pblock, new_start);
+
+    std::vector<char> old_data(get_file_size(inode));
+    read_frag(inode, old_data.data(), old_data.size(), 0);
+    GET_INSTANCE(DiskManager)
+        .disk_write(old_data.data(), old_data.size(), new_pblock,
+                    new_start * frag_size);
+    GET_INSTANCE(FragmentManager).free(pblock, start, count);
+
+    pblock = new_pblock;
+    start = new_start;
+    count = new_count;
+    set_frag(inode, pblock, start, count);
+  }
+
+  GET_INSTANCE(DiskManager)
+      .disk_write(buf, size, pblock, start * frag_size + offset);
+  set_file_size(inode, new_size);
+  return true;
+}
+
+// move the inline content into fragments, return false if new_size is too
+// large to be packed
+bool InodeManager::pack_inline(ext4_inode &inode, uint64_t new_size) {
+  assert(is_inline(inode));
+  // packed blocks live on the ssd
+  if (new_size > GET_INSTANCE(FragmentManager).max_frag_bytes() ||
+      tier_hint(inode) == Tier::HDD ||
+      GET_INSTANCE(MetaDataManager).ssd_data_quota(Tier::AUTO) == 0)
+    return false;
+
+  pblock_t pblock;
+  uint32_t start;
+  uint32_t count = GET_INSTANCE(FragmentManager).bytes_to_frags(new_size);
+  GET_INSTANCE(FragmentManager).alloc(count, pblock, start);
+
+  uint64_t file_size = get_file_size(inode);
+  uint32_t frag_size = GET_INSTANCE(FragmentManager).frag_size();
+  if (file_size > 0) {
+    GET_INSTANCE(DiskManager)
+        .disk_write(inode.i_block, file_size, pblock, start * frag_size);
+  }
+
+  memset(inode.i_block, 0, sizeof(inode.i_block));
+  inode.i_flags &= ~EXT4_INLINE_DATA_FL;
+  set_frag(inode, pblock, start, count);
+  LOG(INFO) << "Pack inline data to block #" << pblock << " fragments ["
+            << start << ", " << start + count << ")";
+  return true;
+}
+
+// move the packed content to a data block of its own
+void InodeManager::spill_frag(ext4_inode &inode) {
+  pblock_t pblock;
+  uint32_t start, count;
+  get_frag(inode, pblock, start, count);
+
+  std::vector<std::byte> buf(block_size_, std::byte(0));
+  read_frag(inode, (char *)buf.data(), block_size_, 0);
+
+  free_frag(inode);
+
+  alloc_data_pblocks(inode, 0, 1);
+  pblock_t data_pblock = get_data_pblock(inode, 0);
+  GET_INSTANCE(DiskManager).disk_block_write(buf.data(), data_pblock);
+  LOG(INFO) << "Spill packed data to block #" << data_pblock;
+}
+
+void InodeManager::free_frag(ext4_inode &inode) {
+  pblock_t pblock;
+  uint32_t start, count;
+  get_frag(inode, pblock, start, count);
+  GET_INSTANCE(FragmentManager).free(pblock, start, count);
+  set_frag(inode, 0, 0, 0);
+}
@@ -0,0 +1,92 @@
+#include "MetaData.h"
+#include "common.h"
+#include "disk.h"
+#include "inode.h"
+#include "types/ext4_dentry.h"
+#include "types/ext4_inode.h"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <glog/logging.h>
+#include <vector>
+
+// Tiny files and directories keep their content in i_block (ext4 inline
+// data) until they grow beyond EXT4_MIN_INLINE_DATA_SIZE bytes
+
+bool InodeManager::is_inline(const ext4_inode &inode) {
+  return (inode.i_flags & EXT4_INLINE_DATA_FL) != 0;
+}
+
+size_t InodeManager::read_inline(const ext4_inode &inode, char *buf,
+                                 size_t size, off_t offset) {
+  assert(is_inline(inode));
+
+  uint64_t file_size = get_file_size(inode);
+  if ((uint64_t)offset >= file_size)
+    return 0;
+
+  size = std::min((uint64_t)size, file_size - offset);
+  memcpy(buf, (const std::byte *)inode.i_block + offset, size);
+  return size;
+}
+
+// return false if the data does not fit in the inode
+bool InodeManager::write_inline(ext4_inode &inode, const char *buf,
+                                size_t size, off_t offset) {
+  assert(is_inline(inode));
+
+  if ((uint64_t)offset + size > EXT4_MIN_INLINE_DATA_SIZE)
+    return false;
+
+  memcpy((std::byte *)inode.i_block + offset, buf, size);
+  if ((uint64_t)offset + size > get_file_size(inode)) {
+    set_file_size(inode, offset + size);
+  }
+  return true;
+}
+
+// move the inline content to a data block
+void InodeManager::spill_inline(ext4_inode &inode) {
+  assert(is_inline(inode));
+
+  uint64_t file_size = get_file_size(inode);
+  std::vector<std::byte> buf(block_size_, std::byte(0));
+  memcpy(buf.data(), inode.i_block, EXT4_MIN_INLINE_DATA_SIZE);
+
+  memset(inode.i_block, 0, sizeof(inode.i_block));
+  inode.i_flags &= ~EXT4_INLINE_DATA_FL;
+
+  if (S_ISDIR(inode.i_mode)) {
+    // the last entry covers the rest of the block
+    ext4_dir_entry_2 *dentry = nullptr;
+    off_t offset = 0;
+    while (offset < (off_t)file_size) {
+      dentry = (ext4_dir_entry_2 *)&buf[offset];
+      offset += dentry->rec_len;
+    }
+    if (dentry != nullptr) {
+      dentry->rec_len += block_size_ - file_size;
+    }
+    file_size = block_size_;
+    set_file_size(inode, file_size);
+  }
+
+  // empty file does not need any block
+  if (file_size == 0)
+    return;
+
+  // directory blocks stay on the ssd, file data follows the tier hint
+  pblock_t pblock;
+  if (S_ISDIR(inode.i_mode)) {
+    pblock = GET_INSTANCE(MetaDataManager).alloc_new_pblock(0);
+    set_data_pblock(inode, 0, pblock);
+    GET_INSTANCE(DiskManager).metadata_block_write(buf.data(), pblock);
+  } else {
+    alloc_data_pblocks(inode, 0, 1);
+    pblock = get_data_pblock(inode, 0);
+    GET_INSTANCE(DiskManager).disk_block_write(buf.data(), pblock);
+  }
+  LOG(INFO) << "Spill inline data to block #" << pblock;
+}
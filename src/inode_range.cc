@@ -0,0 +1,237 @@
+#include "MetaData.h"
+#include "common.h"
+#include "disk.h"
+#include "fragment.h"
+#include "inode.h"
+#include "types/ext4_inode.h"
+#include "writeback.h"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <glog/logging.h>
+#include <sys/types.h>
+#include <vector>
+
+// Truncate, preallocation and hole punching. Free blocks are always zeroed,
+// so preallocated blocks read as zeros without being written, and punched
+// blocks become sparse holes.
+
+// block map lookups of seek_data are done this many blocks at a time
+#define SEEK_CHUNK_BLOCKS 1024
+
+// zero [offset, offset + len) of an inline or packed file
+void InodeManager::zero_small(ext4_inode &inode, uint64_t offset,
+                              uint64_t len) {
+  if (is_inline(inode)) {
+    if (offset >= EXT4_MIN_INLINE_DATA_SIZE)
+      return;
+    len = std::min(len, EXT4_MIN_INLINE_DATA_SIZE - offset);
+    memset((std::byte *)inode.i_block + offset, 0, len);
+    return;
+  }
+
+  assert(is_frag(inode));
+  pblock_t pblock;
+  uint32_t start, count;
+  get_frag(inode, pblock, start, count);
+  uint32_t frag_size = GET_INSTANCE(FragmentManager).frag_size();
+  if (offset >= (uint64_t)count * frag_size)
+    return;
+
+  len = std::min(len, count * frag_size - offset);
+  std::vector<std::byte> zero(len, std::byte(0));
+  GET_INSTANCE(DiskManager)
+      .disk_write(zero.data(), len, pblock, start * frag_size + offset);
+}
+
+// zero [offset, offset + len) within one block
+void InodeManager::zero_partial_block(const ext4_inode &inode, uint64_t offset,
+                                      uint32_t len) {
+  assert(offset % block_size_ + len <= block_size_);
+  pblock_t pblock = get_data_pblock(inode, offset / block_size_);
+  if (pblock == 0)
+    return;
+
+  std::vector<std::byte> zero(len, std::byte(0));
+  GET_INSTANCE(DiskManager)
+      .disk_write(zero.data(), len, pblock, offset % block_size_);
+}
+
+void InodeManager::truncate(uint32_t inode_idx, ext4_inode &inode,
+                            uint64_t new_size) {
+  uint64_t old_size = get_file_size(inode);
+
+  if (is_inline(inode)) {
+    if (new_size <= EXT4_MIN_INLINE_DATA_SIZE) {
+      if (new_size < old_size)
+        zero_small(inode, new_size, old_size - new_size);
+      set_file_size(inode, new_size);
+      return;
+    }
+
+    if (!pack_inline(inode, new_size))
+      spill_inline(inode);
+  }
+
+  if (is_frag(inode)) {
+    if (new_size <= GET_INSTANCE(FragmentManager).max_frag_bytes()) {
+      if (new_size < old_size) {
+        zero_small(inode, new_size, old_size - new_size);
+        set_file_size(inode, new_size);
+      } else if (new_size > old_size) {
+        // repack into a larger fragment run if needed
+        std::vector<char> zero(new_size - old_size, 0);
+        write_frag(inode, zero.data(), zero.size(), old_size);
+      }
+      return;
+    }
+
+    spill_frag(inode);
+  }
+
+  if (new_size < old_size) {
+    GET_INSTANCE(WriteBackManager)
+        .punch(inode_idx, new_size, old_size - new_size);
+
+    // the tail of the last block must read as zeros if the file grows again
+    if (new_size % block_size_ != 0) {
+      zero_partial_block(inode, new_size,
+                         block_size_ - new_size % block_size_);
+    }
+
+    // blocks preallocated beyond the old size are dropped as well
+    uint64_t new_blocks = (new_size + block_size_ - 1) / block_size_;
+    uint64_t old_blocks =
+        std::max((uint64_t)get_file_blocks_count(inode),
+                 (old_size + block_size_ - 1) / block_size_);
+    if (old_blocks > new_blocks)
+      free_data_range(inode, new_blocks, old_blocks - new_blocks);
+    if (get_file_blocks_count(inode) > new_blocks)
+      set_file_blocks_count(inode, new_blocks);
+  }
+
+  set_file_size(inode, new_size);
+}
+
+bool InodeManager::truncate_tail(uint32_t inode_idx, ext4_inode &inode,
+                                 uint64_t new_size, uint32_t max_blocks) {
+  if (is_inline(inode) || is_frag(inode))
+    return false;
+
+  uint64_t old_size = get_file_size(inode);
+  uint64_t new_blocks = (new_size + block_size_ - 1) / block_size_;
+  uint64_t old_blocks = std::max((uint64_t)get_file_blocks_count(inode),
+                                 (old_size + block_size_ - 1) / block_size_);
+  if (old_blocks <= new_blocks + max_blocks)
+    return false;
+
+  // the file ends where the freed blocks begin, block aligned
+  uint64_t first = old_blocks - max_blocks;
+  if (old_size > first * block_size_) {
+    GET_INSTANCE(WriteBackManager)
+        .punch(inode_idx, first * block_size_, old_size - first * block_size_);
+    set_file_size(inode, first * block_size_);
+  }
+  free_data_range(inode, first, max_blocks);
+  if (get_file_blocks_count(inode) > first)
+    set_file_blocks_count(inode, first);
+  return true;
+}
+
+void InodeManager::preallocate(ext4_inode &inode, uint64_t offset,
+                               uint64_t len, bool keep_size) {
+  uint64_t end = offset + len;
+  uint64_t file_size = get_file_size(inode);
+
+  if (is_inline(inode)) {
+    if (end <= EXT4_MIN_INLINE_DATA_SIZE) {
+      if (!keep_size && end > file_size)
+        set_file_size(inode, end);
+      return;
+    }
+
+    if (!pack_inline(inode, end))
+      spill_inline(inode);
+  }
+
+  if (is_frag(inode)) {
+    if (end <= GET_INSTANCE(FragmentManager).max_frag_bytes()) {
+      if (!keep_size && end > file_size) {
+        std::vector<char> zero(end - file_size, 0);
+        write_frag(inode, zero.data(), zero.size(), file_size);
+      }
+      return;
+    }
+
+    spill_frag(inode);
+  }
+
+  Tier tier = tier_hint(inode);
+  if (tier == Tier::AUTO)
+    tier = GET_INSTANCE(MetaDataManager).fallocate_tier();
+
+  uint32_t first_lblock = offset / block_size_;
+  uint32_t last_lblock = (end - 1) / block_size_;
+  alloc_data_pblocks(inode, first_lblock, last_lblock - first_lblock + 1, tier);
+
+  if (!keep_size && end > file_size)
+    set_file_size(inode, end);
+}
+
+void InodeManager::punch_hole(uint32_t inode_idx, ext4_inode &inode,
+                              uint64_t offset, uint64_t len) {
+  if (is_inline(inode) || is_frag(inode)) {
+    zero_small(inode, offset, len);
+    return;
+  }
+
+  GET_INSTANCE(WriteBackManager).punch(inode_idx, offset, len);
+
+  // whole blocks are freed, the partial ones at both ends are zeroed
+  uint64_t end = offset + len;
+  uint64_t first_full = (offset + block_size_ - 1) / block_size_;
+  uint64_t last_full = end / block_size_;
+  if (first_full > last_full) {
+    zero_partial_block(inode, offset, len);
+    return;
+  }
+
+  if (offset < first_full * block_size_)
+    zero_partial_block(inode, offset, first_full * block_size_ - offset);
+  if (last_full * block_size_ < end)
+    zero_partial_block(inode, last_full * block_size_,
+                       end - last_full * block_size_);
+  if (last_full > first_full)
+    free_data_range(inode, first_full, last_full - first_full);
+}
+
+off_t InodeManager::seek_data(uint32_t inode_idx, const ext4_inode &inode,
+                              uint64_t offset, bool data) {
+  uint64_t file_size = get_file_size(inode);
+  if (offset >= file_size)
+    return -ENXIO;
+
+  // inline and packed files have no hole
+  if (is_inline(inode) || is_frag(inode))
+    return data ? offset : file_size;
+
+  uint64_t lblock = offset / block_size_;
+  uint64_t end_lblock = (file_size + block_size_ - 1) / block_size_;
+  while (lblock < end_lblock) {
+    uint32_t count = std::min((uint64_t)SEEK_CHUNK_BLOCKS, end_lblock - lblock);
+    std::vector<pblock_t> pblock_vec;
+    get_data_pblocks(inode, lblock, count, pblock_vec);
+
+    for (uint32_t i = 0; i < count; i++) {
+      bool mapped = pblock_vec[i] != 0 ||
+                    GET_INSTANCE(WriteBackManager).is_dirty(inode_idx, lblock + i);
+      if (mapped == data)
+        return std::max(offset, (lblock + i) * block_size_);
+    }
+    lblock += count;
+  }
+
+  return data ? -ENXIO : file_size;
+}
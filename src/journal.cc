@@ -0,0 +1,576 @@
+#include "journal.h"
+#include "MetaData.h"
+#include "common.h"
+#include "disk.h"
+#include "fragment.h"
+#include "types/hybrid_fs.h"
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <glog/logging.h>
+#include <map>
+
+// commit the running transaction at least this often
+#define JOURNAL_COMMIT_INTERVAL std::chrono::seconds(5)
+
+// nesting depth of the handles held by this thread
+static thread_local int handle_depth = 0;
+
+static uint32_t journal_checksum(uint32_t checksum, const std::byte *buf,
+                                 size_t nbyte) {
+  // FNV-1a
+  for (size_t i = 0; i < nbyte; i++) {
+    checksum ^= (uint32_t)buf[i];
+    checksum *= 16777619;
+  }
+  return checksum;
+}
+
+JournalManager &JournalManager::get_instance() {
+  static JournalManager instance;
+  return instance;
+}
+
+JournalManager::JournalManager()
+    : enabled_(false), active_(false), block_size_(0), journal_pblock_(0),
+      journal_blocks_(0), start_(0), head_(0), first_seq_(1), next_seq_(1),
+      tag_bytes_(sizeof(pblock_t)), stop_(false) {}
+
+JournalManager::Handle::Handle() : locked_(false) {
+  auto &journal = GET_INSTANCE(JournalManager);
+  if (handle_depth++ == 0 && journal.active()) {
+    journal.txn_mutex_.lock_shared();
+    locked_ = true;
+  }
+}
+
+JournalManager::Handle::~Handle() {
+  handle_depth--;
+  if (locked_)
+    GET_INSTANCE(JournalManager).txn_mutex_.unlock_shared();
+}
+
+void JournalManager::set_enabled(bool enabled) { enabled_ = enabled; }
+
+bool JournalManager::enabled() { return enabled_; }
+
+bool JournalManager::active() { return active_; }
+
+uint32_t JournalManager::ring_size() { return journal_blocks_ - 1; }
+
+uint32_t JournalManager::used_blocks() {
+  return (head_ + ring_size() - start_) % ring_size();
+}
+
+uint32_t JournalManager::tags_per_block() {
+  return (block_size_ - sizeof(journal_header)) / tag_bytes_;
+}
+
+// revoke blocks, descriptor blocks, data blocks and the commit block
+uint32_t JournalManager::transaction_blocks(size_t block_count,
+                                            size_t revoke_count) {
+  uint32_t tags = tags_per_block();
+  return (revoke_count + tags - 1) / tags + (block_count + tags - 1) / tags +
+         block_count + 1;
+}
+
+void JournalManager::write_super() {
+  std::vector<std::byte> buf(block_size_);
+  journal_super_block *jsb = (journal_super_block *)buf.data();
+  jsb->js_magic = JOURNAL_MAGIC;
+  jsb->js_blocks = journal_blocks_;
+  jsb->js_start = start_;
+  jsb->js_seq = first_seq_;
+  jsb->js_tag_bytes = tag_bytes_;
+  GET_INSTANCE(DiskManager).disk_block_write(buf.data(), journal_pblock_);
+}
+
+void JournalManager::read_ring(std::byte *buf, uint32_t ring_idx,
+                               uint32_t count) {
+  while (count > 0) {
+    uint32_t n = std::min(count, ring_size() - ring_idx);
+    GET_INSTANCE(DiskManager)
+        .disk_read(buf, (size_t)n * block_size_, journal_pblock_ + 1 + ring_idx,
+                   0);
+    buf += (size_t)n * block_size_;
+    count -= n;
+    ring_idx = (ring_idx + n) % ring_size();
+  }
+}
+
+// a transaction is a single sequential write unless it wraps around
+void JournalManager::write_ring(const std::byte *buf, uint32_t ring_idx,
+                                uint32_t count) {
+  while (count > 0) {
+    uint32_t n = std::min(count, ring_size() - ring_idx);
+    GET_INSTANCE(DiskManager)
+        .disk_write(buf, (size_t)n * block_size_,
+                    journal_pblock_ + 1 + ring_idx, 0);
+    buf += (size_t)n * block_size_;
+    count -= n;
+    ring_idx = (ring_idx + n) % ring_size();
+  }
+}
+
+// read the journal super block and collect the latest committed image of
+// every block, return false if there is no journal
+bool JournalManager::scan(std::map<pblock_t, std::vector<std::byte>> &images,
+                          uint32_t &replayed) {
+  replayed = 0;
+  if (!enabled_)
+    return false;
+
+  block_size_ = GET_INSTANCE(MetaDataManager).block_size();
+  if (!GET_INSTANCE(MetaDataManager)
+           .journal_location(journal_pblock_, journal_blocks_))
+    return false;
+
+  std::vector<std::byte> buf(block_size_);
+  GET_INSTANCE(DiskManager).disk_block_read(buf.data(), journal_pblock_);
+  journal_super_block *jsb = (journal_super_block *)buf.data();
+  if (jsb->js_magic != JOURNAL_MAGIC || jsb->js_blocks != journal_blocks_) {
+    LOG(FATAL) << "Invalid journal super block at #" << journal_pblock_;
+  }
+  start_ = head_ = jsb->js_start;
+  first_seq_ = next_seq_ = jsb->js_seq;
+
+  // the latest committed image of every block, a revoke drops the images of
+  // the earlier transactions
+  // journals written before the addresses were widened have 32 bit tags
+  tag_bytes_ = jsb->js_tag_bytes != 0 ? jsb->js_tag_bytes : sizeof(uint32_t);
+  auto tag_at = [this](const journal_header *header, uint32_t k) -> pblock_t {
+    if (tag_bytes_ == sizeof(uint32_t))
+      return pblock_from32(((const uint32_t *)(header + 1))[k]);
+    return ((const pblock_t *)(header + 1))[k];
+  };
+
+  while (true) {
+    uint32_t pos = head_;
+    uint32_t count = 0;
+    uint32_t checksum = 0;
+    bool complete = false;
+    std::vector<pblock_t> revokes;
+    std::vector<std::pair<pblock_t, std::vector<std::byte>>> blocks;
+
+    while (count < ring_size()) {
+      read_ring(buf.data(), pos, 1);
+      journal_header *header = (journal_header *)buf.data();
+      if (header->jh_magic != JOURNAL_MAGIC || header->jh_seq != next_seq_)
+        break;
+
+      if (header->jh_type == JOURNAL_COMMIT_BLOCK) {
+        journal_commit *jc = (journal_commit *)buf.data();
+        complete = jc->jc_header.jh_count == count &&
+                   jc->jc_checksum == checksum;
+        pos = (pos + 1) % ring_size();
+        break;
+      }
+
+      checksum = journal_checksum(checksum, buf.data(), block_size_);
+      count++;
+      pos = (pos + 1) % ring_size();
+
+      uint32_t tag_count = std::min(header->jh_count, tags_per_block());
+      std::vector<pblock_t> tags;
+      for (uint32_t k = 0; k < tag_count; k++)
+        tags.push_back(tag_at(header, k));
+      if (header->jh_type == JOURNAL_REVOKE_BLOCK) {
+        revokes.insert(revokes.end(), tags.begin(), tags.end());
+      } else if (header->jh_type == JOURNAL_DESC_BLOCK) {
+        std::vector<pblock_t> desc_tags(tags);
+        for (auto pblock : desc_tags) {
+          std::vector<std::byte> image(block_size_);
+          read_ring(image.data(), pos, 1);
+          checksum = journal_checksum(checksum, image.data(), block_size_);
+          count++;
+          pos = (pos + 1) % ring_size();
+          blocks.emplace_back(pblock, std::move(image));
+        }
+      } else {
+        break;
+      }
+    }
+
+    if (!complete)
+      break;
+
+    for (auto pblock : revokes)
+      images.erase(pblock);
+    for (auto &[pblock, image] : blocks)
+      images[pblock] = std::move(image);
+    head_ = pos;
+    next_seq_++;
+    replayed++;
+  }
+  return true;
+}
+
+void JournalManager::recover() {
+  std::map<pblock_t, std::vector<std::byte>> images;
+  uint32_t replayed;
+  if (!scan(images, replayed))
+    return;
+
+  if (!images.empty()) {
+    BlockIoBatch batch(block_size_);
+    for (auto &[pblock, image] : images)
+      batch.add(pblock, image.data(), block_size_);
+    batch.write();
+  }
+  LOG(INFO) << "Journal replayed " << replayed << " transactions, "
+            << images.size() << " blocks";
+
+  // everything is at home now, empty the journal
+  start_ = head_;
+  first_seq_ = next_seq_;
+  tag_bytes_ = sizeof(pblock_t);
+  GET_INSTANCE(DiskManager).disk_sync();
+  write_super();
+  GET_INSTANCE(DiskManager).disk_sync();
+}
+
+// allocate a contiguous ssd run for the journal at the first mount
+void JournalManager::create() {
+  std::vector<pblock_t> pblock_vec;
+  GET_INSTANCE(MetaDataManager)
+      .alloc_new_ssd_pblocks(JOURNAL_DEFAULT_BLOCKS, pblock_vec);
+  for (uint32_t i = 1; i < pblock_vec.size(); i++) {
+    if (pblock_vec[i] != pblock_vec[0] + i) {
+      LOG(FATAL) << "No contiguous space for the journal!";
+    }
+  }
+
+  journal_pblock_ = pblock_vec[0];
+  journal_blocks_ = JOURNAL_DEFAULT_BLOCKS;
+  start_ = head_ = 0;
+  first_seq_ = next_seq_ = 1;
+
+  // no stale header may follow the super block
+  std::vector<std::byte> zero(block_size_);
+  write_ring(zero.data(), 0, 1);
+  write_super();
+  GET_INSTANCE(MetaDataManager)
+      .set_journal_location(journal_pblock_, journal_blocks_);
+  GET_INSTANCE(DiskManager).disk_sync();
+  LOG(INFO) << "Create journal at #" << journal_pblock_ << " with "
+            << journal_blocks_ << " blocks";
+}
+
+void JournalManager::start() {
+  if (!enabled_)
+    return;
+
+  block_size_ = GET_INSTANCE(MetaDataManager).block_size();
+  if (journal_pblock_ == 0)
+    create();
+
+  active_ = true;
+  stop_ = false;
+  commit_thread_ = std::thread(&JournalManager::commit_thread, this);
+}
+
+void JournalManager::shutdown() {
+  if (!active_)
+    return;
+
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  commit_cv_.notify_all();
+  commit_thread_.join();
+
+  // the second commit covers the blocks freed by the first one
+  do_commit(false);
+  do_commit(false);
+  do_commit(true);
+  active_ = false;
+}
+
+void JournalManager::commit_thread() {
+  std::unique_lock lock(mutex_);
+  while (!stop_) {
+    commit_cv_.wait_for(lock, JOURNAL_COMMIT_INTERVAL, [&] {
+      return stop_ || running_.size() > ring_size() / 4;
+    });
+    if (stop_)
+      break;
+
+    lock.unlock();
+    do_commit(false);
+    lock.lock();
+  }
+}
+
+bool JournalManager::needs_recovery() {
+  std::map<pblock_t, std::vector<std::byte>> images;
+  uint32_t replayed;
+  return scan(images, replayed) && replayed > 0;
+}
+
+void JournalManager::commit() { do_commit(false); }
+
+void JournalManager::commit_if_large() {
+  assert(handle_depth == 0);
+  if (!active())
+    return;
+  {
+    std::lock_guard lock(mutex_);
+    if (running_.size() <= ring_size() / 4)
+      return;
+  }
+  do_commit(false);
+}
+
+void JournalManager::do_commit(bool force_checkpoint) {
+  std::lock_guard commit_lock(commit_mutex_);
+
+  Transaction txn;
+  {
+    // wait for the operations in flight and hold off new ones
+    std::unique_lock txn_lock(txn_mutex_);
+    std::lock_guard lock(mutex_);
+
+    uint32_t needed = transaction_blocks(running_.size(), revoked_.size());
+    if (needed >= ring_size()) {
+      LOG(FATAL) << "Journal transaction too large: " << needed << " blocks";
+    }
+    if (force_checkpoint || used_blocks() > ring_size() / 2 ||
+        needed >= ring_size() - used_blocks()) {
+      checkpoint_locked();
+    }
+
+    txn.seq = next_seq_;
+    for (auto pblock : running_) {
+      Image image(new std::byte[block_size_]);
+      memcpy(image.get(), overlay_.at(pblock).get(), block_size_);
+      txn.blocks.emplace_back(pblock, std::move(image));
+    }
+    running_.clear();
+    txn.revokes.swap(revoked_);
+    txn.frees.swap(deferred_free_);
+    txn.frag_frees.swap(deferred_frag_free_);
+    if (!txn.blocks.empty() || !txn.revokes.empty())
+      next_seq_++;
+  }
+
+  // ordered mode: the data reaches the disk before the metadata pointing at it
+  GET_INSTANCE(DiskManager).disk_sync();
+
+  if (!txn.blocks.empty() || !txn.revokes.empty()) {
+    write_transaction(txn);
+    GET_INSTANCE(DiskManager).disk_sync();
+
+    std::lock_guard lock(mutex_);
+    for (auto &[pblock, image] : txn.blocks)
+      checkpoint_[pblock] = std::move(image);
+  }
+
+  // nothing committed refers to these blocks any more
+  if (!txn.frees.empty() || !txn.frag_frees.empty()) {
+    Handle handle;
+    GET_INSTANCE(MetaDataManager).free_pblock_now(txn.frees);
+    // a packed block left empty is freed with the next transaction
+    for (auto &run : txn.frag_frees)
+      GET_INSTANCE(FragmentManager).free_now(run.pblock, run.start, run.count);
+  }
+}
+
+void JournalManager::write_transaction(Transaction &txn) {
+  std::sort(txn.blocks.begin(), txn.blocks.end(),
+            [](const auto &a, const auto &b) { return a.first < b.first; });
+
+  uint32_t nblocks = transaction_blocks(txn.blocks.size(), txn.revokes.size());
+  std::vector<std::byte> buf((size_t)nblocks * block_size_);
+  uint32_t tags = tags_per_block();
+  uint32_t idx = 0;
+
+  auto add_header = [&](uint32_t type, uint32_t count) {
+    journal_header *header = (journal_header *)&buf[(size_t)idx * block_size_];
+    header->jh_magic = JOURNAL_MAGIC;
+    header->jh_type = type;
+    header->jh_seq = txn.seq;
+    header->jh_count = count;
+    return (pblock_t *)(header + 1);
+  };
+
+  for (size_t i = 0; i < txn.revokes.size(); i += tags) {
+    uint32_t n = std::min(txn.revokes.size() - i, (size_t)tags);
+    pblock_t *tag = add_header(JOURNAL_REVOKE_BLOCK, n);
+    memcpy(tag, &txn.revokes[i], n * sizeof(pblock_t));
+    idx++;
+  }
+
+  for (size_t i = 0; i < txn.blocks.size(); i += tags) {
+    uint32_t n = std::min(txn.blocks.size() - i, (size_t)tags);
+    pblock_t *tag = add_header(JOURNAL_DESC_BLOCK, n);
+    for (uint32_t j = 0; j < n; j++)
+      tag[j] = txn.blocks[i + j].first;
+    idx++;
+
+    for (uint32_t j = 0; j < n; j++) {
+      memcpy(&buf[(size_t)idx * block_size_], txn.blocks[i + j].second.get(),
+             block_size_);
+      idx++;
+    }
+  }
+
+  journal_commit *jc = (journal_commit *)&buf[(size_t)idx * block_size_];
+  add_header(JOURNAL_COMMIT_BLOCK, idx);
+  jc->jc_checksum =
+      journal_checksum(0, buf.data(), (size_t)idx * block_size_);
+  idx++;
+  assert(idx == nblocks);
+
+  write_ring(buf.data(), head_, nblocks);
+  head_ = (head_ + nblocks) % ring_size();
+  LOG(INFO) << "Commit transaction #" << txn.seq << ": "
+            << txn.blocks.size() << " blocks, " << txn.revokes.size()
+            << " revokes";
+}
+
+// write the committed images home and empty the journal
+void JournalManager::checkpoint_locked() {
+  if (!checkpoint_.empty()) {
+    std::vector<pblock_t> pblock_vec;
+    for (auto &entry : checkpoint_)
+      pblock_vec.push_back(entry.first);
+    std::sort(pblock_vec.begin(), pblock_vec.end());
+
+    BlockIoBatch batch(block_size_);
+    for (auto pblock : pblock_vec)
+      batch.add(pblock, checkpoint_.at(pblock).get(), block_size_);
+    batch.write();
+    GET_INSTANCE(DiskManager).disk_sync();
+
+    // the disk is up to date unless the running transaction changed it
+    for (auto pblock : pblock_vec) {
+      if (running_.count(pblock) == 0)
+        overlay_.erase(pblock);
+    }
+    LOG(INFO) << "Checkpoint " << pblock_vec.size() << " blocks";
+  }
+  checkpoint_.clear();
+
+  start_ = head_;
+  first_seq_ = next_seq_;
+  write_super();
+  GET_INSTANCE(DiskManager).disk_sync();
+}
+
+std::byte *JournalManager::get_image_locked(pblock_t pblock) {
+  auto it = overlay_.find(pblock);
+  if (it == overlay_.end()) {
+    Image image(new std::byte[block_size_]);
+    GET_INSTANCE(DiskManager).disk_block_read(image.get(), pblock);
+    it = overlay_.emplace(pblock, std::move(image)).first;
+  }
+  return it->second.get();
+}
+
+ssize_t JournalManager::read(void *buf, size_t nbyte, pblock_t pblock,
+                             off_t pblock_offset) {
+  std::byte *dst = (std::byte *)buf;
+  uint64_t offset = pblock_offset;
+  size_t done = 0;
+  while (done < nbyte) {
+    pblock_t cur = pblock + offset / block_size_;
+    uint32_t block_offset = offset % block_size_;
+    size_t bytes = std::min(nbyte - done, (size_t)(block_size_ - block_offset));
+
+    bool hit = false;
+    {
+      std::lock_guard lock(mutex_);
+      auto it = overlay_.find(cur);
+      if (it != overlay_.end()) {
+        memcpy(dst + done, it->second.get() + block_offset, bytes);
+        hit = true;
+      }
+    }
+    if (!hit)
+      GET_INSTANCE(DiskManager).disk_read(dst + done, bytes, cur, block_offset);
+
+    done += bytes;
+    offset += bytes;
+  }
+  return nbyte;
+}
+
+ssize_t JournalManager::write(const void *buf, size_t nbyte, pblock_t pblock,
+                              off_t pblock_offset) {
+  const std::byte *src = (const std::byte *)buf;
+  uint64_t offset = pblock_offset;
+  size_t done = 0;
+  bool wake = false;
+  {
+    std::lock_guard lock(mutex_);
+    while (done < nbyte) {
+      pblock_t cur = pblock + offset / block_size_;
+      uint32_t block_offset = offset % block_size_;
+      size_t bytes =
+          std::min(nbyte - done, (size_t)(block_size_ - block_offset));
+
+      memcpy(get_image_locked(cur) + block_offset, src + done, bytes);
+      running_.insert(cur);
+
+      done += bytes;
+      offset += bytes;
+    }
+    wake = running_.size() > ring_size() / 4;
+  }
+
+  if (wake)
+    commit_cv_.notify_one();
+  return nbyte;
+}
+
+ssize_t JournalManager::readv(const std::vector<iovec> &iov, pblock_t pblock) {
+  ssize_t ret = 0;
+  for (auto &vec : iov) {
+    read(vec.iov_base, vec.iov_len, pblock, ret);
+    ret += vec.iov_len;
+  }
+  return ret;
+}
+
+ssize_t JournalManager::writev(const std::vector<iovec> &iov,
+                               pblock_t pblock) {
+  ssize_t ret = 0;
+  for (auto &vec : iov) {
+    write(vec.iov_base, vec.iov_len, pblock, ret);
+    ret += vec.iov_len;
+  }
+  return ret;
+}
+
+bool JournalManager::defer_free(const std::vector<pblock_t> &pblock_vec) {
+  if (!active_)
+    return false;
+
+  std::lock_guard lock(mutex_);
+  deferred_free_.insert(deferred_free_.end(), pblock_vec.begin(),
+                        pblock_vec.end());
+  return true;
+}
+
+bool JournalManager::defer_frag_free(pblock_t pblock, uint32_t start,
+                                     uint32_t count) {
+  if (!active_)
+    return false;
+
+  std::lock_guard lock(mutex_);
+  deferred_frag_free_.push_back({pblock, start, count});
+  return true;
+}
+
+void JournalManager::revoke(pblock_t pblock) {
+  if (!active_)
+    return;
+
+  std::lock_guard lock(mutex_);
+  overlay_.erase(pblock);
+  running_.erase(pblock);
+  checkpoint_.erase(pblock);
+  revoked_.push_back(pblock);
+}
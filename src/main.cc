@@ -1,15 +1,29 @@
 #include "ops.h"
+#include "MetaData.h"
 #include "common.h"
 #include "cxxopts.hpp"
+#include "defrag.h"
 #include "disk.h"
+#include "journal.h"
+#include "writeback.h"
 #include <err.h>
 #include <glog/logging.h>
 #include <iostream>
 #include <string>
+#include <vector>
 
 struct Fs {
-  std::string hdd_path;
-  std::string ssd_path;
+  std::vector<std::string> hdd_paths;
+  std::vector<std::string> ssd_paths;
+  bool delalloc;
+  bool direct_io;
+  bool mmap_metadata;
+  bool journal;
+  std::string fallocate_tier;
+  uint64_t defrag_rate;
+  uint32_t ssd_high_watermark;
+  uint32_t ssd_low_watermark;
+  uint32_t ssd_meta_reserve;
 } fs;
 
 static void print_usage(char *prog_name) {
@@ -24,8 +38,28 @@ static void print_usage(char *prog_name) {
 static cxxopts::ParseResult parse_options(int argc, char **argv) {
   cxxopts::Options opt_parser(argv[0]);
   opt_parser.add_options()("h,help", "Print help")(
-      "hdd_filename", "Filesystem hdd path", cxxopts::value<std::string>())(
-      "ssd_filename", "Filesystem ssd path", cxxopts::value<std::string>());
+      "hdd_filename", "Filesystem hdd path, repeat it to stripe over several hdds",
+      cxxopts::value<std::vector<std::string>>())(
+      "ssd_filename", "Filesystem ssd path, repeat it to spread over several ssds",
+      cxxopts::value<std::vector<std::string>>())(
+      "delalloc", "Delay block allocation until write back",
+      cxxopts::value<bool>()->default_value("false"))(
+      "direct_io", "Bypass the host page cache with O_DIRECT",
+      cxxopts::value<bool>()->default_value("false"))(
+      "mmap_metadata", "Access ssd metadata through a shared mapping",
+      cxxopts::value<bool>()->default_value("false"))(
+      "journal", "Write metadata through a write-ahead journal",
+      cxxopts::value<bool>()->default_value("false"))(
+      "fallocate_tier", "Tier of preallocated blocks: auto, ssd or hdd",
+      cxxopts::value<std::string>()->default_value("auto"))(
+      "defrag_rate", "Online defragmentation rate in MiB/s, 0 for unlimited",
+      cxxopts::value<uint64_t>()->default_value("32"))(
+      "ssd_high_watermark", "SSD usage in percent above which data goes to the hdd",
+      cxxopts::value<uint32_t>()->default_value("90"))(
+      "ssd_low_watermark", "SSD usage in percent the demoter brings the ssd down to",
+      cxxopts::value<uint32_t>()->default_value("80"))(
+      "ssd_meta_reserve", "Percent of the ssd kept for metadata",
+      cxxopts::value<uint32_t>()->default_value("2"));
   opt_parser.allow_unrecognised_options();
   auto options = opt_parser.parse(argc, argv);
 
@@ -38,10 +72,52 @@ static cxxopts::ParseResult parse_options(int argc, char **argv) {
   }
 
   // Set HDD SSD disk file
-  fs.hdd_path = options["hdd_filename"].as<std::string>();
-  fs.ssd_path = options["ssd_filename"].as<std::string>();
-  LOG(INFO) << "hdd_filename: " << fs.hdd_path << std::endl;
-  LOG(INFO) << "ssd_filename: " << fs.ssd_path << std::endl;
+  fs.hdd_paths = options["hdd_filename"].as<std::vector<std::string>>();
+  fs.ssd_paths = options["ssd_filename"].as<std::vector<std::string>>();
+  fs.delalloc = options["delalloc"].as<bool>();
+  fs.direct_io = options["direct_io"].as<bool>();
+  fs.mmap_metadata = options["mmap_metadata"].as<bool>();
+  fs.journal = options["journal"].as<bool>();
+  fs.fallocate_tier = options["fallocate_tier"].as<std::string>();
+  fs.defrag_rate = options["defrag_rate"].as<uint64_t>();
+  fs.ssd_high_watermark = options["ssd_high_watermark"].as<uint32_t>();
+  fs.ssd_low_watermark = options["ssd_low_watermark"].as<uint32_t>();
+  fs.ssd_meta_reserve = options["ssd_meta_reserve"].as<uint32_t>();
+  for (auto &hdd_path : fs.hdd_paths)
+    LOG(INFO) << "hdd_filename: " << hdd_path << std::endl;
+  for (auto &ssd_path : fs.ssd_paths)
+    LOG(INFO) << "ssd_filename: " << ssd_path << std::endl;
+  LOG(INFO) << "delalloc: " << fs.delalloc << std::endl;
+  LOG(INFO) << "direct_io: " << fs.direct_io << std::endl;
+  LOG(INFO) << "mmap_metadata: " << fs.mmap_metadata << std::endl;
+  LOG(INFO) << "journal: " << fs.journal << std::endl;
+  LOG(INFO) << "fallocate_tier: " << fs.fallocate_tier << std::endl;
+  LOG(INFO) << "defrag_rate: " << fs.defrag_rate << std::endl;
+  LOG(INFO) << "ssd_high_watermark: " << fs.ssd_high_watermark << std::endl;
+  LOG(INFO) << "ssd_low_watermark: " << fs.ssd_low_watermark << std::endl;
+  LOG(INFO) << "ssd_meta_reserve: " << fs.ssd_meta_reserve << std::endl;
+
+  // the mapping would bypass the journal
+  if (fs.journal && fs.mmap_metadata) {
+    LOG(FATAL) << "journal and mmap_metadata can not be used together";
+  }
+  // the mapping would miss the mirror and the stripes
+  if (fs.ssd_paths.size() > 1 && fs.mmap_metadata) {
+    LOG(FATAL) << "mmap_metadata needs a single ssd file";
+  }
+  // O_DIRECT I/O to the ssd file would bypass the mapped pages
+  if (fs.direct_io && fs.mmap_metadata) {
+    LOG(FATAL) << "direct_io and mmap_metadata can not be used together";
+  }
+  if (fs.fallocate_tier != "auto" && fs.fallocate_tier != "ssd" &&
+      fs.fallocate_tier != "hdd") {
+    LOG(FATAL) << "Invalid fallocate_tier: " << fs.fallocate_tier;
+  }
+  if (fs.ssd_low_watermark > fs.ssd_high_watermark ||
+      fs.ssd_high_watermark > 100 || fs.ssd_meta_reserve >= 100) {
+    LOG(FATAL) << "Invalid ssd watermarks: " << fs.ssd_low_watermark << ", "
+               << fs.ssd_high_watermark << ", reserve " << fs.ssd_meta_reserve;
+  }
 
   return options;
 }
@@ -52,11 +128,25 @@ static struct fuse_operations fs_ops = {
   .mkdir = fs_mkdir,
   .unlink = fs_unlink,
   .rmdir = fs_rmdir,
+  .truncate = fs_truncate,
   .open = fs_open,
   .read = fs_read,
   .write = fs_write,
+  .flush = fs_flush,
+  .release = fs_release,
+  .fsync = fs_fsync,
+  .setxattr = fs_setxattr,
+  .getxattr = fs_getxattr,
+  .listxattr = fs_listxattr,
+  .removexattr = fs_removexattr,
   .readdir = fs_readdir,
+  .fsyncdir = fs_fsyncdir,
   .init = fs_init,
+  .destroy = fs_destroy,
+  .ioctl = fs_ioctl,
+  .fallocate = fs_fallocate,
+  .copy_file_range = fs_copy_file_range,
+  .lseek = fs_lseek,
 };
 
 int main(int argc, char *argv[]) {
@@ -66,7 +156,18 @@ int main(int argc, char *argv[]) {
   auto options{parse_options(argc, argv)};
 
   // open disk file
-  GET_INSTANCE(DiskManager).disk_open(fs.ssd_path, fs.hdd_path);
+  GET_INSTANCE(DiskManager).disk_open(fs.ssd_paths, fs.hdd_paths, fs.direct_io);
+  GET_INSTANCE(DiskManager).set_metadata_mmap(fs.mmap_metadata);
+  GET_INSTANCE(WriteBackManager).set_enabled(fs.delalloc);
+  GET_INSTANCE(JournalManager).set_enabled(fs.journal);
+  if (fs.fallocate_tier == "ssd")
+    GET_INSTANCE(MetaDataManager).set_fallocate_tier(Tier::SSD);
+  else if (fs.fallocate_tier == "hdd")
+    GET_INSTANCE(MetaDataManager).set_fallocate_tier(Tier::HDD);
+  GET_INSTANCE(DefragManager).set_rate(fs.defrag_rate << 20);
+  GET_INSTANCE(MetaDataManager)
+      .set_ssd_watermarks(fs.ssd_high_watermark, fs.ssd_low_watermark,
+                          fs.ssd_meta_reserve);
 
   // Initialize fuse argument
   fuse_args args = FUSE_ARGS_INIT(0, nullptr);
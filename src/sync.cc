@@ -0,0 +1,42 @@
+#include "sync.h"
+#include "common.h"
+#include "disk.h"
+#include "journal.h"
+#include <glog/logging.h>
+
+SyncManager &SyncManager::get_instance() {
+  static SyncManager instance;
+  return instance;
+}
+
+SyncManager::SyncManager() : requested_(0), completed_(0), flushing_(false) {}
+
+void SyncManager::sync() {
+  std::unique_lock lock(mutex_);
+  uint64_t ticket = ++requested_;
+
+  while (completed_ < ticket) {
+    if (flushing_) {
+      // a flush is running, it may have started before our ticket
+      cv_.wait(lock);
+      continue;
+    }
+
+    // become the leader of every ticket taken so far
+    flushing_ = true;
+    uint64_t batch = requested_;
+    lock.unlock();
+
+    LOG(INFO) << "Group commit tickets up to #" << batch;
+    if (GET_INSTANCE(JournalManager).active()) {
+      GET_INSTANCE(JournalManager).commit();
+    } else {
+      GET_INSTANCE(DiskManager).disk_sync();
+    }
+
+    lock.lock();
+    flushing_ = false;
+    completed_ = batch;
+    cv_.notify_all();
+  }
+}
@@ -0,0 +1,279 @@
+#include "writeback.h"
+#include "MetaData.h"
+#include "common.h"
+#include "defrag.h"
+#include "disk.h"
+#include "inode.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <glog/logging.h>
+#include <shared_mutex>
+#include <vector>
+
+// dirty data is written back, largest files first, above this much
+#define MAX_DIRTY_BYTES (64 << 20)
+
+WriteBackManager &WriteBackManager::get_instance() {
+  static WriteBackManager instance;
+  return instance;
+}
+
+void WriteBackManager::set_enabled(bool enabled) { enabled_ = enabled; }
+
+bool WriteBackManager::enabled() { return enabled_; }
+
+size_t WriteBackManager::write(uint32_t inode_idx, const char *buf,
+                               size_t size, off_t offset, Tier tier) {
+  std::unique_lock lock(mutex_);
+  // the inode is updated below, not while a write back updates it
+  wait_writeback(lock, inode_idx);
+  block_size_ = GET_INSTANCE(MetaDataManager).block_size();
+  if (tier == Tier::HDD)
+    streams_.insert(inode_idx);
+  else
+    streams_.erase(inode_idx);
+
+  ext4_inode inode;
+  GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
+
+  size_t ret = 0;
+  size_t un_offset = (size_t)offset;
+  while (ret < size) {
+    uint32_t lblock = un_offset / block_size_;
+    uint32_t block_offset = un_offset % block_size_;
+    size_t bytes = std::min(size - ret, (size_t)(block_size_ - block_offset));
+
+    std::byte *page = get_page(inode_idx, inode, lblock, bytes == block_size_);
+    memcpy(page + block_offset, buf, bytes);
+
+    ret += bytes;
+    buf += bytes;
+    un_offset += bytes;
+  }
+
+  uint64_t file_size = GET_INSTANCE(InodeManager).get_file_size(inode);
+  if ((uint64_t)offset + size > file_size) {
+    GET_INSTANCE(InodeManager).set_file_size(inode, (size_t)offset + size);
+    GET_INSTANCE(InodeManager).update_disk_inode(inode_idx, inode);
+  }
+
+  lock.unlock();
+  balance(inode_idx);
+  return ret;
+}
+
+bool WriteBackManager::read_page(uint32_t inode_idx, uint32_t lblock,
+                                 char *buf, size_t size, off_t offset) {
+  std::lock_guard lock(mutex_);
+  for (auto *inodes : {&dirty_inodes_, &writing_}) {
+    auto inode_it = inodes->find(inode_idx);
+    if (inode_it == inodes->end())
+      continue;
+
+    auto page_it = inode_it->second.find(lblock);
+    if (page_it == inode_it->second.end())
+      continue;
+
+    memcpy(buf, page_it->second.get() + offset, size);
+    return true;
+  }
+  return false;
+}
+
+bool WriteBackManager::is_dirty(uint32_t inode_idx, uint32_t lblock) {
+  std::lock_guard lock(mutex_);
+  for (auto *inodes : {&dirty_inodes_, &writing_}) {
+    auto inode_it = inodes->find(inode_idx);
+    if (inode_it != inodes->end() && inode_it->second.count(lblock) > 0)
+      return true;
+  }
+  return false;
+}
+
+bool WriteBackManager::has_dirty(uint32_t inode_idx) {
+  std::lock_guard lock(mutex_);
+  return dirty_inodes_.count(inode_idx) > 0 || writing_.count(inode_idx) > 0;
+}
+
+void WriteBackManager::flush(uint32_t inode_idx) {
+  std::unique_lock lock(mutex_);
+  flush_locked(lock, inode_idx);
+}
+
+void WriteBackManager::flush_all() {
+  std::unique_lock lock(mutex_);
+  while (!dirty_inodes_.empty()) {
+    flush_locked(lock, dirty_inodes_.begin()->first);
+  }
+}
+
+void WriteBackManager::drop(uint32_t inode_idx) {
+  std::unique_lock lock(mutex_);
+  wait_writeback(lock, inode_idx);
+  auto inode_it = dirty_inodes_.find(inode_idx);
+  if (inode_it == dirty_inodes_.end())
+    return;
+
+  dirty_bytes_ -= inode_it->second.size() * block_size_;
+  dirty_inodes_.erase(inode_it);
+  streams_.erase(inode_idx);
+}
+
+void WriteBackManager::punch(uint32_t inode_idx, uint64_t offset,
+                             uint64_t len) {
+  std::unique_lock lock(mutex_);
+  wait_writeback(lock, inode_idx);
+  auto inode_it = dirty_inodes_.find(inode_idx);
+  if (inode_it == dirty_inodes_.end())
+    return;
+
+  DirtyPages &pages = inode_it->second;
+  uint64_t end = offset + len;
+  auto page_it = pages.lower_bound(offset / block_size_);
+  while (page_it != pages.end() &&
+         (uint64_t)page_it->first * block_size_ < end) {
+    uint64_t page_begin = (uint64_t)page_it->first * block_size_;
+    uint64_t page_end = page_begin + block_size_;
+    if (offset <= page_begin && page_end <= end) {
+      page_it = pages.erase(page_it);
+      dirty_bytes_ -= block_size_;
+      continue;
+    }
+
+    uint64_t zero_begin = std::max(offset, page_begin);
+    uint64_t zero_end = std::min(end, page_end);
+    memset(page_it->second.get() + (zero_begin - page_begin), 0,
+           zero_end - zero_begin);
+    page_it++;
+  }
+
+  if (pages.empty())
+    dirty_inodes_.erase(inode_it);
+}
+
+// get the dirty page of lblock, fill in the on-disk content if the page is
+// only partially overwritten
+std::byte *WriteBackManager::get_page(uint32_t inode_idx,
+                                      const ext4_inode &inode, uint32_t lblock,
+                                      bool full_write) {
+  DirtyPages &pages = dirty_inodes_[inode_idx];
+  auto page_it = pages.find(lblock);
+  if (page_it != pages.end())
+    return page_it->second.get();
+
+  std::byte *page = new std::byte[block_size_];
+  pblock_t pblock = GET_INSTANCE(InodeManager).get_data_pblock(inode, lblock);
+  if (pblock != 0 && !full_write) {
+    GET_INSTANCE(DiskManager).disk_block_read(page, pblock);
+  } else {
+    memset(page, 0, block_size_);
+  }
+
+  pages.emplace(lblock, page);
+  dirty_bytes_ += block_size_;
+  return page;
+}
+
+void WriteBackManager::wait_writeback(std::unique_lock<std::mutex> &lock,
+                                      uint32_t inode_idx) {
+  written_.wait(lock, [&] { return writing_.count(inode_idx) == 0; });
+}
+
+// The pages are moved to writing_ and written back without mutex_, so the
+// other files can be written meanwhile.
+void WriteBackManager::flush_locked(std::unique_lock<std::mutex> &lock,
+                                    uint32_t inode_idx) {
+  wait_writeback(lock, inode_idx);
+  auto inode_it = dirty_inodes_.find(inode_idx);
+  if (inode_it == dirty_inodes_.end())
+    return;
+
+  DirtyPages &pages = writing_[inode_idx];
+  pages = std::move(inode_it->second);
+  dirty_inodes_.erase(inode_it);
+  dirty_bytes_ -= pages.size() * block_size_;
+  Tier tier = streams_.count(inode_idx) != 0 ? Tier::HDD : Tier::AUTO;
+  streams_.erase(inode_idx);
+  lock.unlock();
+
+  ext4_inode inode;
+  GET_INSTANCE(InodeManager).get_inode_by_idx(inode_idx, inode);
+  MetaDataManager::Goal goal(inode_idx);
+
+  // allocate blocks for the runs of consecutive pages together, so that the
+  // placement is decided with the whole run known
+  std::vector<uint32_t> lblock_vec;
+  for (auto &[lblock, page] : pages) {
+    lblock_vec.push_back(lblock);
+  }
+
+  BlockIoBatch batch(block_size_);
+  size_t i = 0;
+  while (i < lblock_vec.size()) {
+    size_t j = i + 1;
+    while (j < lblock_vec.size() && lblock_vec[j] == lblock_vec[j - 1] + 1)
+      j++;
+
+    std::vector<pblock_t> pblock_vec;
+    GET_INSTANCE(InodeManager).alloc_data_pblocks(inode, lblock_vec[i], j - i, tier);
+    GET_INSTANCE(InodeManager)
+        .get_data_pblocks(inode, lblock_vec[i], j - i, pblock_vec);
+    for (size_t k = i; k < j; k++) {
+      batch.add(pblock_vec[k - i], pages[lblock_vec[k]].get(), block_size_);
+    }
+    i = j;
+  }
+  batch.write();
+
+  GET_INSTANCE(InodeManager).update_disk_inode(inode_idx, inode);
+  LOG(INFO) << "Write back " << pages.size() << " pages of inode #"
+            << inode_idx;
+
+  lock.lock();
+  writing_.erase(inode_idx);
+  written_.notify_all();
+}
+
+// Files other than inode_idx are skipped while their lock is taken, by
+// defrag for one. Waiting for it here could deadlock with the lock held
+// on inode_idx.
+void WriteBackManager::balance(uint32_t inode_idx) {
+  std::shared_mutex &own_lock =
+      GET_INSTANCE(DefragManager).inode_lock(inode_idx);
+  std::unordered_set<uint32_t> busy;
+  while (true) {
+    uint32_t victim = 0;
+    {
+      std::lock_guard lock(mutex_);
+      if (dirty_bytes_ <= MAX_DIRTY_BYTES)
+        return;
+      size_t most = 0;
+      for (auto &[idx, pages] : dirty_inodes_) {
+        if (pages.size() > most && busy.count(idx) == 0) {
+          victim = idx;
+          most = pages.size();
+        }
+      }
+    }
+    if (victim == 0)
+      return;
+
+    // the locks are shared between inodes, the caller may hold it already
+    std::shared_mutex &victim_lock =
+        GET_INSTANCE(DefragManager).inode_lock(victim);
+    if (&victim_lock == &own_lock) {
+      flush(victim);
+      continue;
+    }
+    std::shared_lock lock(victim_lock, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      busy.insert(victim);
+      continue;
+    }
+    flush(victim);
+  }
+}
+
+WriteBackManager::WriteBackManager()
+    : enabled_(false), block_size_(0), dirty_bytes_(0) {}
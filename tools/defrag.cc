@@ -0,0 +1,33 @@
+#include "defrag.h"
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// Queue files of a mounted hybrid-fs for online defragmentation. The
+// filesystem moves them in the background and returns at once.
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cout << "Usage: " << argv[0] << " <file>..." << std::endl;
+    return 1;
+  }
+
+  int ret = 0;
+  for (int i = 1; i < argc; i++) {
+    int fd = open(argv[i], O_RDONLY);
+    if (fd < 0) {
+      std::cerr << argv[i] << ": " << strerror(errno) << std::endl;
+      ret = 1;
+      continue;
+    }
+
+    if (ioctl(fd, HYBRID_IOC_DEFRAG) < 0) {
+      std::cerr << argv[i] << ": " << strerror(errno) << std::endl;
+      ret = 1;
+    }
+    close(fd);
+  }
+  return ret;
+}
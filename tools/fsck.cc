@@ -0,0 +1,85 @@
+#include "MetaData.h"
+#include "common.h"
+#include "cxxopts.hpp"
+#include "disk.h"
+#include "fsck.h"
+#include "inode.h"
+#include "journal.h"
+#include <glog/logging.h>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// exit codes follow e2fsck
+#define FSCK_OK 0
+#define FSCK_NONDESTRUCT 1
+#define FSCK_UNCORRECTED 4
+
+int main(int argc, char *argv[]) {
+  google::InitGoogleLogging(argv[0]);
+
+  cxxopts::Options opt_parser(argv[0], "Hybrid-fs consistency checker");
+  opt_parser.add_options()("h,help", "Print help")(
+      "hdd_filename", "Filesystem hdd path, repeated for a striped hdd tier",
+      cxxopts::value<std::vector<std::string>>())(
+      "ssd_filename", "Filesystem ssd path, repeated for a striped ssd tier",
+      cxxopts::value<std::vector<std::string>>())(
+      "threads", "Number of checking threads",
+      cxxopts::value<uint32_t>()->default_value(
+          std::to_string(std::thread::hardware_concurrency())))(
+      "repair", "Write the rebuilt bitmaps and free counts back",
+      cxxopts::value<bool>()->default_value("false"));
+  auto options = opt_parser.parse(argc, argv);
+
+  if (options.count("help") || !options.count("hdd_filename") ||
+      !options.count("ssd_filename")) {
+    std::cout << opt_parser.help() << std::endl;
+    return options.count("help") ? FSCK_OK : FSCK_UNCORRECTED;
+  }
+
+  // without --repair nothing is written, the files are opened read-only
+  bool repair = options["repair"].as<bool>();
+  GET_INSTANCE(DiskManager)
+      .disk_open(options["ssd_filename"].as<std::vector<std::string>>(),
+                 options["hdd_filename"].as<std::vector<std::string>>(), false,
+                 !repair);
+
+  auto &meta = GET_INSTANCE(MetaDataManager);
+  meta.super_block_fill();
+  GET_INSTANCE(JournalManager).set_enabled(true);
+
+  // a layout conversion is left to the mount
+  if (GET_INSTANCE(DiskManager).ssd_count() != meta.ssd_device_count() ||
+      GET_INSTANCE(DiskManager).hdd_count() != meta.hdd_device_count()) {
+    std::cout << "The filesystem is spread over " << meta.ssd_device_count()
+              << " ssd and " << meta.hdd_device_count() << " hdd files, "
+              << GET_INSTANCE(DiskManager).ssd_count() << " and "
+              << GET_INSTANCE(DiskManager).hdd_count() << " given"
+              << std::endl;
+    return FSCK_UNCORRECTED;
+  }
+  meta.ssd_layout_init();
+
+  // the journal is only replayed by a repair
+  if (repair) {
+    GET_INSTANCE(JournalManager).recover();
+  } else if (GET_INSTANCE(JournalManager).needs_recovery()) {
+    std::cout << "The journal needs recovery, run with --repair or mount "
+                 "the filesystem first"
+              << std::endl;
+    return FSCK_UNCORRECTED;
+  }
+  meta.gdt_fill();
+
+  if (!meta.hdd_disk_load()) {
+    std::cout << "The hdd is not initialized" << std::endl;
+    return FSCK_UNCORRECTED;
+  }
+  GET_INSTANCE(InodeManager).load_layout();
+
+  FsChecker checker(options["threads"].as<uint32_t>(), repair);
+  if (checker.check() == 0)
+    return FSCK_OK;
+  return repair ? FSCK_NONDESTRUCT : FSCK_UNCORRECTED;
+}